@@ -24,14 +24,14 @@ void print_help(char *argv[])
 	printf("--lock/--unlock: temporarily suspend sending requests from coordinatool to workers\n");
 	printf("--lock-quit: suspend sending requests from coordinatool to workers, and exit\n");
 	printf("             coordinatool when all in-flight requests are done\n");
-	printf("--queue/-Q: queue active_requests from stdin\n");
+	printf("--queue/-Q: queue active_requests from stdin, sent in chunks as they are read\n");
 	printf("--recv/-R: (debug tool) ask for receiving work\n");
 	printf("           note the work will be reclaimed when client disconnects\n");
 	printf("--drain: (debug tool) recv and mark done everything one can get\n");
 	printf("--client-id/-I: force client name (useful to drain specific host)\n");
 	printf("--archive/-A: archive id (repeatable). Only makes sense for recv\n");
 	printf("--iters/-i: number of replies to expect (can be used to exit immediately after\n");
-	printf("            receiving work)\n");
+	printf("            receiving work). For queue, 0 means do not wait for replies\n");
 	printf("--fsname <name>: fsname for -Q, optionally used by coordinatool to avoid\n");
 	printf("                 sending to wrong server\n");
 	printf("--verbose/-v: Increase log level (can repeat)\n");
@@ -45,10 +45,64 @@ void print_version(void)
 	printf("Coordinatool client version %s\n", VERSION);
 }
 
+/* wait for queue replies until at most max_pending chunks are left */
+static int queue_wait_replies(struct client *client, int max_pending)
+{
+	struct active_requests_state *active_requests =
+		&client->active_requests;
+	int rc;
+
+	while (active_requests->chunks_pending > max_pending) {
+		rc = protocol_read_command(client->state.socket_fd, "server",
+					   NULL, protocol_cbs, NULL, client);
+		if (rc < 0)
+			return rc;
+	}
+	return 0;
+}
+
+/* send current hai_list and start a new one */
+static int queue_send_chunk(struct client *client)
+{
+	struct active_requests_state *active_requests =
+		&client->active_requests;
+	int count = json_array_size(active_requests->hai_list);
+	int rc;
+
+	if (count == 0)
+		return 0;
+
+	/* make room in window first */
+	rc = queue_wait_replies(client, QUEUE_WINDOW - 1);
+	if (rc < 0)
+		return rc;
+
+	/* takes ownership of hai_list */
+	rc = protocol_request_queue(&client->state, active_requests->hai_list);
+	active_requests->hai_list = json_array();
+	if (!active_requests->hai_list)
+		abort();
+	if (rc < 0)
+		return rc;
+
+	active_requests->sent_items += count;
+	/* -i 0: do not wait for replies (e.g. fuzzing with fake server) */
+	if (client->iters == 0)
+		return 0;
+
+	active_requests->chunk_items[(active_requests->chunk_first +
+				      active_requests->chunks_pending) %
+				     QUEUE_WINDOW] = count;
+	active_requests->chunks_pending++;
+	return 0;
+}
+
 int parse_hai_cb(struct hsm_action_item *hai, unsigned int archive_id,
 		 unsigned long flags, void *arg)
 {
-	struct active_requests_state *active_requests = arg;
+	struct client *client = arg;
+	struct active_requests_state *active_requests =
+		&client->active_requests;
 	json_t *json_hai = json_hsm_action_item(hai, archive_id, flags);
 
 	if (!json_hai) {
@@ -58,17 +112,48 @@ int parse_hai_cb(struct hsm_action_item *hai, unsigned int archive_id,
 
 	json_array_append_new(active_requests->hai_list, json_hai);
 
-#if 0
-	/* XXX send every 10000 items or so to avoid starving resources */
-	if (json_array_size(active_requests->hai_list) >= 10000) {
-		struct state *state = containers_of(active_requests...)
-		protocol_request_queue(state->socket_fd, active_requests);
-		protocol_read_command(state->socket_fd, NULL, protocol_cbs, state);
-	}
-#endif
+	/* do not build everything in memory: send as we go */
+	if (json_array_size(active_requests->hai_list) >= QUEUE_CHUNK_ITEMS)
+		return queue_send_chunk(client);
+
 	return 0;
 }
 
+static int client_run_queue(struct client *client)
+{
+	struct active_requests_state *active_requests =
+		&client->active_requests;
+	int rc;
+
+	client->state.fsname = active_requests->fsname;
+	active_requests->hai_list = json_array();
+	if (!active_requests->hai_list)
+		abort();
+
+	rc = parse_active_requests(0, parse_hai_cb, client);
+	if (rc < 0)
+		goto out;
+
+	rc = queue_send_chunk(client);
+	if (rc < 0)
+		goto out;
+
+	if (active_requests->sent_items == 0) {
+		LOG_DEBUG("Nothing to enqueue, exiting");
+		goto out;
+	}
+
+	rc = queue_wait_replies(client, 0);
+	if (rc < 0)
+		goto out;
+
+	printf("queue done: %d enqueued, %d skipped\n",
+	       active_requests->enqueued, active_requests->skipped);
+out:
+	json_decref(active_requests->hai_list);
+	return rc;
+}
+
 int client_run(struct client *client)
 {
 	int rc;
@@ -83,27 +168,8 @@ int client_run(struct client *client)
 		rc = protocol_request_status(state, state->config.verbose);
 		break;
 	case MODE_QUEUE:
-		client->active_requests.hai_list = json_array();
-		if (!client->active_requests.hai_list)
-			abort();
-		rc = parse_active_requests(0, parse_hai_cb,
-					   &client->active_requests);
-		if (rc < 0) {
-			json_decref(client->active_requests.hai_list);
-			return rc;
-		}
-		client->sent_items = rc;
-
-		if (json_array_size(client->active_requests.hai_list) == 0) {
-			LOG_DEBUG("Nothing to enqueue, exiting");
-			json_decref(client->active_requests.hai_list);
-			return 0;
-		}
-		/* takes ownership of hai_list */
-		state->fsname = client->active_requests.fsname;
-		rc = protocol_request_queue(state,
-					    client->active_requests.hai_list);
-		break;
+		/* replies are processed as chunks are sent */
+		return client_run_queue(client);
 	case MODE_LOCK:
 		rc = protocol_request_lock(state, client->locked);
 		break;
@@ -121,7 +187,7 @@ int client_run(struct client *client)
 
 	while (client->iters < 0 || client->iters-- > 0) {
 		rc = protocol_read_command(state->socket_fd, "server", NULL,
-					   protocol_cbs, client);
+					   protocol_cbs, NULL, client);
 		if (rc < 0)
 			return rc;
 	}
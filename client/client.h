@@ -16,9 +16,22 @@ enum client_mode {
 	MODE_LOCK,
 };
 
+/* queue requests are sent in chunks of that many items, with at most
+ * QUEUE_WINDOW chunks waiting for a reply at any time */
+#define QUEUE_CHUNK_ITEMS 10000
+#define QUEUE_WINDOW 4
+
 struct active_requests_state {
 	json_t *hai_list;
 	const char *fsname;
+	/* item count of chunks waiting for reply, in send order */
+	int chunk_items[QUEUE_WINDOW];
+	int chunk_first;
+	int chunks_pending;
+	/* totals */
+	int sent_items;
+	int enqueued;
+	int skipped;
 };
 
 struct client {
@@ -27,10 +40,7 @@ struct client {
 	enum client_mode mode;
 	union {
 		// queue
-		struct {
-			struct active_requests_state active_requests;
-			int sent_items;
-		};
+		struct active_requests_state active_requests;
 		// lock
 		enum protocol_lock locked;
 	};
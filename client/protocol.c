@@ -63,20 +63,41 @@ static int done_cb(void *fd_arg UNUSED, json_t *json, void *arg UNUSED)
 static int queue_cb(void *fd_arg UNUSED, json_t *json, void *arg)
 {
 	struct client *client = arg;
+	struct active_requests_state *active_requests =
+		&client->active_requests;
 
-	printf("Got queue reply:\n");
-	protocol_write(json, STDOUT_FILENO, "stdout", JSON_INDENT(2));
-	printf("\n");
+	if (llapi_msg_get_level() >= LLAPI_MSG_DEBUG) {
+		printf("Got queue reply:\n");
+		protocol_write(json, STDOUT_FILENO, "stdout", JSON_INDENT(2));
+		printf("\n");
+	}
+
+	if (active_requests->chunks_pending == 0) {
+		printf("unexpected queue reply\n");
+		return -EINVAL;
+	}
+	int expected = active_requests->chunk_items[active_requests->chunk_first];
+	active_requests->chunk_first =
+		(active_requests->chunk_first + 1) % QUEUE_WINDOW;
+	active_requests->chunks_pending--;
 
 	int status = protocol_getjson_int(json, "status", 0);
-	if (status)
+	if (status) {
+		printf("error queueing: %s\n",
+		       protocol_getjson_str(json, "error", "", NULL));
 		return -status;
+	}
 
 	int enqueued = protocol_getjson_int(json, "enqueued", 0);
 	int skipped = protocol_getjson_int(json, "skipped", 0);
-	if (client->sent_items != enqueued + skipped) {
+	active_requests->enqueued += enqueued;
+	active_requests->skipped += skipped;
+	printf("queue: %d enqueued, %d skipped (%d sent)\n",
+	       active_requests->enqueued, active_requests->skipped,
+	       active_requests->sent_items);
+	if (expected != enqueued + skipped) {
 		printf("didn't process all records (expected %d, got %d+%d)\n",
-		       client->sent_items, enqueued, skipped);
+		       expected, enqueued, skipped);
 		return -EINVAL;
 	}
 
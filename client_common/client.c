@@ -128,6 +128,18 @@ static int config_parse(struct ct_state_config *config, int fail_enoent)
 				 config->max_remove);
 			continue;
 		}
+		if (!strcasecmp(key, "max_inflight_bytes")) {
+			long long intval =
+				str_suffix_to_size(val, "max_inflight_bytes");
+			if (intval < 0) {
+				rc = intval;
+				goto out;
+			}
+			config->max_inflight_bytes = intval;
+			LOG_INFO("config setting max_inflight_bytes to %lu",
+				 config->max_inflight_bytes);
+			continue;
+		}
 		if (!strcasecmp(key, "hal_size")) {
 			long long intval = str_suffix_to_u32(val, "hal_size");
 			if (intval < 0) {
@@ -139,6 +151,18 @@ static int config_parse(struct ct_state_config *config, int fail_enoent)
 				 config->hsm_action_list_size);
 			continue;
 		}
+		if (!strcasecmp(key, "compress_threshold")) {
+			long long intval =
+				str_suffix_to_u32(val, "compress_threshold");
+			if (intval < 0) {
+				rc = intval;
+				goto out;
+			}
+			config->compress_threshold = intval;
+			LOG_INFO("config setting compress_threshold to %u",
+				 config->compress_threshold);
+			continue;
+		}
 		if (!strcasecmp(key, "verbose")) {
 			int intval = str_to_verbose(val);
 			if (intval < 0) {
@@ -153,12 +177,20 @@ static int config_parse(struct ct_state_config *config, int fail_enoent)
 		/* skip server only options */
 		if (!strcasecmp(key, "archive_id"))
 			continue;
+		if (!strcasecmp(key, "listen_unix"))
+			continue;
+		if (!strcasecmp(key, "listen_backlog"))
+			continue;
+		if (!strcasecmp(key, "ehlo_per_iteration"))
+			continue;
 		if (!strcasecmp(key, "redis_host"))
 			continue;
 		if (!strcasecmp(key, "redis_port"))
 			continue;
 		if (!strcasecmp(key, "client_grace_ms"))
 			continue;
+		if (!strcasecmp(key, "client_send_hwm"))
+			continue;
 		if (!strcasecmp(key, "archive_on_hosts"))
 			continue;
 		if (!strcasecmp(key, "archive_on_hosts_ch"))
@@ -173,6 +205,18 @@ static int config_parse(struct ct_state_config *config, int fail_enoent)
 			continue;
 		if (!strcasecmp(key, "reporting_schedule_interval_ms"))
 			continue;
+		if (!strcasecmp(key, "fair_share_hint"))
+			continue;
+		if (!strcasecmp(key, "fair_share_weight"))
+			continue;
+		if (!strcasecmp(key, "priority_hint"))
+			continue;
+		if (!strcasecmp(key, "priority_rule"))
+			continue;
+		if (!strcasecmp(key, "priority_aging_sec"))
+			continue;
+		if (!strcasecmp(key, "size_from_stat"))
+			continue;
 
 		LOG_WARN(-EINVAL, "skipping unknown key %s in %s (line %zd)",
 			 key, config->confpath, linenum);
@@ -200,6 +244,7 @@ int ct_config_init(struct ct_state_config *config)
 	config->max_archive = -1;
 	config->max_remove = -1;
 	config->hsm_action_list_size = 1024 * 1024;
+	config->compress_threshold = 64 * 1024;
 	config->verbose = LLAPI_MSG_NORMAL;
 	llapi_msg_set_level(config->verbose);
 
@@ -235,6 +280,10 @@ int ct_config_init(struct ct_state_config *config)
 	if (rc < 0)
 		return rc;
 	rc = getenv_u32("COORDINATOOL_HAL_SIZE", &config->hsm_action_list_size);
+	if (rc < 0)
+		return rc;
+	rc = getenv_size("COORDINATOOL_MAX_INFLIGHT_BYTES",
+			 &config->max_inflight_bytes);
 	if (rc < 0)
 		return rc;
 	rc = getenv_verbose("COORDINATOOL_VERBOSE", &config->verbose);
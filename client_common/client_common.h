@@ -18,12 +18,24 @@ struct ct_state {
 		uint32_t max_restore;
 		uint32_t max_remove;
 		uint32_t hsm_action_list_size;
+		uint64_t max_inflight_bytes;
+		uint32_t compress_threshold;
 		enum llapi_message_level verbose;
 	} config;
 	// state values
 	int socket_fd;
 	const char *fsname;
 	json_t *archive_ids;
+	/* request binary protocol in ehlo, callers must handle binary
+	 * replies */
+	bool binary_capable;
+	/* binary protocol negotiated with server */
+	bool binary;
+	/* compression negotiated with server, kept on reconnect so ehlo
+	 * with running actions can be compressed */
+	bool compress;
+	/* server accepts DONE with a list of items */
+	bool done_list;
 };
 
 /* client.c */
@@ -48,6 +60,14 @@ int protocol_request_status(const struct ct_state *state, int verbose);
 int protocol_request_recv(const struct ct_state *state);
 int protocol_request_done(const struct ct_state *state, uint64_t cookie,
 			  struct lu_fid *dfid, int status);
+/* acknowledge multiple actions with a single request and reply */
+struct protocol_done_item {
+	uint64_t cookie;
+	struct lu_fid dfid;
+	int status;
+};
+int protocol_request_done_list(const struct ct_state *state,
+			       struct protocol_done_item *items, size_t count);
 int protocol_request_queue(const struct ct_state *state, json_t *hai_list);
 int protocol_request_ehlo(const struct ct_state *state, json_t *hai_list);
 int protocol_request_lock(const struct ct_state *state,
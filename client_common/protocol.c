@@ -5,6 +5,12 @@
 #include "client_common.h"
 #include "utils.h"
 
+/* only compress if server told us it can read it */
+static size_t compress_threshold(const struct ct_state *state)
+{
+	return state->compress ? state->config.compress_threshold : 0;
+}
+
 int protocol_checkerror(json_t *reply)
 {
 	int rc = protocol_getjson_int(reply, "status", 0);
@@ -87,6 +93,11 @@ int protocol_request_recv(const struct ct_state *state)
 		LOG_ERROR(rc, "Could not pack recv request");
 		return rc;
 	}
+	/* only sent if set, older servers do not know it */
+	rc = protocol_setjson_int(request, "max_inflight_bytes",
+				  state->config.max_inflight_bytes);
+	if (rc)
+		goto out_free;
 	LOG_INFO("Sending recv request to %d", state->socket_fd);
 	if (protocol_write(request, state->socket_fd, "recv", 0)) {
 		rc = -EIO;
@@ -99,22 +110,94 @@ out_free:
 	return rc;
 }
 
-int protocol_request_done(const struct ct_state *state, uint64_t cookie,
-			  struct lu_fid *dfid, int status)
+static int protocol_request_done_bin(const struct ct_state *state,
+				     struct protocol_done_item *items,
+				     size_t count)
 {
-	json_t *request;
+	struct protocol_bin_buf bin = { 0 };
+	size_t i;
+	int rc;
+
+	protocol_bin_init(&bin, DONE);
+	protocol_bin_put_u32(&bin, count);
+	for (i = 0; i < count; i++)
+		protocol_bin_put_done(&bin, items[i].cookie, &items[i].dfid,
+				      items[i].status);
+	protocol_bin_finish(&bin);
+
+	LOG_INFO("Sending done request (%zu items) to %d", count,
+		 state->socket_fd);
+	rc = write_full(state->socket_fd, bin.data, bin.len);
+	if (rc) {
+		rc = -EIO;
+		LOG_ERROR(rc, "Could not write done request");
+	}
+
+	protocol_bin_free(&bin);
+	return rc;
+}
+
+static json_t *done_item_json(struct protocol_done_item *item)
+{
+	return json_pack("{sI,so,si}", "hai_cookie", item->cookie, "hai_dfid",
+			 json_fid(&item->dfid), "status", item->status);
+}
+
+int protocol_request_done_list(const struct ct_state *state,
+			       struct protocol_done_item *items, size_t count)
+{
+	json_t *request, *list;
+	size_t i;
 	int rc = 0;
 
-	request = json_pack("{ss,si,so,si}", "command", "done", "hai_cookie",
-			    cookie, "hai_dfid", json_fid(dfid), "status",
-			    status);
-	if (!request) {
-		rc = -ENOMEM;
-		LOG_ERROR(rc, "Could not pack recv request");
-		return rc;
+	if (count == 0)
+		return 0;
+
+	if (state->binary)
+		return protocol_request_done_bin(state, items, count);
+
+	/* older servers do not know about lists, one request per item */
+	if (count > 1 && !state->done_list) {
+		for (i = 0; i < count; i++) {
+			rc = protocol_request_done_list(state, &items[i], 1);
+			if (rc)
+				return rc;
+		}
+		return 0;
 	}
-	LOG_INFO("Sending done request to %d", state->socket_fd);
-	if (protocol_write(request, state->socket_fd, "done", 0)) {
+
+	/* single item uses the old format so older servers understand it */
+	if (count == 1) {
+		request = done_item_json(items);
+		if (!request) {
+			rc = -ENOMEM;
+			LOG_ERROR(rc, "Could not pack done request");
+			return rc;
+		}
+	} else {
+		request = json_object();
+		list = json_array();
+		if (!request || !list)
+			abort();
+		for (i = 0; i < count; i++) {
+			json_t *item = done_item_json(&items[i]);
+			if (!item)
+				abort();
+			if ((rc = protocol_setjson_array_append(list, item))) {
+				json_decref(list);
+				goto out_free;
+			}
+		}
+		if ((rc = protocol_setjson(request, "list", list)))
+			goto out_free;
+	}
+	if ((rc = protocol_setjson_str(request, "command", "done")))
+		goto out_free;
+
+	LOG_INFO("Sending done request (%zu items) to %d", count,
+		 state->socket_fd);
+	if (protocol_write_compressed(request, state->socket_fd, "done", 0,
+				      compress_threshold(state))) {
 		rc = -EIO;
 		LOG_ERROR(rc, "Could not write done request");
 		goto out_free;
@@ -125,6 +208,18 @@ out_free:
 	return rc;
 }
 
+int protocol_request_done(const struct ct_state *state, uint64_t cookie,
+			  struct lu_fid *dfid, int status)
+{
+	struct protocol_done_item item = {
+		.cookie = cookie,
+		.dfid = *dfid,
+		.status = status,
+	};
+
+	return protocol_request_done_list(state, &item, 1);
+}
+
 int protocol_request_queue(const struct ct_state *state, json_t *hai_list)
 {
 	int rc;
@@ -144,7 +239,8 @@ int protocol_request_queue(const struct ct_state *state, json_t *hai_list)
 		goto out_free;
 
 	LOG_INFO("Sending queue request to %d", state->socket_fd);
-	if (protocol_write(request, state->socket_fd, "queue", 0)) {
+	if (protocol_write_compressed(request, state->socket_fd, "queue", 0,
+				      compress_threshold(state))) {
 		rc = -EIO;
 		LOG_ERROR(rc, "Could not write queue request");
 		goto out_free;
@@ -182,8 +278,15 @@ int protocol_request_ehlo(const struct ct_state *state, json_t *hai_list)
 	    (rc = protocol_setjson_str(request, "id", state->config.client_id)))
 		goto out_free;
 
+	if ((rc = protocol_setjson_bool(request, "binary",
+					state->binary_capable)) ||
+	    (rc = protocol_setjson_bool(request, "compress",
+					state->config.compress_threshold != 0)))
+		goto out_free;
+
 	LOG_INFO("Sending elho request to %d", state->socket_fd);
-	if (protocol_write(request, state->socket_fd, "ehlo", 0)) {
+	if (protocol_write_compressed(request, state->socket_fd, "ehlo", 0,
+				      compress_threshold(state))) {
 		rc = -EIO;
 		LOG_ERROR(rc, "Could not write ehlo request");
 		goto out_free;
@@ -218,9 +321,27 @@ out_free:
 	return rc;
 }
 
-static int ehlo_cb(void *fd_arg UNUSED, json_t *json, void *arg UNUSED)
+static int ehlo_cb(void *fd_arg UNUSED, json_t *json, void *arg)
 {
-	return protocol_checkerror(json);
+	struct ct_state *state = arg;
+	int rc;
+
+	rc = protocol_checkerror(json);
+	if (rc)
+		return rc;
+
+	/* older servers do not know about binary and won't reply it */
+	state->binary = state->binary_capable &&
+			protocol_getjson_bool(json, "binary", false);
+	if (state->binary)
+		LOG_INFO("Using binary protocol");
+	state->compress = state->config.compress_threshold != 0 &&
+			  protocol_getjson_bool(json, "compress", false);
+	if (state->compress)
+		LOG_INFO("Using compression above %u bytes",
+			 state->config.compress_threshold);
+	state->done_list = protocol_getjson_bool(json, "done_list", false);
+	return 0;
 }
 
 protocol_read_cb protocol_ehlo_cbs[PROTOCOL_COMMANDS_MAX] = {
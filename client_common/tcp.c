@@ -1,10 +1,34 @@
 /* SPDX-License-Identifier: LGPL-3.0-or-later */
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 
 #include "client_common.h"
 
+#define UNIX_HOST_PREFIX "unix:"
+
+static int unix_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sfd, rc;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd < 0)
+		return -errno;
+
+	if (connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		rc = -errno;
+		close(sfd);
+		return rc;
+	}
+	return sfd;
+}
+
 int tcp_connect(struct ct_state *state, json_t *hai_list)
 {
 	struct addrinfo hints;
@@ -17,6 +41,26 @@ again:
 		close(state->socket_fd);
 		state->socket_fd = -1;
 	}
+
+	/* local server: skip tcp altogether, port is ignored */
+	if (!strncmp(state->config.host, UNIX_HOST_PREFIX,
+		     strlen(UNIX_HOST_PREFIX))) {
+		sfd = unix_connect(state->config.host +
+				   strlen(UNIX_HOST_PREFIX));
+		if (sfd == -ENAMETOOLONG) {
+			LOG_ERROR(sfd, "unix socket path %s too long",
+				  state->config.host);
+			return sfd;
+		}
+		if (sfd < 0) {
+			LOG_WARN(sfd, "Could not connect to %s. Retrying.",
+				 state->config.host);
+			sleep(5);
+			goto again;
+		}
+		goto connected;
+	}
+
 	memset(&hints, 0, sizeof(struct addrinfo));
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
@@ -57,9 +101,12 @@ again:
 		sleep(5);
 		goto again;
 	}
+connected:
 	LOG_INFO("Connected to %s", state->config.host);
 
 	state->socket_fd = sfd;
+	state->binary = false;
+	state->done_list = false;
 
 	rc = protocol_request_ehlo(state, hai_list);
 	if (rc) {
@@ -70,7 +117,13 @@ again:
 		goto again;
 	}
 	rc = protocol_read_command(state->socket_fd, "server", NULL,
-				   protocol_ehlo_cbs, state);
+				   protocol_ehlo_cbs, NULL, state);
+	if (rc && state->compress) {
+		/* server might no longer understand compression */
+		LOG_WARN(rc, "ehlo failed, retrying without compression");
+		state->compress = false;
+		goto again;
+	}
 	if (rc) {
 		LOG_WARN(
 			rc,
@@ -18,18 +18,23 @@ int getenv_str(const char *name, const char **val)
 	return 1;
 }
 
-long long str_suffix_to_u32(const char *str, const char *error_hint)
+static long long str_suffix_to_max(const char *str, const char *error_hint,
+				   long long max)
 {
 	char *endptr;
 
 	long long val = strtoll(str, &endptr, 0);
-	long multiplier = 1;
+	long long multiplier = 1;
 
 	if (!endptr)
 		abort();
 	switch (*endptr) {
 	case 0:
 		break;
+	case 't':
+	case 'T':
+		multiplier *= 1024;
+		// fallthrough
 	case 'g':
 	case 'G':
 		multiplier *= 1024;
@@ -56,9 +61,9 @@ long long str_suffix_to_u32(const char *str, const char *error_hint)
 
 	/* allow -1 as max */
 	if (val == -1)
-		return UINT32_MAX;
+		return max;
 
-	if (val > UINT32_MAX / multiplier || val < 0) {
+	if (val > max / multiplier || val < 0) {
 		LOG_ERROR(-EINVAL, "%s was set to %s, which would overflow",
 			  error_hint, str);
 		return -EINVAL;
@@ -66,6 +71,16 @@ long long str_suffix_to_u32(const char *str, const char *error_hint)
 	return val * multiplier;
 }
 
+long long str_suffix_to_u32(const char *str, const char *error_hint)
+{
+	return str_suffix_to_max(str, error_hint, UINT32_MAX);
+}
+
+long long str_suffix_to_size(const char *str, const char *error_hint)
+{
+	return str_suffix_to_max(str, error_hint, LLONG_MAX);
+}
+
 int getenv_u32(const char *name, uint32_t *val)
 {
 	const char *env = getenv(name);
@@ -81,6 +96,21 @@ int getenv_u32(const char *name, uint32_t *val)
 	return 1;
 }
 
+int getenv_size(const char *name, uint64_t *val)
+{
+	const char *env = getenv(name);
+	if (!env)
+		return 0;
+
+	long long envval = str_suffix_to_size(env, name);
+	if (envval < 0)
+		return envval;
+
+	*val = envval;
+	LOG_INFO("env setting %s to %lu", name, *val);
+	return 1;
+}
+
 int getenv_int(const char *name, int *val)
 {
 	const char *env = getenv(name);
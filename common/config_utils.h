@@ -7,9 +7,12 @@
 
 int getenv_str(const char *name, const char **val);
 int getenv_u32(const char *name, uint32_t *val);
+int getenv_size(const char *name, uint64_t *val);
 int getenv_int(const char *name, int *val);
 int getenv_verbose(const char *name, enum llapi_message_level *val);
 enum llapi_message_level str_to_verbose(const char *str);
 long long str_suffix_to_u32(const char *str, const char *error_hint);
+/* same up to LLONG_MAX, also accepts T */
+long long str_suffix_to_size(const char *str, const char *error_hint);
 
 #endif
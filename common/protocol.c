@@ -1,8 +1,10 @@
 /* SPDX-License-Identifier: LGPL-3.0-or-later */
 
-#include <assert.h>
+#include <endian.h>
 #include <errno.h>
 #include <sys/param.h>
+#include <sys/uio.h>
+#include <zlib.h>
 
 #include "protocol.h"
 #include "logs.h"
@@ -56,80 +58,172 @@ const char *protocol_command2str(enum protocol_commands command)
 	}
 }
 
-struct load_cb_data {
-	int fd;
-	const char *id;
-	char *buffer;
-	int buflen;
-	int bufoff;
-	int bufread;
-	int position;
-};
+/* initial and max size of receive buffers. Buffers grow as needed to fit
+ * a whole message, so the max is a sanity limit for a single message. */
+#define PROTOCOL_READ_BUFFER_MIN (64 * 1024)
+#define PROTOCOL_READ_BUFFER_MAX (256 * 1024 * 1024)
 
-// XXX can hang reading from socket on partial json written,
-// but I don't see any way around this short of keeping a
-// large buffer around
-static size_t json_load_cb(void *buffer, size_t buflen, void *data)
+void protocol_read_buffer_free(struct protocol_read_buffer *rbuf)
 {
-	struct load_cb_data *cbdata = data;
+	free(rbuf->buf);
+	memset(rbuf, 0, sizeof(*rbuf));
+}
+
+/* make room for at least one more read at the end of buffer */
+static int read_buffer_reserve(struct protocol_read_buffer *rbuf,
+			       const char *id)
+{
+	/* drop consumed data first */
+	if (rbuf->off > 0) {
+		memmove(rbuf->buf, rbuf->buf + rbuf->off,
+			rbuf->len - rbuf->off);
+		rbuf->len -= rbuf->off;
+		rbuf->scan -= rbuf->off;
+		rbuf->off = 0;
+	}
+	if (rbuf->len < rbuf->size)
+		return 0;
+
+	if (rbuf->size >= PROTOCOL_READ_BUFFER_MAX) {
+		LOG_ERROR(-EMSGSIZE, "Message from %s too big (> %d bytes)", id,
+			  PROTOCOL_READ_BUFFER_MAX);
+		return -EMSGSIZE;
+	}
+	rbuf->size = rbuf->size ? rbuf->size * 2 : PROTOCOL_READ_BUFFER_MIN;
+	rbuf->buf = xrealloc(rbuf->buf, rbuf->size);
+	return 0;
+}
+
+/**
+ * read into buffer.
+ * if nonblock is set keep reading until EAGAIN, otherwise read once
+ *
+ * @return 0 on success, -errno on error, including -ECONNRESET on eof
+ */
+static int read_buffer_fill(int fd, const char *id,
+			    struct protocol_read_buffer *rbuf, bool nonblock)
+{
+	ssize_t n;
+	int rc;
+
+	while (true) {
+		rc = read_buffer_reserve(rbuf, id);
+		if (rc)
+			return rc;
 
-	if (cbdata->bufoff == cbdata->bufread) {
-		int n;
-		n = read(cbdata->fd, cbdata->buffer, cbdata->buflen);
+		n = read(fd, rbuf->buf + rbuf->len, rbuf->size - rbuf->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
 		if (n < 0) {
-			LOG_ERROR(-errno, "Read failed for %s", cbdata->id);
-			return (size_t)-1;
+			rc = -errno;
+			LOG_ERROR(rc, "Read failed for %s", id);
+			return rc;
+		}
+		if (n == 0) {
+			/* eof: readers will close on any error */
+			if (rbuf->len != rbuf->off)
+				LOG_WARN(-EPIPE,
+					 "%s closed connection with %zu bytes of partial message",
+					 id, rbuf->len - rbuf->off);
+			return -ECONNRESET;
 		}
-		cbdata->bufread = n;
-		cbdata->bufoff = 0;
-		if (n == 0)
+		rbuf->len += n;
+		if (!nonblock)
 			return 0;
 	}
+}
 
-	size_t len = cbdata->bufread - cbdata->bufoff;
-	if (buflen > len)
-		buflen = len;
-	memcpy(buffer, cbdata->buffer + cbdata->bufoff, buflen);
-	cbdata->bufoff += buflen;
-	cbdata->position += buflen;
+/* binary messages have their length in header, no need to scan */
+static ssize_t read_buffer_frame_binary(struct protocol_read_buffer *rbuf,
+					const char *id)
+{
+	uint32_t len;
+
+	if (rbuf->len - rbuf->off < PROTOCOL_BINARY_HEADER_SIZE)
+		return 0;
+	memcpy(&len, rbuf->buf + rbuf->off + 4, sizeof(len));
+	len = le32toh(len);
+	if (len > PROTOCOL_READ_BUFFER_MAX - PROTOCOL_BINARY_HEADER_SIZE) {
+		LOG_ERROR(-EMSGSIZE, "Message from %s too big (%u bytes)", id,
+			  len);
+		return -EMSGSIZE;
+	}
+	if (rbuf->len - rbuf->off < PROTOCOL_BINARY_HEADER_SIZE + len)
+		return 0;
 
-	return buflen;
+	rbuf->scan = rbuf->off + PROTOCOL_BINARY_HEADER_SIZE + len;
+	return PROTOCOL_BINARY_HEADER_SIZE + len;
 }
 
-int protocol_read_command(int fd, const char *id, void *fd_arg,
-			  protocol_read_cb *cbs, void *cb_arg)
+/**
+ * look for the end of the first json object in buffer.
+ * This only tracks nesting and strings: actual validation is done by
+ * jansson once we know we have the whole object.
+ * Scanning state is kept in rbuf so we do not look at the same bytes
+ * twice when messages are split over multiple reads.
+ *
+ * @return length of complete message at rbuf->off, 0 if incomplete,
+ * -EINVAL if data cannot be a json object
+ */
+static ssize_t read_buffer_frame(struct protocol_read_buffer *rbuf,
+				 const char *id)
 {
-	json_t *request;
-	json_error_t json_error;
-	int rc = 0;
-	struct load_cb_data cbdata = {
-		.fd = fd,
-		.id = id,
-	};
-	cbdata.buffer = xmalloc(1024 * 1024);
-	cbdata.buflen = 1024 * 1024;
-
-again:
-	request = json_load_callback(json_load_cb, &cbdata,
-				     JSON_DISABLE_EOF_CHECK | JSON_ALLOW_NUL,
-				     &json_error);
-	if (!request) {
-		// XXX map json_error_code(error) (enum json_error_code) to errno ?
-		rc = -EINVAL;
-		/* cbdata.bufread = 0 means eof, readers will close on any error */
-		if (cbdata.bufread > 0)
-			LOG_ERROR(rc, "Invalid json while reading from %s: %s",
-				  id, json_error.text);
-		goto out_freebuf;
-	}
-	/* error's position is the exact offset jansson used, while our's is
-	 * what we wrote into jansson. This allows backtracking in buffer if
-	 * required
-	 */
-	if (json_error.position < cbdata.position) {
-		assert(cbdata.bufoff >= cbdata.position - json_error.position);
-		cbdata.bufoff -= cbdata.position - json_error.position;
+	for (; rbuf->scan < rbuf->len; rbuf->scan++) {
+		char c = rbuf->buf[rbuf->scan];
+
+		if (rbuf->in_string) {
+			if (rbuf->escape)
+				rbuf->escape = false;
+			else if (c == '\\')
+				rbuf->escape = true;
+			else if (c == '"')
+				rbuf->in_string = false;
+			continue;
+		}
+		if (rbuf->depth == 0) {
+			/* skip whitespace between messages */
+			if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+				rbuf->off = rbuf->scan + 1;
+				continue;
+			}
+			if ((unsigned char)c == PROTOCOL_BINARY_MAGIC ||
+			    (unsigned char)c == PROTOCOL_COMPRESSED_MAGIC)
+				return read_buffer_frame_binary(rbuf, id);
+			if (c != '{') {
+				LOG_ERROR(-EINVAL,
+					  "Invalid data while reading from %s: expected object, got '%c'",
+					  id, c);
+				return -EINVAL;
+			}
+		}
+		switch (c) {
+		case '"':
+			rbuf->in_string = true;
+			break;
+		case '{':
+		case '[':
+			rbuf->depth++;
+			break;
+		case '}':
+		case ']':
+			rbuf->depth--;
+			if (rbuf->depth == 0) {
+				rbuf->scan++;
+				return rbuf->scan - rbuf->off;
+			}
+			break;
+		default:
+			break;
+		}
 	}
+	return 0;
+}
+
+static int protocol_dispatch(json_t *request, const char *id, void *fd_arg,
+			     protocol_read_cb *cbs, void *cb_arg)
+{
 	if (llapi_msg_get_level() >= LLAPI_MSG_DEBUG) {
 		char *json_str = json_dumps(request, 0);
 		LOG_DEBUG("Got something from %s: %s", id, json_str);
@@ -139,93 +233,603 @@ again:
 	json_t *command_obj = json_object_get(request, "command");
 	if (!command_obj) {
 		char *json_str = json_dumps(request, 0);
-		rc = -EINVAL;
-		LOG_ERROR(rc, "Received valid json with no command: %s",
+		LOG_ERROR(-EINVAL, "Received valid json with no command: %s",
 			  json_str);
 		free(json_str);
-		goto out_freereq;
+		return -EINVAL;
 	}
 	const char *command_str = json_string_value(command_obj);
 	if (!command_str) {
 		char *json_str = json_dumps(request, 0);
-		rc = -EINVAL;
-		LOG_ERROR(rc, "Command was not a string: %s", json_str);
+		LOG_ERROR(-EINVAL, "Command was not a string: %s", json_str);
 		free(json_str);
-		goto out_freereq;
+		return -EINVAL;
 	}
 	enum protocol_commands command = protocol_str2command(command_str);
-	if (command == PROTOCOL_COMMANDS_MAX) {
-		rc = -EINVAL;
-		goto out_freereq;
-	}
+	if (command == PROTOCOL_COMMANDS_MAX)
+		return -EINVAL;
 
 	LOG_DEBUG("Got command %s from %s", command_str, id);
 	if (!cbs || !cbs[command]) {
-		rc = -ENOTSUP;
-		LOG_ERROR(rc, "command %s not implemented", command_str);
-		goto out_freereq;
+		LOG_ERROR(-ENOTSUP, "command %s not implemented", command_str);
+		return -ENOTSUP;
 	}
-	rc = cbs[command](fd_arg, request, cb_arg);
+	return cbs[command](fd_arg, request, cb_arg);
+}
+
+static int protocol_dispatch_binary(const char *msg, size_t len,
+				    const char *id, void *fd_arg,
+				    protocol_read_bin_cb *bin_cbs,
+				    void *cb_arg)
+{
+	unsigned char command = msg[1];
 
-out_freereq:
-	json_decref(request);
-	if (rc == 0 && cbdata.bufoff != cbdata.bufread) {
-		cbdata.position = 0;
-		goto again;
+	if (command >= PROTOCOL_COMMANDS_MAX) {
+		LOG_ERROR(-EINVAL, "Invalid binary command %d from %s",
+			  command, id);
+		return -EINVAL;
 	}
+	LOG_DEBUG("Got binary command %s from %s (%zu bytes)",
+		  protocol_command2str(command), id, len);
+	if (!bin_cbs || !bin_cbs[command]) {
+		LOG_ERROR(-ENOTSUP, "binary command %s not implemented",
+			  protocol_command2str(command));
+		return -ENOTSUP;
+	}
+	return bin_cbs[command](fd_arg, msg + PROTOCOL_BINARY_HEADER_SIZE,
+				len - PROTOCOL_BINARY_HEADER_SIZE, cb_arg);
+}
 
-out_freebuf:
-	free(cbdata.buffer);
-	return rc;
+/* size of compressed message header, including uncompressed size */
+#define PROTOCOL_COMPRESSED_HEADER_SIZE (PROTOCOL_BINARY_HEADER_SIZE + 4)
+/* deflate cannot do better than about 1032:1, larger claims are bogus */
+#define PROTOCOL_COMPRESS_RATIO_MAX 1032
+/* first output allocation when inflating, doubled as it fills up */
+#define PROTOCOL_INFLATE_MIN (64 * 1024)
+
+/* decompress a compressed message into a new read buffer.
+ * Memory follows what the stream actually inflates to, not the size its
+ * header claims. */
+static int read_buffer_inflate(const char *msg, size_t len, const char *id,
+			       struct protocol_read_buffer *out)
+{
+	z_stream zs = { 0 };
+	uint32_t size;
+	int rc;
+
+	if (msg[1] != PROTOCOL_COMPRESS_ZLIB) {
+		rc = -EPROTONOSUPPORT;
+		LOG_ERROR(rc, "Unknown compression %d from %s", msg[1], id);
+		return rc;
+	}
+	if (len < PROTOCOL_COMPRESSED_HEADER_SIZE) {
+		rc = -EINVAL;
+		LOG_ERROR(rc, "Truncated compressed message from %s", id);
+		return rc;
+	}
+	memcpy(&size, msg + PROTOCOL_BINARY_HEADER_SIZE, sizeof(size));
+	size = le32toh(size);
+	if (size > PROTOCOL_READ_BUFFER_MAX ||
+	    size > (uint64_t)(len - PROTOCOL_COMPRESSED_HEADER_SIZE) *
+			   PROTOCOL_COMPRESS_RATIO_MAX) {
+		rc = -EMSGSIZE;
+		LOG_ERROR(rc,
+			  "Message from %s too big (%u bytes uncompressed from %zu)",
+			  id, size, len);
+		return rc;
+	}
+
+	if (inflateInit(&zs) != Z_OK)
+		abort();
+	zs.next_in = (Bytef *)msg + PROTOCOL_COMPRESSED_HEADER_SIZE;
+	zs.avail_in = len - PROTOCOL_COMPRESSED_HEADER_SIZE;
+	do {
+		/* full at the announced size: inflate fails with
+		 * Z_BUF_ERROR if the stream goes on */
+		if (out->len == out->size && out->size < size) {
+			out->size = out->size ? out->size * 2 :
+						PROTOCOL_INFLATE_MIN;
+			if (out->size > size)
+				out->size = size;
+			out->buf = xrealloc(out->buf, out->size);
+		}
+		zs.next_out = (Bytef *)out->buf + out->len;
+		zs.avail_out = out->size - out->len;
+		rc = inflate(&zs, Z_NO_FLUSH);
+		out->len = zs.total_out;
+	} while (rc == Z_OK);
+	inflateEnd(&zs);
+	if (rc != Z_STREAM_END || out->len != size) {
+		rc = -EINVAL;
+		LOG_ERROR(rc, "Invalid compressed message from %s", id);
+		protocol_read_buffer_free(out);
+		return rc;
+	}
+	return 0;
 }
 
-static int json_dump_cb(const char *buffer, size_t _size, void *data)
+/**
+ * parse and process all complete messages in buffer
+ *
+ * @param processed set to true if any message was processed
+ * @return 0 on success, -errno on error, or positive value returned by
+ * callback (in which case rbuf must no longer be accessed)
+ */
+static int read_buffer_process(struct protocol_read_buffer *rbuf,
+			       const char *id, void *fd_arg,
+			       protocol_read_cb *cbs,
+			       protocol_read_bin_cb *bin_cbs, void *cb_arg,
+			       bool *processed)
 {
-	struct load_cb_data *cbdata = data;
+	json_t *request;
+	json_error_t json_error;
+	ssize_t msglen;
 	int rc;
-	ssize_t size = _size;
 
-	if (size > cbdata->buflen - cbdata->bufread) {
-		rc = write_full(cbdata->fd, cbdata->buffer, cbdata->bufread);
-		cbdata->bufread = 0;
-		if (rc) {
-			LOG_ERROR(rc, "write to %s failed", cbdata->id);
+	while ((msglen = read_buffer_frame(rbuf, id)) > 0) {
+		if ((unsigned char)rbuf->buf[rbuf->off] ==
+		    PROTOCOL_COMPRESSED_MAGIC) {
+			/* nothing compresses twice, no nesting either */
+			struct protocol_read_buffer inflated = {
+				.reject_compressed = true,
+			};
+
+			if (rbuf->reject_compressed) {
+				rc = -EPROTO;
+				LOG_ERROR(rc,
+					  "Unexpected compressed message from %s",
+					  id);
+				return rc;
+			}
+			rc = read_buffer_inflate(rbuf->buf + rbuf->off, msglen,
+						 id, &inflated);
+			rbuf->off += msglen;
+			if (rc)
+				return rc;
+			if (processed)
+				*processed = true;
+			/* compressed data must only hold complete messages */
+			rc = read_buffer_process(&inflated, id, fd_arg, cbs,
+						 bin_cbs, cb_arg, NULL);
+			if (rc == 0 && inflated.off != inflated.len) {
+				rc = -EINVAL;
+				LOG_ERROR(rc,
+					  "Partial message in compressed data from %s",
+					  id);
+			}
+			protocol_read_buffer_free(&inflated);
+			if (rc)
+				return rc;
+			continue;
+		}
+		if ((unsigned char)rbuf->buf[rbuf->off] ==
+		    PROTOCOL_BINARY_MAGIC) {
+			const char *msg = rbuf->buf + rbuf->off;
+
+			/* as below, the callback can free the buffer: it
+			 * must not use payload after that */
+			rbuf->off += msglen;
+			if (processed)
+				*processed = true;
+			rc = protocol_dispatch_binary(msg, msglen, id, fd_arg,
+						      bin_cbs, cb_arg);
+			if (rc)
+				return rc;
+			continue;
+		}
+		request = json_loadb(rbuf->buf + rbuf->off, msglen,
+				     JSON_ALLOW_NUL, &json_error);
+		/* consume message before callback: the callback can free
+		 * the buffer (e.g. client disconnect) */
+		rbuf->off += msglen;
+		if (!request) {
+			// XXX map json_error_code(error) (enum json_error_code) to errno ?
+			rc = -EINVAL;
+			LOG_ERROR(rc, "Invalid json while reading from %s: %s",
+				  id, json_error.text);
 			return rc;
 		}
-	}
-	if (size > cbdata->buflen) {
-		// just write directly if it's big, buffer has just been flushed
-		rc = write_full(cbdata->fd, buffer, size);
+		if (processed)
+			*processed = true;
+
+		rc = protocol_dispatch(request, id, fd_arg, cbs, cb_arg);
+		json_decref(request);
 		if (rc)
-			LOG_ERROR(rc, "write to %s failed", cbdata->id);
+			return rc;
+	}
+	return msglen;
+}
+
+int protocol_read_buffered(int fd, const char *id,
+			   struct protocol_read_buffer *rbuf, void *fd_arg,
+			   protocol_read_cb *cbs, protocol_read_bin_cb *bin_cbs,
+			   void *cb_arg)
+{
+	int rc, rc_fill;
+
+	rc_fill = read_buffer_fill(fd, id, rbuf, true);
+
+	/* process whatever we got even if connection was closed */
+	rc = read_buffer_process(rbuf, id, fd_arg, cbs, bin_cbs, cb_arg, NULL);
+	if (rc)
 		return rc;
+
+	return rc_fill;
+}
+
+int protocol_read_command(int fd, const char *id, void *fd_arg,
+			  protocol_read_cb *cbs, protocol_read_bin_cb *bin_cbs,
+			  void *cb_arg)
+{
+	struct protocol_read_buffer rbuf = { 0 };
+	bool processed = false;
+	int rc;
+
+	do {
+		rc = read_buffer_fill(fd, id, &rbuf, false);
+		if (rc)
+			break;
+		rc = read_buffer_process(&rbuf, id, fd_arg, cbs, bin_cbs,
+					 cb_arg, &processed);
+	} while (rc == 0 && (!processed || rbuf.off != rbuf.len));
+
+	protocol_read_buffer_free(&rbuf);
+	return rc;
+}
+
+#define PROTOCOL_WRITE_CHUNK_SIZE (64 * 1024)
+/* smaller buffers are copied anyway, not worth an iovec of their own */
+#define PROTOCOL_WRITE_TAKE_MIN 4096
+/* max chunks per writev */
+#define PROTOCOL_WRITE_IOV_MAX 64
+
+static void write_buffer_link_chunk(struct protocol_write_buffer *wbuf,
+				    struct protocol_write_chunk *chunk)
+{
+	chunk->next = NULL;
+	chunk->len = 0;
+	chunk->off = 0;
+
+	if (wbuf->tail)
+		wbuf->tail->next = chunk;
+	else
+		wbuf->head = chunk;
+	wbuf->tail = chunk;
+}
+
+static struct protocol_write_chunk *
+write_buffer_new_chunk(struct protocol_write_buffer *wbuf, size_t size)
+{
+	struct protocol_write_chunk *chunk;
+
+	if (size <= PROTOCOL_WRITE_CHUNK_SIZE && wbuf->spare) {
+		chunk = wbuf->spare;
+		wbuf->spare = NULL;
+	} else {
+		if (size < PROTOCOL_WRITE_CHUNK_SIZE)
+			size = PROTOCOL_WRITE_CHUNK_SIZE;
+		chunk = xmalloc(sizeof(*chunk) + size);
+		chunk->size = size;
+	}
+	chunk->ext = NULL;
+	write_buffer_link_chunk(wbuf, chunk);
+	return chunk;
+}
+
+/* chunk has been written: keep one standard chunk around for reuse */
+static void write_buffer_release_chunk(struct protocol_write_buffer *wbuf,
+				       struct protocol_write_chunk *chunk)
+{
+	if (chunk->ext) {
+		free(chunk->ext);
+		free(chunk);
+		return;
+	}
+	if (!wbuf->spare && chunk->size == PROTOCOL_WRITE_CHUNK_SIZE) {
+		wbuf->spare = chunk;
+		return;
+	}
+	free(chunk);
+}
+
+static inline char *write_chunk_data(struct protocol_write_chunk *chunk)
+{
+	return chunk->ext ? chunk->ext : chunk->data;
+}
+
+static int write_buffer_append_cb(const char *buffer, size_t size, void *data)
+{
+	struct protocol_write_buffer *wbuf = data;
+	struct protocol_write_chunk *chunk = wbuf->tail;
+
+	wbuf->copied += size;
+	wbuf->pending += size;
+	if (!chunk || chunk->size - chunk->len < size) {
+		/* fill current chunk first so we only allocate for the rest */
+		if (chunk && chunk->len < chunk->size) {
+			size_t avail = chunk->size - chunk->len;
+
+			memcpy(chunk->data + chunk->len, buffer, avail);
+			chunk->len += avail;
+			buffer += avail;
+			size -= avail;
+		}
+		chunk = write_buffer_new_chunk(wbuf, size);
 	}
-	memcpy(cbdata->buffer + cbdata->bufread, buffer, size);
-	cbdata->bufread += size;
+	memcpy(chunk->data + chunk->len, buffer, size);
+	chunk->len += size;
 	return 0;
 }
 
-int protocol_write(json_t *json, int fd, const char *id, size_t flags)
+int protocol_write_buffered(json_t *json, struct protocol_write_buffer *wbuf,
+			    const char *id, size_t flags)
 {
-	struct load_cb_data cbdata = {
-		.fd = fd,
-	};
 	int rc;
 
 	if (llapi_msg_get_level() >= LLAPI_MSG_DEBUG) {
 		char *json_str = json_dumps(json, 0);
-		LOG_DEBUG("Sending message to %s: %s", id, json_str);
+		LOG_DEBUG("Queueing message to %s: %s", id, json_str);
 		free(json_str);
 	}
 
-	cbdata.buffer = xmalloc(64 * 1024);
-	cbdata.buflen = 64 * 1024;
-	rc = json_dump_callback(json, json_dump_cb, &cbdata, flags);
-	if (rc == 0 && cbdata.bufread) {
-		rc = write_full(cbdata.fd, cbdata.buffer, cbdata.bufread);
-		if (rc)
-			LOG_ERROR(rc, "write to %s failed", id);
+	rc = json_dump_callback(json, write_buffer_append_cb, wbuf, flags);
+	if (rc) {
+		rc = -EINVAL;
+		LOG_ERROR(rc, "Could not encode message to %s", id);
+	}
+	return rc;
+}
+
+void protocol_write_buffered_raw(struct protocol_write_buffer *wbuf,
+				 const char *buf, size_t len)
+{
+	write_buffer_append_cb(buf, len, wbuf);
+}
+
+void protocol_write_buffered_take(struct protocol_write_buffer *wbuf,
+				  char *buf, size_t len)
+{
+	struct protocol_write_chunk *chunk;
+
+	if (len < PROTOCOL_WRITE_TAKE_MIN) {
+		write_buffer_append_cb(buf, len, wbuf);
+		free(buf);
+		return;
+	}
+
+	chunk = xmalloc(sizeof(*chunk));
+	write_buffer_link_chunk(wbuf, chunk);
+	chunk->ext = buf;
+	/* full: next append goes to a new chunk */
+	chunk->size = chunk->len = len;
+	wbuf->pending += len;
+}
+
+int protocol_write_flush(int fd, const char *id,
+			 struct protocol_write_buffer *wbuf)
+{
+	struct iovec iov[PROTOCOL_WRITE_IOV_MAX];
+	struct protocol_write_chunk *chunk;
+	ssize_t n;
+	int iovcnt, rc;
+
+	while (wbuf->head) {
+		iovcnt = 0;
+		for (chunk = wbuf->head;
+		     chunk && iovcnt < PROTOCOL_WRITE_IOV_MAX;
+		     chunk = chunk->next) {
+			if (chunk->off == chunk->len)
+				continue;
+			iov[iovcnt].iov_base = write_chunk_data(chunk) + chunk->off;
+			iov[iovcnt].iov_len = chunk->len - chunk->off;
+			iovcnt++;
+		}
+
+		if (iovcnt) {
+			n = writev(fd, iov, iovcnt);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return 0;
+			if (n < 0) {
+				rc = -errno;
+				LOG_ERROR(rc, "write to %s failed", id);
+				return rc;
+			}
+			wbuf->pending -= n;
+		} else {
+			n = 0;
+		}
+
+		/* consume written data, releasing complete chunks.
+		 * The tail chunk is kept if it has room left */
+		while ((chunk = wbuf->head)) {
+			size_t left = chunk->len - chunk->off;
+
+			if ((size_t)n < left) {
+				chunk->off += n;
+				break;
+			}
+			n -= left;
+			chunk->off = chunk->len;
+			if (chunk == wbuf->tail && chunk->len < chunk->size)
+				break;
+			wbuf->head = chunk->next;
+			if (!wbuf->head)
+				wbuf->tail = NULL;
+			write_buffer_release_chunk(wbuf, chunk);
+		}
+		if (wbuf->pending == 0)
+			break;
+	}
+	return 0;
+}
+
+/* drop everything not written yet */
+static void write_buffer_discard(struct protocol_write_buffer *wbuf)
+{
+	struct protocol_write_chunk *chunk, *next;
+
+	for (chunk = wbuf->head; chunk; chunk = next) {
+		next = chunk->next;
+		write_buffer_release_chunk(wbuf, chunk);
+	}
+	wbuf->head = wbuf->tail = NULL;
+	wbuf->pending = 0;
+}
+
+void protocol_write_buffer_splice(struct protocol_write_buffer *dst,
+				  struct protocol_write_buffer *src)
+{
+	struct protocol_write_chunk *chunk = src->head, *tail = dst->tail;
+
+	/* src builds the next message: hand it the chunk dst kept */
+	if (!src->spare) {
+		src->spare = dst->spare;
+		dst->spare = NULL;
+	}
+	if (!chunk)
+		return;
+
+	dst->pending += src->pending;
+	dst->copied += src->copied;
+	/* small message: copy it after what dst has left to write rather
+	 * than chaining a mostly empty chunk, src keeps its chunk */
+	if (!chunk->next && !chunk->ext && tail && !tail->ext &&
+	    tail->size - tail->len >= chunk->len - chunk->off) {
+		memcpy(tail->data + tail->len, chunk->data + chunk->off,
+		       chunk->len - chunk->off);
+		tail->len += chunk->len - chunk->off;
+		dst->copied += chunk->len - chunk->off;
+		src->head = src->tail = NULL;
+		write_buffer_release_chunk(src, chunk);
+	} else {
+		if (tail)
+			tail->next = chunk;
+		else
+			dst->head = chunk;
+		dst->tail = src->tail;
+		src->head = src->tail = NULL;
+	}
+	src->pending = 0;
+	src->copied = 0;
+}
+
+int protocol_write_buffer_compress(struct protocol_write_buffer *wbuf,
+				   size_t threshold)
+{
+	struct protocol_write_chunk *chunk;
+	z_stream zs = { 0 };
+	char *frame;
+	uint32_t val;
+	size_t len;
+	int rc;
+
+	if (!threshold || wbuf->pending < threshold)
+		return 0;
+	if (wbuf->pending > PROTOCOL_READ_BUFFER_MAX)
+		return 0;
+
+	/* favor speed: this runs in the server main loop.
+	 * Compression is optional, on any error send the message as is */
+	rc = deflateInit(&zs, Z_BEST_SPEED);
+	if (rc != Z_OK) {
+		LOG_WARN(-ENOMEM, "deflateInit failed (%d), not compressing",
+			 rc);
+		return 0;
+	}
+	len = deflateBound(&zs, wbuf->pending);
+	frame = xmalloc(PROTOCOL_COMPRESSED_HEADER_SIZE + len);
+	zs.next_out = (Bytef *)frame + PROTOCOL_COMPRESSED_HEADER_SIZE;
+	zs.avail_out = len;
+	for (chunk = wbuf->head; chunk; chunk = chunk->next) {
+		zs.next_in = (Bytef *)write_chunk_data(chunk) + chunk->off;
+		zs.avail_in = chunk->len - chunk->off;
+		rc = deflate(&zs, chunk->next ? Z_NO_FLUSH : Z_FINISH);
+		/* output is large enough for everything */
+		if (rc != (chunk->next ? Z_OK : Z_STREAM_END) ||
+		    zs.avail_in != 0) {
+			LOG_WARN(-EIO, "deflate failed (%d), not compressing",
+				 rc);
+			deflateEnd(&zs);
+			free(frame);
+			return 0;
+		}
+	}
+	len = zs.total_out;
+	deflateEnd(&zs);
+
+	/* not worth it */
+	if (PROTOCOL_COMPRESSED_HEADER_SIZE + len >= wbuf->pending) {
+		free(frame);
+		return 0;
+	}
+
+	frame[0] = PROTOCOL_COMPRESSED_MAGIC;
+	frame[1] = PROTOCOL_COMPRESS_ZLIB;
+	frame[2] = 0;
+	frame[3] = 0;
+	val = htole32(len + 4);
+	memcpy(frame + 4, &val, sizeof(val));
+	val = htole32(wbuf->pending);
+	memcpy(frame + 8, &val, sizeof(val));
+
+	LOG_DEBUG("Compressed message from %zu to %zu bytes", wbuf->pending,
+		  PROTOCOL_COMPRESSED_HEADER_SIZE + len);
+	write_buffer_discard(wbuf);
+	protocol_write_buffered_take(wbuf, frame,
+				     PROTOCOL_COMPRESSED_HEADER_SIZE + len);
+	return 0;
+}
+
+void protocol_write_buffer_free(struct protocol_write_buffer *wbuf)
+{
+	struct protocol_write_chunk *chunk, *next;
+
+	for (chunk = wbuf->head; chunk; chunk = next) {
+		next = chunk->next;
+		if (chunk->ext)
+			free(chunk->ext);
+		free(chunk);
+	}
+	free(wbuf->spare);
+	memset(wbuf, 0, sizeof(*wbuf));
+}
+
+/* per-thread arena for blocking writes, see protocol_write */
+static __thread struct protocol_write_buffer write_arena;
+
+int protocol_write(json_t *json, int fd, const char *id, size_t flags)
+{
+	return protocol_write_compressed(json, fd, id, flags, 0);
+}
+
+int protocol_write_compressed(json_t *json, int fd, const char *id,
+			      size_t flags, size_t threshold)
+{
+	struct protocol_write_buffer *wbuf = &write_arena;
+	struct pollfd pollfd = {
+		.fd = fd,
+		.events = POLLOUT,
+	};
+	int rc;
+
+	/* arena is empty on entry: previous calls wrote everything */
+	rc = protocol_write_buffered(json, wbuf, id, flags);
+	if (rc == 0)
+		rc = protocol_write_buffer_compress(wbuf, threshold);
+	while (rc == 0 && wbuf->pending) {
+		rc = protocol_write_flush(fd, id, wbuf);
+		/* only happens if fd is non-blocking */
+		if (rc == 0 && wbuf->pending && poll(&pollfd, 1, -1) < 0 &&
+		    errno != EINTR) {
+			rc = -errno;
+			LOG_ERROR(rc, "poll on %s failed", id);
+		}
+	}
+	if (rc) {
+		/* drop partial message */
+		write_buffer_discard(wbuf);
 	}
-	free(cbdata.buffer);
 	return rc;
 }
@@ -5,6 +5,7 @@
 
 #include <lustre/lustreapi.h>
 #include <jansson.h>
+#include <stdbool.h>
 
 #include "logs.h"
 
@@ -42,23 +43,147 @@ enum protocol_commands protocol_str2command(const char *str);
 const char *protocol_command2str(enum protocol_commands cmd);
 
 typedef int (*protocol_read_cb)(void *fd_arg, json_t *json, void *arg);
+/* same for binary messages, payload is valid until callback returns */
+typedef int (*protocol_read_bin_cb)(void *fd_arg, const char *payload,
+				    size_t len, void *arg);
+
+/**
+ * receive buffer, kept per connection so partial messages can be completed
+ * on later reads without blocking.
+ * Initialize to zero, release with protocol_read_buffer_free()
+ */
+struct protocol_read_buffer {
+	char *buf;
+	size_t size; /* allocated size */
+	size_t len; /* bytes read into buf */
+	size_t off; /* start of first unprocessed message */
+	/* framing state of message at off, scanned up to scan */
+	size_t scan;
+	int depth;
+	bool in_string;
+	bool escape;
+	/* compression was not negotiated, compressed messages are errors */
+	bool reject_compressed;
+};
+
+void protocol_read_buffer_free(struct protocol_read_buffer *rbuf);
+
+/**
+ * read everything available on a non-blocking fd into rbuf and callback
+ * for every complete json object. Partial messages are kept in rbuf for
+ * the next call.
+ *
+ * @param fd non-blocking fd of socket to read from
+ * @param id hint for logs identifying fd
+ * @param rbuf receive buffer associated with fd
+ * @param fd_arg
+ * @param cbs vector of callbacks, see protocol_read_command.
+ * @param bin_cbs vector of callbacks for binary messages, can be NULL
+ * @param cb_arg
+ * @return 0 on success, -errno on error (-ECONNRESET on eof), or positive
+ * value returned by a callback: in that case processing stopped immediately
+ * and rbuf must no longer be accessed (e.g. it has been freed)
+ */
+int protocol_read_buffered(int fd, const char *id,
+			   struct protocol_read_buffer *rbuf, void *fd_arg,
+			   protocol_read_cb *cbs, protocol_read_bin_cb *bin_cbs,
+			   void *cb_arg);
 
 /**
  * read json objects and callbacks -- this keeps reading until the end
- * of buffer coincides with the end of a json object for efficiency
+ * of buffer coincides with the end of a json object for efficiency.
+ * This blocks until at least one message has been read and is intended
+ * for clients.
  *
  * @param fd fd of socket to read one json object from
  * @param id hint for logs identifying fd
  * @param fd_arg
  * @param cbs vector of callbacks, must be readable up to PROTOCOL_COMMANDS_MAX.
  * if cb is null for a given command, an error is logged and message is ignored.
+ * @param bin_cbs same for binary messages, can be NULL if binary protocol
+ * was not negotiated.
  * @param cb_arg
  * @return 0 on success, -errno on error.
  */
 int protocol_read_command(int fd, const char *id, void *fd_arg,
-			  protocol_read_cb *cbs, void *cb_arg);
+			  protocol_read_cb *cbs, protocol_read_bin_cb *bin_cbs,
+			  void *cb_arg);
 
 int protocol_write(json_t *json, int fd, const char *id, size_t flags);
+/* same, compressing message if larger than threshold (0 = never) */
+int protocol_write_compressed(json_t *json, int fd, const char *id,
+			      size_t flags, size_t threshold);
+
+/**
+ * send buffer: messages are encoded into a chain of chunks that are
+ * flushed with writev as the fd becomes writable.
+ * Large pre-encoded buffers can be handed over without copy, in which case
+ * the chunk points to the external buffer.
+ * Written chunks are kept for reuse, so a busy connection does not
+ * allocate at all once warmed up.
+ * Initialize to zero, release with protocol_write_buffer_free()
+ */
+struct protocol_write_chunk {
+	struct protocol_write_chunk *next;
+	char *ext; /* external buffer owned by chunk, data is unused if set */
+	size_t size; /* allocated size of data */
+	size_t len; /* bytes filled in data */
+	size_t off; /* bytes already written */
+	char data[];
+};
+
+struct protocol_write_buffer {
+	struct protocol_write_chunk *head;
+	struct protocol_write_chunk *tail;
+	struct protocol_write_chunk *spare; /* written chunk kept for reuse */
+	size_t pending; /* bytes not written yet */
+	size_t copied; /* stats: bytes copied into chunks */
+};
+
+/**
+ * encode json object at the end of wbuf, does not write anything.
+ *
+ * @return 0 on success, -errno on error
+ */
+int protocol_write_buffered(json_t *json, struct protocol_write_buffer *wbuf,
+			    const char *id, size_t flags);
+
+/**
+ * append already encoded data (e.g. binary message) at the end of wbuf
+ */
+void protocol_write_buffered_raw(struct protocol_write_buffer *wbuf,
+				 const char *buf, size_t len);
+
+/**
+ * same as protocol_write_buffered_raw, but take ownership of a malloc'd
+ * buffer instead of copying it. buf is freed once written.
+ */
+void protocol_write_buffered_take(struct protocol_write_buffer *wbuf,
+				  char *buf, size_t len);
+
+/**
+ * write as much of wbuf as possible to a non-blocking fd
+ *
+ * @return 0 on success (check wbuf->pending for leftovers), -errno on error
+ */
+int protocol_write_flush(int fd, const char *id,
+			 struct protocol_write_buffer *wbuf);
+
+/**
+ * replace everything pending in wbuf by a single compressed message if it
+ * is larger than threshold (0 = never) and compresses well enough.
+ * wbuf must only contain complete messages, nothing partially written.
+ *
+ * @return 0 on success, -errno on error
+ */
+int protocol_write_buffer_compress(struct protocol_write_buffer *wbuf,
+				   size_t threshold);
+
+/* move everything pending in src at the end of dst */
+void protocol_write_buffer_splice(struct protocol_write_buffer *dst,
+				  struct protocol_write_buffer *src);
+
+void protocol_write_buffer_free(struct protocol_write_buffer *wbuf);
 
 /**
  * - STATUS command: query runtime information
@@ -91,6 +216,10 @@ int protocol_write(json_t *json, int fd, const char *id, size_t flags);
  *      ^ maximum size of items to send when reencoded, defaults to 1MB
  *        (this is due to how llapi_hsm_copytool_recv works with a static
  *         buffer for kuc in lustre code)
+ *     max_inflight_bytes = integer (s64)
+ *      ^ maximum known size of requests being worked on, a request
+ *        that would exceed it is only sent if nothing is in flight.
+ *        Optional, defaults to no limit.
  *   reply properties:
  *     command = "recv"
  *     status = int (0 on success, errno on failure)
@@ -132,7 +261,12 @@ int protocol_write(json_t *json, int fd, const char *id, size_t flags);
  *     archive_id = integer (u32), archive_id of the cookie
  *     hai_cookie = integers (u64), cookie of the hsm action items being acknowledged
  *     hai_dfid = fid object (see recv), dfid of the hsm action item being acknowledged
- *   reply properties:
+ *     status = int (status of the action, 0 on success)
+ *     list = list of objects with hai_cookie, hai_dfid and status as above
+ *            to acknowledge multiple items at once. If set, top level
+ *            hai_cookie/hai_dfid/status are ignored. Only sent to servers
+ *            that set "done_list" in their EHLO reply.
+ *   reply properties (single reply for the whole list):
  *     command = "done"
  *     status = int (0 on success, errno on failure)
  *     error = string (extra error message)
@@ -171,6 +305,8 @@ int protocol_write(json_t *json, int fd, const char *id, size_t flags);
  *     command = "ehlo"
  *     status = int (0 on success, errno on failure)
  *     error = string (extra error message)
+ *     done_list = bool, DONE requests can carry a list (older servers
+ *                 reject it, clients then acknowledge items one by one)
  */
 
 /**
@@ -185,12 +321,115 @@ int protocol_write(json_t *json, int fd, const char *id, size_t flags);
  *     error = string (extra error message)
  */
 
+/**
+ * - binary messages
+ *   If both sides set "binary": true in EHLO request and reply, some messages
+ *   can be sent in binary instead of json. Json is always accepted, so old
+ *   clients and debug tools keep working.
+ *   Binary messages start with a byte that cannot start a json object:
+ *     u8 magic = PROTOCOL_BINARY_MAGIC
+ *     u8 command = enum protocol_commands
+ *     u16 reserved = 0
+ *     u32 length = payload length, excluding this header
+ *   All integers are little endian.
+ *
+ *   RECV reply payload (successful replies only, errors are sent as json):
+ *     u32 hal_version, u32 hal_archive_id, u64 hal_flags, u32 hal_count,
+ *     u32 fsname length, fsname (not nul-terminated)
+ *     then hal_count hsm_action_items:
+ *       u32 hai_action, fid hai_fid, fid hai_dfid,
+ *       u64 hai_extent_offset, u64 hai_extent_length, u64 hai_cookie,
+ *       u64 hai_gid, u32 data length, hai_data
+ *     fid = u64 f_seq, u32 f_oid, u32 f_ver
+ *
+ *   DONE request payload:
+ *     u32 count, then count times: u64 hai_cookie, fid hai_dfid, s32 status
+ *   reply is sent in json as usual.
+ */
+
+/**
+ * - compression
+ *   If EHLO request and reply both set "compress": true, each side can
+ *   compress messages larger than its compress_threshold. Compressed
+ *   messages use the binary header with a different magic:
+ *     u8 magic = PROTOCOL_COMPRESSED_MAGIC
+ *     u8 algorithm = PROTOCOL_COMPRESS_ZLIB
+ *     u16 reserved = 0
+ *     u32 length = payload length, excluding this header
+ *   payload is u32 uncompressed length followed by a zlib stream.
+ *   Uncompressed data is one or more complete json or binary messages,
+ *   never compressed messages.
+ *   Clients that negotiated compression before may compress their EHLO on
+ *   reconnect, and must retry uncompressed if that fails. Other compressed
+ *   messages are refused unless compression was negotiated, as are
+ *   messages claiming to inflate more than deflate can compress.
+ */
+
 /**
  * - future command ideas:
  *   * change some config value on the fly? could be a single command
  *     that sets lock property above
  */
 
+#define PROTOCOL_BINARY_MAGIC 0xb1
+#define PROTOCOL_COMPRESSED_MAGIC 0xb2
+#define PROTOCOL_COMPRESS_ZLIB 1
+#define PROTOCOL_BINARY_HEADER_SIZE 8
+/* fixed size part of an encoded hsm_action_item (without data) */
+#define PROTOCOL_BINARY_HAI_SIZE (4 + 16 + 16 + 8 + 8 + 8 + 8 + 4)
+
+/**
+ * binary message helpers: encode in a bin buf with protocol_bin_init,
+ * put whatever is required then call protocol_bin_finish to set length.
+ */
+struct protocol_bin_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+void protocol_bin_init(struct protocol_bin_buf *bin,
+		       enum protocol_commands command);
+void protocol_bin_put_u32(struct protocol_bin_buf *bin, uint32_t val);
+void protocol_bin_put_u64(struct protocol_bin_buf *bin, uint64_t val);
+void protocol_bin_put_bytes(struct protocol_bin_buf *bin, const void *buf,
+			    size_t len);
+/* overwrite u32 previously put at offset, e.g. counts */
+void protocol_bin_set_u32(struct protocol_bin_buf *bin, size_t offset,
+			  uint32_t val);
+void protocol_bin_put_hai(struct protocol_bin_buf *bin,
+			  struct hsm_action_item *hai, const char *data,
+			  size_t data_len);
+void protocol_bin_put_done(struct protocol_bin_buf *bin, uint64_t cookie,
+			   struct lu_fid *dfid, int status);
+void protocol_bin_finish(struct protocol_bin_buf *bin);
+void protocol_bin_free(struct protocol_bin_buf *bin);
+
+/* getters return 0 past the end of payload and set error */
+struct protocol_bin_reader {
+	const char *data;
+	size_t len;
+	size_t off;
+	bool error;
+};
+
+uint32_t protocol_bin_get_u32(struct protocol_bin_reader *reader);
+uint64_t protocol_bin_get_u64(struct protocol_bin_reader *reader);
+const char *protocol_bin_get_bytes(struct protocol_bin_reader *reader,
+				   size_t len);
+int protocol_bin_get_done(struct protocol_bin_reader *reader,
+			  uint64_t *cookie, struct lu_fid *dfid, int *status);
+/**
+ * decode one hsm_action_item, see json_hsm_action_item_get
+ *
+ * @param data_len output length of hai_data, excluding padding
+ * @return 0 on success, -EINVAL if payload is truncated, -EOVERFLOW if
+ * hai_len is too small
+ */
+int protocol_bin_get_hai(struct protocol_bin_reader *reader,
+			 struct hsm_action_item *hai, size_t hai_len,
+			 size_t *data_len);
+
 /**
  * common helpers for packing
  */
@@ -398,4 +637,14 @@ typedef int (*hal_get_cb)(struct hsm_action_list *hal,
 int json_hsm_action_list_get(json_t *json, struct hsm_action_list *hal,
 			     size_t hal_len, hal_get_cb cb, void *cb_arg);
 
+typedef int (*hal_bin_get_cb)(struct hsm_action_list *hal,
+			      struct hsm_action_item *hai, size_t data_len,
+			      void *arg);
+/**
+ * same as json_hsm_action_list_get for binary RECV reply payload
+ */
+int protocol_bin_hal_get(const char *payload, size_t len,
+			 struct hsm_action_list *hal, size_t hal_len,
+			 hal_bin_get_cb cb, void *cb_arg);
+
 #endif
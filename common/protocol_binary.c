@@ -0,0 +1,272 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <lustre/lustreapi.h>
+
+#include "protocol.h"
+#include "utils.h"
+
+/**
+ * encoding helpers
+ */
+
+static char *bin_reserve(struct protocol_bin_buf *bin, size_t len)
+{
+	char *ptr;
+
+	if (bin->len + len > bin->size) {
+		bin->size = bin->size ? bin->size * 2 : 4096;
+		if (bin->size < bin->len + len)
+			bin->size = bin->len + len;
+		bin->data = xrealloc(bin->data, bin->size);
+	}
+	ptr = bin->data + bin->len;
+	bin->len += len;
+	return ptr;
+}
+
+void protocol_bin_put_u32(struct protocol_bin_buf *bin, uint32_t val)
+{
+	val = htole32(val);
+	memcpy(bin_reserve(bin, sizeof(val)), &val, sizeof(val));
+}
+
+void protocol_bin_put_u64(struct protocol_bin_buf *bin, uint64_t val)
+{
+	val = htole64(val);
+	memcpy(bin_reserve(bin, sizeof(val)), &val, sizeof(val));
+}
+
+void protocol_bin_put_bytes(struct protocol_bin_buf *bin, const void *buf,
+			    size_t len)
+{
+	memcpy(bin_reserve(bin, len), buf, len);
+}
+
+void protocol_bin_set_u32(struct protocol_bin_buf *bin, size_t offset,
+			  uint32_t val)
+{
+	assert(offset + sizeof(val) <= bin->len);
+	val = htole32(val);
+	memcpy(bin->data + offset, &val, sizeof(val));
+}
+
+static void bin_put_fid(struct protocol_bin_buf *bin, struct lu_fid *fid)
+{
+	protocol_bin_put_u64(bin, fid->f_seq);
+	protocol_bin_put_u32(bin, fid->f_oid);
+	protocol_bin_put_u32(bin, fid->f_ver);
+}
+
+void protocol_bin_init(struct protocol_bin_buf *bin,
+		       enum protocol_commands command)
+{
+	char *header;
+
+	bin->len = 0;
+	header = bin_reserve(bin, PROTOCOL_BINARY_HEADER_SIZE);
+	header[0] = PROTOCOL_BINARY_MAGIC;
+	header[1] = command;
+	header[2] = 0;
+	header[3] = 0;
+	/* length is set in protocol_bin_finish() */
+}
+
+void protocol_bin_finish(struct protocol_bin_buf *bin)
+{
+	assert(bin->len >= PROTOCOL_BINARY_HEADER_SIZE);
+	protocol_bin_set_u32(bin, 4, bin->len - PROTOCOL_BINARY_HEADER_SIZE);
+}
+
+void protocol_bin_free(struct protocol_bin_buf *bin)
+{
+	free(bin->data);
+	memset(bin, 0, sizeof(*bin));
+}
+
+void protocol_bin_put_hai(struct protocol_bin_buf *bin,
+			  struct hsm_action_item *hai, const char *data,
+			  size_t data_len)
+{
+	struct lu_fid fid;
+
+	protocol_bin_put_u32(bin, hai->hai_action);
+	fid = hai->hai_fid;
+	bin_put_fid(bin, &fid);
+	fid = hai->hai_dfid;
+	bin_put_fid(bin, &fid);
+	protocol_bin_put_u64(bin, hai->hai_extent.offset);
+	protocol_bin_put_u64(bin, hai->hai_extent.length);
+	protocol_bin_put_u64(bin, hai->hai_cookie);
+	protocol_bin_put_u64(bin, hai->hai_gid);
+	protocol_bin_put_u32(bin, data_len);
+	protocol_bin_put_bytes(bin, data, data_len);
+}
+
+void protocol_bin_put_done(struct protocol_bin_buf *bin, uint64_t cookie,
+			   struct lu_fid *dfid, int status)
+{
+	protocol_bin_put_u64(bin, cookie);
+	bin_put_fid(bin, dfid);
+	protocol_bin_put_u32(bin, status);
+}
+
+/**
+ * decoding helpers
+ */
+
+static const char *bin_get(struct protocol_bin_reader *reader, size_t len)
+{
+	const char *ptr;
+
+	if (reader->error || reader->len - reader->off < len) {
+		reader->error = true;
+		return NULL;
+	}
+	ptr = reader->data + reader->off;
+	reader->off += len;
+	return ptr;
+}
+
+uint32_t protocol_bin_get_u32(struct protocol_bin_reader *reader)
+{
+	const char *ptr = bin_get(reader, sizeof(uint32_t));
+	uint32_t val;
+
+	if (!ptr)
+		return 0;
+	memcpy(&val, ptr, sizeof(val));
+	return le32toh(val);
+}
+
+uint64_t protocol_bin_get_u64(struct protocol_bin_reader *reader)
+{
+	const char *ptr = bin_get(reader, sizeof(uint64_t));
+	uint64_t val;
+
+	if (!ptr)
+		return 0;
+	memcpy(&val, ptr, sizeof(val));
+	return le64toh(val);
+}
+
+const char *protocol_bin_get_bytes(struct protocol_bin_reader *reader,
+				   size_t len)
+{
+	return bin_get(reader, len);
+}
+
+static void bin_get_fid(struct protocol_bin_reader *reader,
+			struct lu_fid *fid)
+{
+	fid->f_seq = protocol_bin_get_u64(reader);
+	fid->f_oid = protocol_bin_get_u32(reader);
+	fid->f_ver = protocol_bin_get_u32(reader);
+}
+
+int protocol_bin_get_done(struct protocol_bin_reader *reader,
+			  uint64_t *cookie, struct lu_fid *dfid, int *status)
+{
+	*cookie = protocol_bin_get_u64(reader);
+	bin_get_fid(reader, dfid);
+	*status = (int32_t)protocol_bin_get_u32(reader);
+
+	return reader->error ? -EINVAL : 0;
+}
+
+int protocol_bin_get_hai(struct protocol_bin_reader *reader,
+			 struct hsm_action_item *hai, size_t hai_len,
+			 size_t *data_len)
+{
+	struct lu_fid fid;
+	const char *data;
+
+	if (hai_len < sizeof(*hai))
+		return -EOVERFLOW;
+
+	hai->hai_action = protocol_bin_get_u32(reader);
+	bin_get_fid(reader, &fid);
+	hai->hai_fid = fid;
+	bin_get_fid(reader, &fid);
+	hai->hai_dfid = fid;
+	hai->hai_extent.offset = protocol_bin_get_u64(reader);
+	hai->hai_extent.length = protocol_bin_get_u64(reader);
+	hai->hai_cookie = protocol_bin_get_u64(reader);
+	hai->hai_gid = protocol_bin_get_u64(reader);
+	*data_len = protocol_bin_get_u32(reader);
+	data = bin_get(reader, *data_len);
+	if (!data)
+		return -EINVAL;
+
+	hai->hai_len = __ALIGN_KERNEL_MASK(sizeof(*hai) + *data_len, 7);
+	if (hai_len < hai->hai_len)
+		return -EOVERFLOW;
+
+	memcpy(hai->hai_data, data, *data_len);
+	memset(hai->hai_data + *data_len, 0,
+	       hai->hai_len - sizeof(*hai) - *data_len);
+	return 0;
+}
+
+int protocol_bin_hal_get(const char *payload, size_t len,
+			 struct hsm_action_list *hal, size_t hal_len,
+			 hal_bin_get_cb cb, void *cb_arg)
+{
+	struct protocol_bin_reader reader = {
+		.data = payload,
+		.len = len,
+	};
+	struct hsm_action_item *hai;
+	const char *fsname;
+	uint32_t fsname_len, count, i;
+	size_t data_len, fsname_size;
+	int rc;
+
+	if (hal_len < sizeof(*hal))
+		return -EINVAL;
+	hal_len -= sizeof(*hal);
+
+	hal->hal_version = protocol_bin_get_u32(&reader);
+	hal->hal_archive_id = protocol_bin_get_u32(&reader);
+	hal->hal_flags = protocol_bin_get_u64(&reader);
+	count = protocol_bin_get_u32(&reader);
+	fsname_len = protocol_bin_get_u32(&reader);
+	fsname = bin_get(&reader, fsname_len);
+	if (reader.error) {
+		rc = -EINVAL;
+		LOG_ERROR(rc, "truncated binary hsm action list");
+		return rc;
+	}
+	if (hal->hal_version != HAL_VERSION) {
+		rc = -EINVAL;
+		LOG_ERROR(rc, "hal_version was %d, expecting %d",
+			  hal->hal_version, HAL_VERSION);
+		return rc;
+	}
+	fsname_size = __ALIGN_KERNEL_MASK(fsname_len + 1, 7);
+	if (hal_len < fsname_size)
+		return -EINVAL;
+	hal_len -= fsname_size;
+	memcpy(hal->hal_fsname, fsname, fsname_len);
+	memset(hal->hal_fsname + fsname_len, 0, fsname_size - fsname_len);
+
+	hai = hai_first(hal);
+	for (i = 0; i < count; i++) {
+		rc = protocol_bin_get_hai(&reader, hai, hal_len, &data_len);
+		if (rc == -EINVAL)
+			LOG_ERROR(rc, "truncated binary hsm action item");
+		if (rc < 0)
+			return rc;
+		if (!cb || (rc = cb(hal, hai, data_len, cb_arg)) == 0) {
+			hal_len -= hai->hai_len;
+			hai = hai_next(hai);
+		}
+		if (rc < 0)
+			return rc;
+	}
+	hal->hal_count = count;
+
+	return (uintptr_t)hai - (uintptr_t)hal;
+}
@@ -4,6 +4,7 @@
 #define COORDINATOOL_UTILS_H
 
 #include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -62,12 +63,20 @@ static inline int write_full(int fd, const char *buf, size_t count)
 		n = write(fd, buf, count);
 		if (n < 0 && errno == EINTR)
 			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* non-blocking fd: wait until we can write again */
+			struct pollfd pollfd = { .fd = fd, .events = POLLOUT };
+			if (poll(&pollfd, 1, -1) < 0 && errno != EINTR)
+				return -errno;
+			continue;
+		}
 		if (n < 0) {
 			return -errno;
 		}
 		if ((size_t)n > count) {
 			return -ERANGE;
 		}
+		buf += n;
 		count -= n;
 	}
 	return 0;
@@ -10,6 +10,7 @@ BuildRequires: meson
 BuildRequires: gcc
 BuildRequires: pkgconfig(jansson)
 BuildRequires: pkgconfig(liburcu)
+BuildRequires: pkgconfig(zlib)
 BuildRequires: pkgconfig(glib-2.0)
 BuildRequires: hiredis
 
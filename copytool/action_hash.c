@@ -0,0 +1,231 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Index of all known actions by (cookie, dfid).
+ *
+ * Open addressing with linear probing; entries keep the full hash so most
+ * probes never dereference the action itself. Removal leaves a tombstone.
+ *
+ * Growing is incremental: when the table gets too full a new one is
+ * allocated and every insert/remove moves a few slots from the old table,
+ * so we never stall the main loop rehashing millions of actions at once.
+ * Lookups check both tables until the old one is empty.
+ */
+
+#include <assert.h>
+
+#include "coordinatool.h"
+
+#define ACTION_HASH_MIN_SIZE 1024
+/* old table slots moved per insert/remove while resizing */
+#define ACTION_HASH_MIGRATE_STEP 64
+
+/* removed entries, keep probing past them */
+static struct item_info tombstone;
+
+static inline bool entry_live(struct hsm_action_hash_entry *entry)
+{
+	return entry->info && entry->info != &tombstone;
+}
+
+/* murmur3 finalizer */
+static uint64_t fmix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* lustre only guarantees identity per mdt.
+ * We don't have mdt index in action info, so use cookie and fid
+ * (there can be multiple requests on a single fid as well, but these
+ * must be on the same mdt so cookie will be different)
+ */
+static uint64_t action_hash_key(uint64_t cookie, const struct lu_fid *dfid)
+{
+	uint64_t h;
+
+	h = fmix64(dfid->f_seq ^ ((uint64_t)dfid->f_oid << 32 | dfid->f_ver));
+	return fmix64(h ^ cookie);
+}
+
+static inline bool entry_match(struct hsm_action_hash_entry *entry,
+			       uint64_t hash, uint64_t cookie,
+			       const struct lu_fid *dfid)
+{
+	return entry->hash == hash && entry->info != &tombstone &&
+	       entry->info->cookie == cookie &&
+	       memcmp(&entry->info->dfid, dfid, sizeof(*dfid)) == 0;
+}
+
+static struct hsm_action_hash_entry *
+table_find(struct hsm_action_hash_table *table, uint64_t hash,
+	   uint64_t cookie, const struct lu_fid *dfid)
+{
+	size_t mask = table->size - 1, i;
+
+	if (!table->entries)
+		return NULL;
+
+	for (i = hash & mask; table->entries[i].info; i = (i + 1) & mask) {
+		if (entry_match(&table->entries[i], hash, cookie, dfid))
+			return &table->entries[i];
+	}
+	return NULL;
+}
+
+/* caller checked key is not present and table has room */
+static void table_insert(struct hsm_action_hash_table *table, uint64_t hash,
+			 struct item_info *info)
+{
+	size_t mask = table->size - 1, i;
+
+	i = hash & mask;
+	while (entry_live(&table->entries[i]))
+		i = (i + 1) & mask;
+	if (table->entries[i].info == &tombstone)
+		table->tombstones--;
+	table->entries[i].hash = hash;
+	table->entries[i].info = info;
+	table->count++;
+}
+
+static void table_remove(struct hsm_action_hash_table *table,
+			 struct hsm_action_hash_entry *entry)
+{
+	entry->info = &tombstone;
+	table->count--;
+	table->tombstones++;
+}
+
+static void action_hash_migrate(struct hsm_action_hash *hash, size_t steps)
+{
+	struct hsm_action_hash_table *old = &hash->old;
+
+	while (old->entries && steps--) {
+		if (hash->migrate_pos == old->size) {
+			assert(old->count == 0);
+			free(old->entries);
+			memset(old, 0, sizeof(*old));
+			return;
+		}
+		struct hsm_action_hash_entry *entry =
+			&old->entries[hash->migrate_pos++];
+
+		if (!entry_live(entry))
+			continue;
+		table_insert(&hash->cur, entry->hash, entry->info);
+		/* not NULL: later entries could be probed past this one */
+		entry->info = &tombstone;
+		old->count--;
+	}
+}
+
+static void action_hash_grow(struct hsm_action_hash *hash)
+{
+	struct hsm_action_hash_table *cur = &hash->cur;
+	size_t size;
+
+	/* keep load under 3/4 counting tombstones */
+	if ((cur->count + cur->tombstones + 1) * 4 <= cur->size * 3)
+		return;
+
+	/* only tombstones to clear: rehash at same size */
+	size = cur->size;
+	if (!size)
+		size = ACTION_HASH_MIN_SIZE;
+	else if (cur->count * 2 >= cur->size)
+		size *= 2;
+
+	LOG_DEBUG("Resizing action hash from %zu to %zu (%zu entries)",
+		  cur->size, size, cur->count);
+	hash->old = *cur;
+	hash->migrate_pos = 0;
+	cur->entries = xcalloc(size, sizeof(*cur->entries));
+	cur->size = size;
+	cur->count = 0;
+	cur->tombstones = 0;
+}
+
+struct item_info *hsm_action_hash_find(struct hsm_action_hash *hash,
+				       uint64_t cookie,
+				       const struct lu_fid *dfid)
+{
+	uint64_t h = action_hash_key(cookie, dfid);
+	struct hsm_action_hash_entry *entry;
+
+	entry = table_find(&hash->cur, h, cookie, dfid);
+	if (!entry)
+		entry = table_find(&hash->old, h, cookie, dfid);
+
+	return entry ? entry->info : NULL;
+}
+
+struct item_info *hsm_action_hash_insert(struct hsm_action_hash *hash,
+					 struct item_info *info)
+{
+	uint64_t h = action_hash_key(info->cookie, &info->dfid);
+	struct hsm_action_hash_entry *entry;
+
+	entry = table_find(&hash->cur, h, info->cookie, &info->dfid);
+	if (!entry)
+		entry = table_find(&hash->old, h, info->cookie, &info->dfid);
+	if (entry)
+		return entry->info;
+
+	/* a resize in progress finishes long before cur fills up */
+	if (!hash->old.entries)
+		action_hash_grow(hash);
+	table_insert(&hash->cur, h, info);
+	action_hash_migrate(hash, ACTION_HASH_MIGRATE_STEP);
+
+	return info;
+}
+
+bool hsm_action_hash_remove(struct hsm_action_hash *hash, uint64_t cookie,
+			    const struct lu_fid *dfid)
+{
+	uint64_t h = action_hash_key(cookie, dfid);
+	struct hsm_action_hash_entry *entry;
+
+	entry = table_find(&hash->cur, h, cookie, dfid);
+	if (entry) {
+		table_remove(&hash->cur, entry);
+	} else {
+		entry = table_find(&hash->old, h, cookie, dfid);
+		if (!entry)
+			return false;
+		table_remove(&hash->old, entry);
+	}
+	action_hash_migrate(hash, ACTION_HASH_MIGRATE_STEP);
+
+	return true;
+}
+
+size_t hsm_action_hash_count(struct hsm_action_hash *hash)
+{
+	return hash->cur.count + hash->old.count;
+}
+
+static void table_destroy(struct hsm_action_hash_table *table,
+			  void (*free_cb)(struct item_info *info))
+{
+	size_t i;
+
+	for (i = 0; free_cb && i < table->size; i++) {
+		if (entry_live(&table->entries[i]))
+			free_cb(table->entries[i].info);
+	}
+	free(table->entries);
+	memset(table, 0, sizeof(*table));
+}
+
+void hsm_action_hash_destroy(struct hsm_action_hash *hash,
+			     void (*free_cb)(struct item_info *info))
+{
+	table_destroy(&hash->old, free_cb);
+	table_destroy(&hash->cur, free_cb);
+	hash->migrate_pos = 0;
+}
@@ -0,0 +1,207 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Waiting lists kept in age order.
+ *
+ * Lists stay plain cds_lists so everything iterating over them is unchanged,
+ * but requests requeued after a disconnect, a refused send or an expired
+ * batch must go back to their place by (timestamp, arrival) rather than
+ * behind newer requests.
+ *
+ * To find that place without walking the list, hans in a list also form a
+ * treap keyed the same way, with priorities derived from the node address.
+ * There is no root pointer: the tree is reached by walking up from the
+ * list tail, so lists can still be moved around by splicing into an empty
+ * head. New requests (the common case) are newer than the tail and are
+ * added there directly; requeues are O(log n).
+ * Nodes also keep their subtree size, so the position of a request in its
+ * list is O(log n) as well (progress reporting).
+ */
+
+#include "coordinatool.h"
+
+static uint64_t order_seq;
+
+static inline uint64_t order_prio(struct hsm_action_node *han)
+{
+	uint64_t h = (uintptr_t)han;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline unsigned int order_size(struct hsm_action_node *han)
+{
+	return han ? han->order.size : 0;
+}
+
+/* move han one level up, above its parent */
+static void order_rotate_up(struct hsm_action_node *han)
+{
+	struct hsm_action_node *parent = han->order.parent;
+	struct hsm_action_node *grandparent = parent->order.parent;
+	int dir = parent->order.child[1] == han;
+
+	/* han takes parent's place and subtree */
+	han->order.size = parent->order.size;
+
+	parent->order.child[dir] = han->order.child[!dir];
+	if (parent->order.child[dir])
+		parent->order.child[dir]->order.parent = parent;
+	han->order.child[!dir] = parent;
+	parent->order.parent = han;
+	parent->order.size = order_size(parent->order.child[0]) +
+			     order_size(parent->order.child[1]) + 1;
+	han->order.parent = grandparent;
+	if (grandparent)
+		grandparent->order.child[grandparent->order.child[1] ==
+					 parent] = han;
+}
+
+void hsm_action_list_add(struct cds_list_head *list,
+			 struct hsm_action_node *han)
+{
+	struct hsm_action_node *cur, *next = NULL;
+	int dir = 1;
+
+	if (!han->seq)
+		han->seq = ++order_seq;
+	memset(&han->order, 0, sizeof(han->order));
+	han->order.size = 1;
+
+	if (cds_list_empty(list)) {
+		cds_list_add_tail(&han->node, list);
+		return;
+	}
+
+	/* newer than tail: right child of the last node, which has none */
+	cur = caa_container_of(list->prev, struct hsm_action_node, node);
+	if (hsm_action_older(han, cur)) {
+		while (cur->order.parent)
+			cur = cur->order.parent;
+		while (true) {
+			dir = !hsm_action_older(han, cur);
+			if (!dir)
+				next = cur;
+			if (!cur->order.child[dir])
+				break;
+			cur = cur->order.child[dir];
+		}
+	}
+	cur->order.child[dir] = han;
+	han->order.parent = cur;
+	cds_list_add_tail(&han->node, next ? &next->node : list);
+	for (; cur; cur = cur->order.parent)
+		cur->order.size++;
+
+	while (han->order.parent &&
+	       order_prio(han->order.parent) < order_prio(han))
+		order_rotate_up(han);
+}
+
+void hsm_action_list_del(struct hsm_action_node *han)
+{
+	struct hsm_action_node *left, *right, *parent;
+
+	/* push down to a leaf, keeping heap order among children */
+	while (true) {
+		left = han->order.child[0];
+		right = han->order.child[1];
+		if (!left && !right)
+			break;
+		if (!right || (left && order_prio(left) > order_prio(right)))
+			order_rotate_up(left);
+		else
+			order_rotate_up(right);
+	}
+	parent = han->order.parent;
+	if (parent)
+		parent->order.child[parent->order.child[1] == han] = NULL;
+	for (; parent; parent = parent->order.parent)
+		parent->order.size--;
+	memset(&han->order, 0, sizeof(han->order));
+
+	cds_list_del(&han->node);
+}
+
+void hsm_action_list_splice(struct cds_list_head *from,
+			    struct cds_list_head *list)
+{
+	struct cds_list_head *n, *nnext;
+
+	if (cds_list_empty(list)) {
+		/* tree has no root pointer, it moves with the nodes */
+		cds_list_splice(from, list);
+		CDS_INIT_LIST_HEAD(from);
+		return;
+	}
+
+	cds_list_for_each_safe(n, nnext, from)
+	{
+		struct hsm_action_node *han =
+			caa_container_of(n, struct hsm_action_node, node);
+
+		hsm_action_list_del(han);
+		hsm_action_list_add(list, han);
+	}
+}
+
+size_t hsm_action_list_rank(struct hsm_action_node *han)
+{
+	size_t rank = order_size(han->order.child[0]);
+
+	for (; han->order.parent; han = han->order.parent) {
+		struct hsm_action_node *parent = han->order.parent;
+
+		if (parent->order.child[1] == han)
+			rank += order_size(parent->order.child[0]) + 1;
+	}
+	return rank;
+}
+
+size_t hsm_action_list_count_older(struct cds_list_head *list,
+				   struct hsm_action_node *han)
+{
+	struct hsm_action_node *cur;
+	size_t count = 0;
+
+	if (cds_list_empty(list))
+		return 0;
+
+	cur = caa_container_of(list->prev, struct hsm_action_node, node);
+	while (cur->order.parent)
+		cur = cur->order.parent;
+	while (cur) {
+		if (hsm_action_older(cur, han)) {
+			count += order_size(cur->order.child[0]) + 1;
+			cur = cur->order.child[1];
+		} else {
+			cur = cur->order.child[0];
+		}
+	}
+	return count;
+}
+
+size_t hsm_action_list_count_until(struct cds_list_head *list,
+				   int64_t timestamp)
+{
+	struct hsm_action_node *cur;
+	size_t count = 0;
+
+	if (cds_list_empty(list) || timestamp < 0)
+		return 0;
+
+	cur = caa_container_of(list->prev, struct hsm_action_node, node);
+	while (cur->order.parent)
+		cur = cur->order.parent;
+	while (cur) {
+		if (cur->info.timestamp <= (uint64_t)timestamp) {
+			count += order_size(cur->order.child[0]) + 1;
+			cur = cur->order.child[1];
+		} else {
+			cur = cur->order.child[0];
+		}
+	}
+	return count;
+}
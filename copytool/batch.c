@@ -15,38 +15,77 @@ static bool batch_still_reserved(struct client_batch *batch, uint64_t now_ns)
 	if (batch->expire_max_ns && batch->expire_max_ns < now_ns)
 		return false;
 	if (batch->expire_idle_ns && batch->expire_idle_ns < now_ns &&
-	    cds_list_empty(&batch->waiting_archive))
+	    hsm_action_queue_empty(&batch->waiting_archive))
 		return false;
 	return true;
 }
 
+/* Index of all slots with a hint, of connected and disconnected clients
+ * (the latter are taken over on reconnect), so matching an archive to its
+ * batch does not walk every slot of every client. */
+static void batch_hint_add(struct client_batch *batch)
+{
+	chain_hash_add(&state->batch_hints, &batch->hash_node,
+		       intern_hash(batch->hint));
+}
+
+static void batch_hint_del(struct client_batch *batch)
+{
+	if (!batch->hint)
+		return;
+	chain_hash_del(&state->batch_hints, &batch->hash_node);
+}
+
+/* slot with hint after batch, the first one if batch is NULL */
+static struct client_batch *batch_hint_next(struct client_batch *batch,
+					    const char *hint)
+{
+	size_t hash = intern_hash(hint);
+	struct chain_hash_node *node;
+
+	node = batch ? chain_hash_next(&batch->hash_node, hash) :
+		       chain_hash_first(&state->batch_hints, hash);
+	for (; node; node = chain_hash_next(node, hash)) {
+		batch = caa_container_of(node, struct client_batch, hash_node);
+		if (batch->hint == hint)
+			return batch;
+	}
+	return NULL;
+}
+
+#define batch_hint_for_each(batch, hint)                \
+	for (batch = batch_hint_next(NULL, hint); batch; \
+	     batch = batch_hint_next(batch, hint))
+
+void batch_hints_destroy(void)
+{
+	chain_hash_destroy(&state->batch_hints);
+}
+
 /* Find a matching slot.
  * Does not check deadlines. */
 static int batch_find_slot(struct client *client, struct hsm_action_node *han)
 {
-	int i;
-	for (i = 0; i < state->config.batch_slots; i++) {
-		/* skip empty slots, non-matches */
-		if (!client->batch[i].hint) {
-			continue;
-		}
-		if (strcmp(client->batch[i].hint, han->info.data))
-			continue;
-		return i;
+	struct client_batch *batch;
+
+	batch_hint_for_each(batch, han->info.data)
+	{
+		if (batch->client == client)
+			return batch - client->batch;
 	}
 	return -1;
 }
 
-/* return list, if han was given this is a new batch so populate hint & start time */
-static struct cds_list_head *batch_slot_list(struct client *client,
-					     int batch_index,
-					     struct hsm_action_node *han,
-					     uint64_t now_ns)
+/* return queue, if han was given this is a new batch so populate hint & start time */
+static struct hsm_action_queue *batch_slot_list(struct client *client,
+						int batch_index,
+						struct hsm_action_node *han,
+						uint64_t now_ns)
 {
 	struct client_batch *batch = &client->batch[batch_index];
 
 	if (han) {
-		if (batch->hint && !strcmp(han->info.data, batch->hint))
+		if (batch->hint == han->info.data)
 			LOG_INFO(
 				"Batches: client %s (%d): refreshing batch '%s'",
 				client->id, client->fd, han->info.data);
@@ -55,8 +94,10 @@ static struct cds_list_head *batch_slot_list(struct client *client,
 				"Batches: client %s (%d): new batch for '%s' (was '%s')",
 				client->id, client->fd, han->info.data,
 				batch->hint ?: "(free)");
-		free(batch->hint);
-		batch->hint = xstrdup(han->info.data);
+		batch_hint_del(batch);
+		intern_put(batch->hint);
+		batch->hint = intern_get(han->info.data);
+		batch_hint_add(batch);
 		batch->expire_max_ns =
 			state->config.batch_slice_max ?
 				now_ns + state->config.batch_slice_max :
@@ -71,7 +112,7 @@ static struct cds_list_head *batch_slot_list(struct client *client,
 	return &batch->waiting_archive;
 }
 
-struct cds_list_head *schedule_batch_slot_active(struct hsm_action_node *han)
+struct hsm_action_queue *schedule_batch_slot_active(struct hsm_action_node *han)
 {
 	/* only batch archive, with hint data */
 	if (han->info.action != HSMA_ARCHIVE || !han->info.data ||
@@ -82,18 +123,16 @@ struct cds_list_head *schedule_batch_slot_active(struct hsm_action_node *han)
 	if (state->config.batch_slice_idle == 0)
 		return NULL;
 
-	/* If this becomes a performance problem we can make a hash table... */
-	struct cds_list_head *clients = &state->stats.clients, *n;
+	struct client_batch *batch;
 	uint64_t now_ns = gettime_ns();
 
 	/* got a match? */
-	cds_list_for_each(n, clients)
+	batch_hint_for_each(batch, han->info.data)
 	{
-		struct client *client =
-			caa_container_of(n, struct client, node_clients);
-		int i = batch_find_slot(client, han);
+		struct client *client = batch->client;
+		int i = batch - client->batch;
 
-		if (i < 0)
+		if (client->status == CLIENT_DISCONNECTED)
 			continue;
 
 		/* found a batch, if still reserved use it. */
@@ -102,14 +141,14 @@ struct cds_list_head *schedule_batch_slot_active(struct hsm_action_node *han)
 
 		/* batch is expired... If no other work waiting re-use it anyway for better
 		 * locality. */
-		if (cds_list_empty(&client->queues.waiting_archive))
+		if (hsm_action_queue_empty(&client->queues.waiting_archive))
 			/* pass han to re-set start time */
 			return batch_slot_list(client, i, han, now_ns);
 	}
 	return NULL;
 }
 
-struct cds_list_head *schedule_batch_slot_new(struct hsm_action_node *han)
+struct hsm_action_queue *schedule_batch_slot_new(struct hsm_action_node *han)
 {
 	/* only batch archive */
 	if (han->info.action != HSMA_ARCHIVE)
@@ -147,7 +186,7 @@ struct cds_list_head *schedule_batch_slot_new(struct hsm_action_node *han)
 			/* expired and no pending work */
 			if (batch_still_reserved(batch, now_ns))
 				continue;
-			if (!cds_list_empty(&batch->waiting_archive))
+			if (!hsm_action_queue_empty(&batch->waiting_archive))
 				continue;
 
 			return batch_slot_list(client, i, han, now_ns);
@@ -166,16 +205,15 @@ struct cds_list_head *schedule_batch_slot_new(struct hsm_action_node *han)
 			if (batch_still_reserved(batch, now_ns))
 				continue;
 
-			/* XXX re-insert based on timestamp; get them to reschedule?
-			 * probably something like:
+			/* XXX get them to reschedule? probably something like:
 			 * - splice this to temporary list head
 			 * - reallocate this batch through batch_slot_list for current han
 			 * - then we can call hsm_action_requeue() on all items in the temporary
 			 *   list
-			 * Until then requeue to same client for archive_on_host setting */
-			cds_list_splice(&batch->waiting_archive,
-					&client->queues.waiting_archive);
-			CDS_INIT_LIST_HEAD(&batch->waiting_archive);
+			 * Until then requeue to same client for archive_on_host setting,
+			 * merged by age with what was already there */
+			hsm_action_queue_splice(&batch->waiting_archive,
+						&client->queues.waiting_archive);
 			return batch_slot_list(client, i, han, now_ns);
 		}
 	}
@@ -184,8 +222,9 @@ struct cds_list_head *schedule_batch_slot_new(struct hsm_action_node *han)
 	return NULL;
 }
 
-struct cds_list_head *schedule_batch_slot_on_client(struct client *client,
-						    struct hsm_action_node *han)
+struct hsm_action_queue *
+schedule_batch_slot_on_client(struct client *client,
+			      struct hsm_action_node *han)
 {
 	uint64_t now_ns = gettime_ns();
 
@@ -211,23 +250,34 @@ struct cds_list_head *schedule_batch_slot_on_client(struct client *client,
 	return NULL;
 }
 
+/* first archive to serve on client queue, or global queue if none */
+static struct hsm_action_node *batch_oldest_waiting(struct client *client)
+{
+	struct hsm_action_subqueue *sq;
+
+	sq = hsm_action_queue_oldest(&client->queues.waiting_archive, NULL);
+	if (!sq)
+		sq = hsm_action_queue_oldest(&state->queues.waiting_archive,
+					     NULL);
+	if (!sq)
+		return NULL;
+	return caa_container_of(sq->actions.next, struct hsm_action_node,
+				node);
+}
+
 void batch_reschedule_client(struct client *client)
 {
 	/* We're only doing this for archives that have multiple queues per client,
 	 * and could otherwise get stuck.
 	 * Further rework might do something similar for waiting restores */
-	struct cds_list_head *schedule_archive_lists[] = {
+	struct hsm_action_queue *archive_queues[] = {
 		&client->queues.waiting_archive, &state->queues.waiting_archive,
 		NULL
 	};
-	struct cds_list_head **archive_lists = schedule_archive_lists;
-	struct cds_list_head *n =
-		cds_manylists_next(archive_lists[0], &archive_lists);
-	/* nothing waiting in local queue, try global one*/
-	if (!n)
+	struct hsm_action_node *han = batch_oldest_waiting(client);
+	/* nothing waiting in local queue nor global one */
+	if (!han)
 		return;
-	struct hsm_action_node *han =
-		caa_container_of(n, struct hsm_action_node, node);
 
 	/* XXX optim: limit to only check every x secs?
 	 * we'll need some sort of timer to retrigger this after a while in cas
@@ -251,30 +301,67 @@ void batch_reschedule_client(struct client *client)
 		 * lead to batches being split if more same requests come but this
 		 * will require some rework to improve
 		 */
-		cds_list_splice(&batch->waiting_archive,
-				&client->queues.waiting_archive);
-		CDS_INIT_LIST_HEAD(&batch->waiting_archive);
+		hsm_action_queue_splice(&batch->waiting_archive,
+					&client->queues.waiting_archive);
 
-		struct cds_list_head *list =
+		struct hsm_action_queue *queue =
 			batch_slot_list(client, i, han, now_ns);
-		hsm_action_requeue(han, list);
-
-		/* find all other pending actions that could match */
-		struct cds_list_head *n, *nnext;
-		int j;
-		cds_manylists_for_each_safe(j, n, nnext, archive_lists)
-		{
-			han = caa_container_of(n, struct hsm_action_node, node);
-			if (strcmp(batch->hint, han->info.data))
-				continue;
-			hsm_action_requeue(han, list);
+		hsm_action_requeue(han, queue);
+
+		/* find all other pending actions that could match,
+		 * whatever their archive id */
+		for (int j = 0; archive_queues[j]; j++) {
+			struct hsm_action_subqueue *sq;
+
+			cds_list_for_each_entry(sq, &archive_queues[j]->subqueues,
+						node)
+			{
+				struct hsm_action_node *nexthan;
+
+				cds_list_for_each_entry_safe(han, nexthan,
+							     &sq->actions, node)
+				{
+					if (batch->hint != han->info.data)
+						continue;
+					hsm_action_requeue(han, queue);
+				}
+			}
 		}
 
 		/* get a new han for next slot */
-		n = cds_manylists_next(archive_lists[0], &archive_lists);
-		if (!n)
+		han = batch_oldest_waiting(client);
+		if (!han)
 			return;
-		han = caa_container_of(n, struct hsm_action_node, node);
+	}
+}
+
+void batch_slots_takeover(struct client *client, struct client *old_client)
+{
+	for (int i = 0; i < state->config.batch_slots; i++) {
+		struct client_batch *batch = &client->batch[i];
+		struct client_batch *old = &old_client->batch[i];
+
+		batch_hint_del(old);
+		*batch = *old;
+		batch->client = client;
+		batch->hash_node.next = NULL;
+		batch->current_count = 0;
+		hsm_action_queue_init(&batch->waiting_archive);
+		hsm_action_queue_splice(&old->waiting_archive,
+					&batch->waiting_archive);
+		if (batch->hint)
+			batch_hint_add(batch);
+		/* avoid frees */
+		old->hint = NULL;
+	}
+}
+
+void batch_slots_free(struct client *client)
+{
+	for (int i = 0; i < state->config.batch_slots; i++) {
+		batch_hint_del(&client->batch[i]);
+		intern_put(client->batch[i].hint);
+		client->batch[i].hint = NULL;
 	}
 }
 
@@ -292,12 +379,8 @@ bool batch_slot_can_send(struct client *client, struct hsm_action_node *han)
 
 	assert(han->info.data);
 
-	for (i = 0; i < state->config.batch_slots; i++) {
-		/* skip empty slots, non-matches */
-		if (!client->batch[i].hint)
-			continue;
-		if (strcmp(client->batch[i].hint, han->info.data))
-			continue;
+	i = batch_find_slot(client, han);
+	if (i >= 0) {
 		/* XXX check expire idle/max limits, but if there are other free slots or
 		 * no other pending work then re-allocate the slot immediately in place
 		 * and allow request.
@@ -309,7 +392,7 @@ bool batch_slot_can_send(struct client *client, struct hsm_action_node *han)
 		return true;
 	}
 
-	hsm_action_requeue(han, NULL);
+	/* caller reschedules it */
 	return false;
 }
 
@@ -318,9 +401,9 @@ static bool client_has_waiting_archives(struct client *client)
 	/* If archive host mapping is set then we only consider the given
 	 * client as requests are routed early, if it is not used then also
 	 * look at global queue */
-	return !cds_list_empty(&client->queues.waiting_archive) ||
+	return !hsm_action_queue_empty(&client->queues.waiting_archive) ||
 	       (cds_list_empty(&state->config.archive_mappings) &&
-		!cds_list_empty(&state->queues.waiting_archive));
+		!hsm_action_queue_empty(&state->queues.waiting_archive));
 }
 
 uint64_t batch_next_expiry(void)
@@ -335,8 +418,8 @@ uint64_t batch_next_expiry(void)
 		client = caa_container_of(n, struct client, node_clients);
 
 		/* client has no work pending: don't bother */
-		if (cds_list_empty(&state->queues.waiting_archive) &&
-		    cds_list_empty(&client->queues.waiting_archive))
+		if (hsm_action_queue_empty(&state->queues.waiting_archive) &&
+		    hsm_action_queue_empty(&client->queues.waiting_archive))
 			continue;
 
 		for (i = 0; i < state->config.batch_slots; i++) {
@@ -349,7 +432,8 @@ uint64_t batch_next_expiry(void)
 			if (client->batch[i].expire_idle_ns >
 				    EXPIRED_DEADLINE &&
 			    closest_ns > client->batch[i].expire_idle_ns &&
-			    cds_list_empty(&client->batch[i].waiting_archive) &&
+			    hsm_action_queue_empty(
+				    &client->batch[i].waiting_archive) &&
 			    client_has_waiting_archives(client))
 				closest_ns = client->batch[i].expire_idle_ns;
 		}
@@ -369,8 +453,8 @@ void batch_clear_expired(uint64_t now_ns)
 		client = caa_container_of(n, struct client, node_clients);
 
 		/* client has no work pending: don't bother */
-		if (cds_list_empty(&state->queues.waiting_archive) &&
-		    cds_list_empty(&client->queues.waiting_archive))
+		if (hsm_action_queue_empty(&state->queues.waiting_archive) &&
+		    hsm_action_queue_empty(&client->queues.waiting_archive))
 			continue;
 
 		for (i = 0; i < state->config.batch_slots; i++) {
@@ -382,7 +466,8 @@ void batch_clear_expired(uint64_t now_ns)
 					EXPIRED_DEADLINE;
 			if (client->batch[i].expire_idle_ns &&
 			    now_ns > client->batch[i].expire_idle_ns &&
-			    cds_list_empty(&client->batch[i].waiting_archive) &&
+			    hsm_action_queue_empty(
+				    &client->batch[i].waiting_archive) &&
 			    client_has_waiting_archives(client))
 				client->batch[i].expire_idle_ns =
 					EXPIRED_DEADLINE;
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Index of clients by id.
+ *
+ * Covers clients past EHLO (whose id will no longer change) and
+ * disconnected clients kept around for recovery, so host mappings, phobos
+ * routing and reconnects don't walk the client lists for every action.
+ * Chained through client->hash_node; both kinds share the table and
+ * lookups filter on status.
+ */
+
+#include "coordinatool.h"
+
+static inline size_t client_hash_of(const char *id)
+{
+	return dbj2(id, strlen(id));
+}
+
+void client_hash_add(struct client *client)
+{
+	chain_hash_add(&state->clients_by_id, &client->hash_node,
+		       client_hash_of(client->id));
+}
+
+void client_hash_del(struct client *client)
+{
+	chain_hash_del(&state->clients_by_id, &client->hash_node);
+}
+
+struct client *find_client(const char *id, bool disconnected)
+{
+	struct chain_hash_node *node;
+
+	chain_hash_for_each(node, &state->clients_by_id, client_hash_of(id))
+	{
+		struct client *client =
+			caa_container_of(node, struct client, hash_node);
+
+		if ((client->status == CLIENT_DISCONNECTED) != disconnected)
+			continue;
+		if (!strcmp(id, client->id))
+			return client;
+	}
+	return NULL;
+}
+
+void client_hash_destroy(void)
+{
+	chain_hash_destroy(&state->clients_by_id);
+}
@@ -9,6 +9,48 @@
 
 static const char *SPACES = " \t\n\r\f\v";
 
+static void config_free_host_mapping(struct host_mapping *mapping)
+{
+	int i;
+
+	free((void *)mapping->tag);
+	for (i = 0; i < mapping->count; i++)
+		free((void *)mapping->hosts[i].name);
+	free(mapping);
+}
+
+/* host, or host[:weight] for consistent hash. The weight is a trailing
+ * ':' and digits only, a token ending any other way is all name, colons
+ * included. Names that end in ':' and digits themselves (unix:<pid>,
+ * host:port client ids) need an explicit weight, e.g. unix:1234:1 */
+static int config_parse_mapping_host(struct host_mapping_host *host,
+				     const char *val, bool weighted)
+{
+	const char *sep = weighted ? strrchr(val, ':') : NULL;
+	long weight = 1;
+
+	if (sep && (sep == val || !sep[1] ||
+		    sep[1 + strspn(sep + 1, "0123456789")]))
+		sep = NULL;
+
+	if (sep) {
+		weight = parse_int(sep + 1, HOST_WEIGHT_MAX, "host weight");
+		if (weight <= 0) {
+			LOG_ERROR(-EINVAL,
+				  "Invalid weight for host %s (append ':1' "
+				  "if that is part of its name)",
+				  val);
+			return -EINVAL;
+		}
+		host->name = xmemdup0(val, sep - val);
+	} else {
+		host->name = xstrdup(val);
+	}
+	host->weight = weight;
+	host->hash = dbj2(host->name, strlen(host->name));
+	return 0;
+}
+
 static int config_parse_host_mapping(struct cds_list_head *head, char *val,
 				     const char *key)
 {
@@ -29,22 +71,27 @@ static int config_parse_host_mapping(struct cds_list_head *head, char *val,
 			 data_pattern);
 		return 0;
 	}
-	struct host_mapping *mapping =
-		xmalloc(sizeof(*mapping) + sizeof(void *));
+	struct host_mapping *mapping = xmalloc(sizeof(*mapping));
 	mapping->tag = xstrdup(data_pattern);
 	mapping->hash_count =
 		hash_count ? parse_int(hash_count, INT_MAX, "hash_count") : 0;
 	mapping->consistent_hash =
 		strcmp(key, "archive_on_hosts_ch") == 0 ? true : false;
-	mapping->count = 1;
-	mapping->hosts[0] = xstrdup(host);
-	while ((host = strtok(NULL, SPACES))) {
+	mapping->count = 0;
+	do {
 		mapping->count++;
 		mapping = xrealloc(mapping,
 				   sizeof(*mapping) +
-					   mapping->count * sizeof(void *));
-		mapping->hosts[mapping->count - 1] = xstrdup(host);
-	}
+					   mapping->count *
+						   sizeof(mapping->hosts[0]));
+		if (config_parse_mapping_host(
+			    &mapping->hosts[mapping->count - 1], host,
+			    mapping->consistent_hash)) {
+			mapping->count--;
+			config_free_host_mapping(mapping);
+			return -EINVAL;
+		}
+	} while ((host = strtok(NULL, SPACES)));
 
 #ifdef DEBUG_ACTION_NODE
 	CDS_INIT_LIST_HEAD(&mapping->node);
@@ -53,6 +100,69 @@ static int config_parse_host_mapping(struct cds_list_head *head, char *val,
 	return 0;
 }
 
+static int config_parse_fair_share_weight(struct cds_list_head *head,
+					  char *val)
+{
+	char *tenant = strtok(val, SPACES);
+	char *weight_str = strtok(NULL, SPACES);
+	int weight;
+
+	if (!tenant || !weight_str)
+		return -EINVAL;
+	weight = parse_int(weight_str, INT_MAX, "fair_share_weight");
+	if (weight <= 0)
+		return -EINVAL;
+
+	struct fair_share_weight *entry = xmalloc(sizeof(*entry));
+	entry->tenant = xstrdup(tenant);
+	entry->weight = weight;
+#ifdef DEBUG_ACTION_NODE
+	CDS_INIT_LIST_HEAD(&entry->node);
+#endif
+	cds_list_add(&entry->node, head);
+	return 0;
+}
+
+static int config_parse_priority_rule(struct cds_list_head *head, char *val)
+{
+	char *action = strtok(val, SPACES);
+	char *pattern = strtok(NULL, SPACES);
+	char *priority_str = strtok(NULL, SPACES);
+	struct priority_rule *rule;
+	int priority;
+
+	if (!action || !pattern || !priority_str)
+		return -EINVAL;
+	priority = parse_int(priority_str, PRIORITY_MAX, "priority_rule class");
+	if (priority < 0)
+		return -EINVAL;
+
+	rule = xcalloc(1, sizeof(*rule));
+	if (!strcasecmp(action, "restore")) {
+		rule->action = HSMA_RESTORE;
+	} else if (!strcasecmp(action, "archive")) {
+		rule->action = HSMA_ARCHIVE;
+	} else if (!strcasecmp(action, "remove")) {
+		rule->action = HSMA_REMOVE;
+	} else {
+		LOG_ERROR(-EINVAL,
+			  "priority_rule action '%s' is not restore, archive "
+			  "or remove",
+			  action);
+		free(rule);
+		return -EINVAL;
+	}
+	if (strcmp(pattern, "*"))
+		rule->pattern = xstrdup(pattern);
+	rule->priority = priority;
+#ifdef DEBUG_ACTION_NODE
+	CDS_INIT_LIST_HEAD(&rule->node);
+#endif
+	/* first matching rule wins: keep config order */
+	cds_list_add_tail(&rule->node, head);
+	return 0;
+}
+
 static int config_parse(struct state_config *config, int fail_enoent)
 {
 	int rc = -EINVAL;
@@ -117,6 +227,13 @@ static int config_parse(struct state_config *config, int fail_enoent)
 			LOG_INFO("config setting port to %s", config->port);
 			continue;
 		}
+		if (!strcasecmp(key, "listen_unix")) {
+			free((void *)config->listen_unix);
+			config->listen_unix = xstrdup(val);
+			LOG_INFO("config setting listen_unix to %s",
+				 config->listen_unix);
+			continue;
+		}
 		if (!strcasecmp(key, "redis_host")) {
 			free((void *)config->redis_host);
 			config->redis_host = xstrdup(val);
@@ -194,6 +311,44 @@ static int config_parse(struct state_config *config, int fail_enoent)
 				 config->client_grace_ms);
 			continue;
 		}
+		if (!strcasecmp(key, "client_send_hwm")) {
+			long long intval =
+				str_suffix_to_u32(val, "client_send_hwm");
+			if (intval < 0)
+				goto err;
+			config->client_send_hwm = intval;
+			LOG_INFO("config setting client_send_hwm to %zu",
+				 config->client_send_hwm);
+			continue;
+		}
+		if (!strcasecmp(key, "listen_backlog")) {
+			config->listen_backlog =
+				parse_int(val, INT_MAX, "listen_backlog");
+			if (config->listen_backlog < 0)
+				goto err;
+			LOG_INFO("config setting listen_backlog to %d",
+				 config->listen_backlog);
+			continue;
+		}
+		if (!strcasecmp(key, "ehlo_per_iteration")) {
+			config->ehlo_per_iteration =
+				parse_int(val, INT_MAX, "ehlo_per_iteration");
+			if (config->ehlo_per_iteration < 0)
+				goto err;
+			LOG_INFO("config setting ehlo_per_iteration to %d",
+				 config->ehlo_per_iteration);
+			continue;
+		}
+		if (!strcasecmp(key, "compress_threshold")) {
+			long long intval =
+				str_suffix_to_u32(val, "compress_threshold");
+			if (intval < 0)
+				goto err;
+			config->compress_threshold = intval;
+			LOG_INFO("config setting compress_threshold to %zu",
+				 config->compress_threshold);
+			continue;
+		}
 		if (!strcasecmp(key, "reporting_hint")) {
 			free((void *)config->reporting_hint);
 			/* add trailing = now */
@@ -206,6 +361,57 @@ static int config_parse(struct state_config *config, int fail_enoent)
 			config->reporting_hint = copy;
 			continue;
 		}
+		if (!strcasecmp(key, "fair_share_hint")) {
+			free((void *)config->fair_share_hint);
+			/* add trailing = now, like reporting_hint */
+			int len = strlen(val);
+			char *copy = xmalloc(len + 2);
+			memcpy(copy, val, len);
+			copy[len] = '=';
+			copy[len + 1] = '\0';
+			LOG_INFO("config setting fair_share_hint to '%s'", copy);
+			config->fair_share_hint = copy;
+			continue;
+		}
+		if (!strcasecmp(key, "fair_share_weight")) {
+			if (config_parse_fair_share_weight(
+				    &config->fair_share_weights, val) < 0)
+				goto err;
+			continue;
+		}
+		if (!strcasecmp(key, "priority_hint")) {
+			free((void *)config->priority_hint);
+			int len = strlen(val);
+			char *copy = xmalloc(len + 2);
+			memcpy(copy, val, len);
+			copy[len] = '=';
+			copy[len + 1] = '\0';
+			LOG_INFO("config setting priority_hint to '%s'", copy);
+			config->priority_hint = copy;
+			continue;
+		}
+		if (!strcasecmp(key, "priority_rule")) {
+			if (config_parse_priority_rule(&config->priority_rules,
+						       val) < 0)
+				goto err;
+			continue;
+		}
+		if (!strcasecmp(key, "priority_aging_sec")) {
+			config->priority_aging_ns = parse_int(
+				val, LONG_MAX / NS_IN_SEC, "priority_aging_sec");
+			if (config->priority_aging_ns < 0)
+				goto err;
+			config->priority_aging_ns *= NS_IN_SEC;
+			continue;
+		}
+		if (!strcasecmp(key, "size_from_stat")) {
+			int intval = parse_int(val, 1, "size_from_stat");
+			if (intval < 0)
+				goto err;
+			config->size_from_stat = intval;
+			LOG_INFO("config setting size_from_stat to %d", intval);
+			continue;
+		}
 		if (!strcasecmp(key, "reporting_dir")) {
 			free((void *)config->reporting_dir);
 			config->reporting_dir = xstrdup(val);
@@ -248,6 +454,8 @@ static int config_parse(struct state_config *config, int fail_enoent)
 			continue;
 		if (!strcasecmp(key, "hal_size"))
 			continue;
+		if (!strcasecmp(key, "max_inflight_bytes"))
+			continue;
 
 		LOG_WARN(-EINVAL, "skipping unknown key %s in %s (line %zd)",
 			 key, config->confpath, linenum);
@@ -279,6 +487,10 @@ int config_init(struct state_config *config)
 	config->redis_host = xstrdup("localhost");
 	config->redis_port = 6379;
 	config->client_grace_ms = 600000; /* 10 mins */
+	config->client_send_hwm = 4 * 1024 * 1024;
+	config->compress_threshold = 64 * 1024;
+	config->listen_backlog = 4096;
+	config->ehlo_per_iteration = 8;
 	config->reporting_schedule_interval_ns = 60 * NS_IN_SEC; /* 1 min */
 	config->verbose = LLAPI_MSG_NORMAL;
 	config->batch_slots = 1;
@@ -305,6 +517,7 @@ int config_init(struct state_config *config)
 	/* then overwrite with env */
 	getenv_str("COORDINATOOL_HOST", &config->host);
 	getenv_str("COORDINATOOL_PORT", &config->port);
+	getenv_str("COORDINATOOL_LISTEN_UNIX", &config->listen_unix);
 	getenv_str("COORDINATOOL_REDIS_HOST", &config->redis_host);
 	getenv_int("COORDINATOOL_REDIS_PORT", &config->redis_port);
 	getenv_int("COORDINATOOL_CLIENT_GRACE", &config->client_grace_ms);
@@ -324,20 +537,32 @@ void config_free(struct state_config *config)
 	free((void *)config->confpath);
 	free((void *)config->host);
 	free((void *)config->port);
+	free((void *)config->listen_unix);
 	free((void *)config->redis_host);
 	free((void *)config->reporting_dir);
 	free((void *)config->reporting_hint);
+	free((void *)config->fair_share_hint);
+	free((void *)config->priority_hint);
 
 	struct cds_list_head *n, *nnext;
 	cds_list_for_each_safe(n, nnext, &config->archive_mappings)
 	{
 		struct host_mapping *mapping =
 			caa_container_of(n, struct host_mapping, node);
-		int i;
-		free((void *)mapping->tag);
-		for (i = 0; i < mapping->count; i++) {
-			free((void *)mapping->hosts[i]);
-		}
-		free(mapping);
+		config_free_host_mapping(mapping);
+	}
+	cds_list_for_each_safe(n, nnext, &config->fair_share_weights)
+	{
+		struct fair_share_weight *weight =
+			caa_container_of(n, struct fair_share_weight, node);
+		free((void *)weight->tenant);
+		free(weight);
+	}
+	cds_list_for_each_safe(n, nnext, &config->priority_rules)
+	{
+		struct priority_rule *rule =
+			caa_container_of(n, struct priority_rule, node);
+		free((void *)rule->pattern);
+		free(rule);
 	}
 }
@@ -35,6 +35,22 @@ int epoll_addfd(int epoll_fd, int fd, void *data)
 	return 0;
 }
 
+int epoll_modfd(int epoll_fd, int fd, uint32_t events, void *data)
+{
+	struct epoll_event ev;
+	int rc;
+
+	ev.events = events;
+	ev.data.ptr = data;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		rc = -errno;
+		LOG_ERROR(rc, "Could not modify fd epoll watch");
+		return rc;
+	}
+
+	return 0;
+}
+
 int epoll_delfd(int epoll_fd, int fd)
 {
 	int rc = 0;
@@ -130,6 +146,10 @@ void initiate_termination(void)
 	epoll_delfd(state->epoll_fd, state->hsm_fd);
 	if (state->listen_fd >= 0)
 		close(state->listen_fd);
+	if (state->listen_unix_fd >= 0) {
+		close(state->listen_unix_fd);
+		unlink(state->config.listen_unix);
+	}
 	if (state->timer_fd >= 0)
 		close(state->timer_fd);
 	cds_list_for_each_safe(n, nnext, &state->stats.clients)
@@ -146,6 +166,8 @@ void initiate_termination(void)
 
 		client_free(client);
 	}
+	client_hash_destroy();
+	batch_hints_destroy();
 
 	/* stop redis */
 	if (state->redis_ac) {
@@ -191,7 +213,7 @@ static int lustre_get_fsname(void)
 	return 0;
 }
 
-#define MAX_EVENTS 10
+#define MAX_EVENTS 64
 static int ct_start(void)
 {
 	int rc;
@@ -240,12 +262,19 @@ static int ct_start(void)
 	if (rc < 0)
 		return rc;
 
+	if (state->config.listen_unix) {
+		rc = unix_listen();
+		if (rc < 0)
+			return rc;
+	}
+
 	rc = ct_register();
 	if (rc < 0)
 		return rc;
 
 	LOG_NORMAL("Starting main loop");
 	while (1) {
+		state->ehlo_budget = state->config.ehlo_per_iteration;
 		nfds = epoll_wait(state->epoll_fd, events, MAX_EVENTS, -1);
 		if (nfds < 0 && errno == EINTR)
 			continue;
@@ -261,8 +290,9 @@ static int ct_start(void)
 			}
 			if (events[n].data.fd == state->hsm_fd) {
 				handle_ct_event();
-			} else if (events[n].data.fd == state->listen_fd) {
-				handle_client_connect();
+			} else if (events[n].data.fd == state->listen_fd ||
+				   events[n].data.fd == state->listen_unix_fd) {
+				handle_client_connect(events[n].data.fd);
 			} else if (events[n].data.ptr == state->redis_ac) {
 				if (events[n].events & EPOLLIN) {
 					redisAsyncHandleRead(state->redis_ac);
@@ -302,12 +332,8 @@ static int ct_start(void)
 				}
 				initiate_termination();
 			} else {
-				struct client *client = events[n].data.ptr;
-				if (protocol_read_command(
-					    client->fd, client->id, client,
-					    protocol_cbs, NULL) < 0) {
-					client_disconnect(client);
-				}
+				handle_client_event(events[n].data.ptr,
+						    events[n].events);
 			}
 
 			/* We exit this loop after redis connection closed.
@@ -354,15 +380,20 @@ int main(int argc, char *argv[])
 	// state init
 	struct state mstate = {
 		.listen_fd = -1,
+		.listen_unix_fd = -1,
 		.timer_fd = -1,
 		.reporting_dir_fd = -1,
 	};
 	state = &mstate;
 	CDS_INIT_LIST_HEAD(&mstate.config.archive_mappings);
+	CDS_INIT_LIST_HEAD(&mstate.config.fair_share_weights);
+	CDS_INIT_LIST_HEAD(&mstate.config.priority_rules);
 	CDS_INIT_LIST_HEAD(&mstate.stats.clients);
 	CDS_INIT_LIST_HEAD(&mstate.stats.disconnected_clients);
 	CDS_INIT_LIST_HEAD(&mstate.waiting_clients);
 	CDS_INIT_LIST_HEAD(&mstate.reporting_cleanup_list);
+	CDS_INIT_LIST_HEAD(&mstate.reporting_actions);
+	CDS_INIT_LIST_HEAD(&mstate.tenants);
 
 	/* parse arguments once first just for config */
 	while ((rc = getopt_long(argc, argv, short_opts, long_opts, NULL)) !=
@@ -476,6 +507,10 @@ out:
 		llapi_hsm_copytool_unregister(&mstate.ctdata);
 	}
 	hsm_action_free_all();
+	hsm_action_queues_free(&state->queues);
+	hsm_action_subqueue_hash_destroy();
+	tenants_destroy();
+	intern_destroy();
 	reporting_cleanup();
 	config_free(&mstate.config);
 	free((void *)mstate.fsname);
@@ -111,16 +111,40 @@ struct hsm_action_node {
 	/* list is used to track order of requests in waiting list,
 	 * or dump requests assigned to a client */
 	struct cds_list_head node;
-	/* enriched infos to take scheduling decisions */
+	/* treap over the waiting list han is in, to find its place by
+	 * (timestamp, seq) without walking the list. see action_list.c */
+	struct {
+		struct hsm_action_node *parent;
+		struct hsm_action_node *child[2];
+		unsigned int size; /* of subtree, for ranks */
+	} order;
+	/* arrival order, set on first enqueue: breaks timestamp ties */
+	uint64_t seq;
+	/* waiting queue part han is in, NULL if running */
+	struct hsm_action_subqueue *subqueue;
+	/* fair share tenant, NULL if fair share is disabled */
+	struct tenant *tenant;
+	/* priority class when received, see priority.c */
+	int priority;
+	/* when it was sent to its current client, for completion latency */
+	int64_t sent_ns;
+	/* the action itself and enriched infos to take scheduling
+	 * decisions. json for redis is built when stored, for clients see
+	 * json below */
 	struct item_info {
 		uint64_t cookie;
 		struct lu_fid dfid;
+		struct lu_fid fid;
+		struct hsm_extent extent;
+		uint64_t gid;
 		uint64_t timestamp;
 		size_t hai_len;
 		enum hsm_copytool_action action;
 		uint32_t archive_id;
 		uint64_t hal_flags;
-		const char *data; /* unlike lustre's, nul-terminated */
+		/* bytes to move, 0 if unknown or none (remove) */
+		uint64_t size;
+		const char *data; /* interned, unlike lustre's nul-terminated */
 #if HAVE_PHOBOS
 		char *hsm_fuid;
 #endif
@@ -131,50 +155,194 @@ struct hsm_action_node {
 	int *current_count;
 	/* reporting info if any */
 	struct reporting *reporting;
-	/* json representation of hai */
-	json_t *hai;
+	/* restores with reporting set are in state->reporting_actions,
+	 * with the last waiting position reported */
+	struct cds_list_head reporting_node;
+	unsigned int reporting_pos;
+	/* compact json hai for clients, built the first time it is sent
+	 * in json and kept for later sends. NULL until then */
+	char *json;
+	size_t json_len;
+};
+
+/* intrusive chained hash table, see chain_hash_* in utils.c.
+ * Entries embed a node, the table only holds buckets: the hash value is
+ * kept in the node so growing or removing does not need the key. */
+struct chain_hash_node {
+	struct chain_hash_node *next;
+	size_t hash;
+};
+
+struct chain_hash {
+	struct chain_hash_node **buckets;
+	size_t size; /* power of two */
+	size_t count;
+};
+
+/* (cookie, dfid) index of all actions, see action_hash.c */
+struct hsm_action_hash_entry {
+	uint64_t hash;
+	struct item_info *info;
+};
+
+struct hsm_action_hash_table {
+	struct hsm_action_hash_entry *entries;
+	size_t size; /* power of two */
+	size_t count;
+	size_t tombstones;
+};
+
+struct hsm_action_hash {
+	struct hsm_action_hash_table cur;
+	/* previous table being emptied into cur while resizing */
+	struct hsm_action_hash_table old;
+	size_t migrate_pos;
 };
 
 #define ARCHIVE_ID_UNINIT ((unsigned int)-1)
+#define PRIORITY_MAX 7
+#define PRIORITY_CLASSES (PRIORITY_MAX + 1)
+/* waiting actions with the same (archive_id, hal_flags), oldest first:
+ * a recv reply can only carry one such combination.
+ * Also split by priority class and, with fair share, by tenant. */
+struct hsm_action_subqueue {
+	struct cds_list_head node; /* in queue subqueues */
+	struct cds_list_head empty_node; /* in queue empty, if count is 0 */
+	struct chain_hash_node hash_node; /* in state->subqueues */
+	struct hsm_action_queue *queue;
+	uint32_t archive_id;
+	uint64_t hal_flags;
+	struct tenant *tenant; /* holds a reference */
+	int priority;
+	unsigned int count;
+	/* requests left to send this round robin round, fair share only */
+	unsigned int deficit;
+	/* last ct_schedule_client() class pass done with this subqueue */
+	uint64_t schedule_gen;
+	struct cds_list_head actions;
+};
+
+/* subqueues are never freed while the queue is alive, so the scheduler
+ * can keep pointers: empty ones are reused for new combinations instead */
+struct hsm_action_queue {
+	struct cds_list_head subqueues;
+	struct cds_list_head empty;
+	unsigned int count;
+	/* fair share: subqueue the round robin is at */
+	struct hsm_action_subqueue *drr_next;
+	/* highest class of the subqueue heads, as of that scheduling gen */
+	uint64_t schedule_gen;
+	int schedule_priority;
+};
+
+/* requests with the same fair_share_hint value, see tenant.c */
+struct tenant {
+	const char *name; /* interned hint value, "" without hint */
+	unsigned int weight;
+	unsigned int waiting;
+	long unsigned int served;
+	/* actions and subqueues with it */
+	unsigned int refcount;
+	struct cds_list_head node; /* in state->tenants */
+	struct chain_hash_node hash_node; /* in state->tenants_by_name */
+};
+
 struct hsm_action_queues {
-	struct cds_list_head waiting_restore;
-	struct cds_list_head waiting_archive;
-	struct cds_list_head waiting_remove;
+	struct hsm_action_queue waiting_restore;
+	struct hsm_action_queue waiting_archive;
+	struct hsm_action_queue waiting_remove;
 };
 
+/* consistent hash picks cost one hash per weight unit of each host */
+#define HOST_WEIGHT_MAX 100
 struct host_mapping {
 	struct cds_list_head node;
 	const char *tag;
 	int count;
 	bool consistent_hash;
 	int hash_count;
-	const char *hosts[];
+	struct host_mapping_host {
+		const char *name;
+		/* consistent hash only: share of tag values, and name hash */
+		unsigned int weight;
+		uint64_t hash;
+	} hosts[];
+};
+
+struct fair_share_weight {
+	struct cds_list_head node;
+	const char *tenant;
+	unsigned int weight;
+};
+
+struct priority_rule {
+	struct cds_list_head node;
+	enum hsm_copytool_action action;
+	const char *pattern; /* NULL matches everything */
+	int priority;
 };
 
 /* common types */
 struct client_batch {
 	uint64_t expire_max_ns;
 	uint64_t expire_idle_ns;
-	char *hint;
+	const char *hint; /* interned */
 	int current_count;
-	struct cds_list_head waiting_archive;
+	struct hsm_action_queue waiting_archive;
+	/* owner, and chain in state->batch_hints while hint is set */
+	struct client *client;
+	struct chain_hash_node hash_node;
+};
+
+/* completion estimates for one action type, see client_perf_done() */
+struct client_perf {
+	/* moving average of completion latency, 0 until a first done */
+	int64_t latency_ns;
+	/* moving average of bytes per second, for requests with a size */
+	uint64_t throughput;
+	/* moving average of completions per second while busy, 0 until a
+	 * first window is complete */
+	double done_rate;
+	/* current window: completions and time spent with work in flight */
+	unsigned int window_done;
+	int64_t window_busy_ns;
+	int64_t last_done_ns;
 };
 
 struct client {
 	const char *id; /* id sent by the client during EHLO, or addr */
 	bool id_set; /* set if clients introduce themselves */
 	int fd;
+	/* partial messages received from client */
+	struct protocol_read_buffer rbuf;
+	/* replies not sent yet, EPOLLOUT is armed while this is not empty */
+	struct protocol_write_buffer wbuf;
+	/* message being queued when compressing, compressed as a whole on
+	 * flush */
+	struct protocol_write_buffer msgbuf;
+	bool epollout;
+	bool binary; /* binary protocol negotiated at EHLO */
+	bool compress; /* compression negotiated at EHLO */
 	struct cds_list_head node_clients;
+	/* chain in state->clients_by_id */
+	struct chain_hash_node hash_node;
 	unsigned int done_restore;
 	unsigned int done_archive;
 	unsigned int done_remove;
 	int current_restore;
 	int current_archive;
 	int current_remove;
+	struct client_perf perf_restore;
+	struct client_perf perf_archive;
+	struct client_perf perf_remove;
 	size_t max_bytes;
 	int max_restore;
 	int max_archive;
 	int max_remove;
+	/* size of the requests it is working on, and how much it accepts
+	 * (0 for no limit) */
+	uint64_t inflight_bytes;
+	uint64_t max_inflight_bytes;
 	int *archives;
 	enum client_status {
 		CLIENT_INIT, /* new connection */
@@ -186,7 +354,7 @@ struct client {
 	/* per client queues */
 	struct hsm_action_queues queues;
 	/* pending cancels */
-	struct cds_list_head cancels;
+	struct hsm_action_queue cancels;
 	union { /* status-dependant fields */
 		int64_t disconnected_timestamp;
 		struct cds_list_head waiting_node;
@@ -202,6 +370,11 @@ struct ct_stats {
 	unsigned int pending_archive;
 	unsigned int pending_remove;
 	unsigned int pending_cancel;
+	/* waiting requests by priority class when received */
+	unsigned int pending_priority[PRIORITY_CLASSES];
+	/* known size of waiting and running requests */
+	uint64_t pending_bytes;
+	uint64_t running_bytes;
 	long unsigned int done_restore;
 	long unsigned int done_archive;
 	long unsigned int done_remove;
@@ -217,6 +390,9 @@ struct state {
 		const char *confpath;
 		const char *host;
 		const char *port;
+		const char *listen_unix;
+		int listen_backlog;
+		int ehlo_per_iteration;
 		const char *reporting_hint;
 		const char *reporting_dir;
 		int64_t reporting_schedule_interval_ns;
@@ -224,12 +400,20 @@ struct state {
 		int redis_port;
 		enum llapi_message_level verbose;
 		int client_grace_ms;
+		size_t client_send_hwm;
+		size_t compress_threshold;
 		int archive_cnt;
 		int archives[LL_HSM_MAX_ARCHIVES_PER_AGENT];
 		struct cds_list_head archive_mappings;
 		int64_t batch_slice_idle;
 		int64_t batch_slice_max;
 		int batch_slots;
+		const char *fair_share_hint;
+		struct cds_list_head fair_share_weights;
+		const char *priority_hint;
+		struct cds_list_head priority_rules;
+		int64_t priority_aging_ns;
+		bool size_from_stat;
 	} config;
 	/* options: command line switches only */
 	const char *mntpath;
@@ -240,15 +424,26 @@ struct state {
 	int epoll_fd;
 	int hsm_fd;
 	int listen_fd;
+	int listen_unix_fd;
+	/* EHLO left to process this main loop iteration */
+	int ehlo_budget;
 	int reporting_dir_fd;
 	int timer_fd;
 	int signal_fd;
 	bool terminating;
 	enum protocol_lock locked;
 	struct hsm_action_queues queues;
-	void *hsm_actions_tree;
+	struct hsm_action_hash hsm_actions;
+	struct chain_hash clients_by_id; /* see client_hash.c */
+	struct chain_hash batch_hints; /* see batch.c */
+	struct chain_hash interned; /* see intern.c */
+	struct cds_list_head tenants;
+	struct chain_hash tenants_by_name; /* see tenant.c */
+	/* by (queue, archive_id, hal_flags, tenant, priority) */
+	struct chain_hash subqueues;
 	void *reporting_tree;
 	struct cds_list_head reporting_cleanup_list;
+	struct cds_list_head reporting_actions;
 	struct cds_list_head waiting_clients;
 	struct ct_stats stats;
 };
@@ -265,6 +460,7 @@ extern struct state *state;
 
 int epoll_addfd(int epoll_fd, int fd, void *data);
 int epoll_delfd(int epoll_fd, int fd);
+int epoll_modfd(int epoll_fd, int fd, uint32_t events, void *data);
 
 /* lhsm */
 
@@ -288,6 +484,7 @@ void ct_report_error(struct hsm_action_item *hai, int errcode);
 #define HAI_SIZE_MARGIN (sizeof(struct hsm_action_item) + 100)
 
 extern protocol_read_cb protocol_cbs[];
+extern protocol_read_bin_cb protocol_bin_cbs[];
 
 /**
  * send status reply
@@ -300,14 +497,67 @@ extern protocol_read_cb protocol_cbs[];
  */
 int protocol_reply_status(struct client *client, int verbose, int status,
 			  char *error);
+/* hsm action items for a recv reply, already encoded for the client
+ * protocol: comma separated json objects or binary items */
+struct recv_items {
+	struct protocol_bin_buf buf;
+	unsigned int count;
+};
+/**
+ * send recv reply
+ *
+ * @param items items to send, NULL for errors. Buffer is freed.
+ */
 int protocol_reply_recv(struct client *client, const char *fsname,
 			uint32_t archive_id, uint64_t hal_flags,
-			json_t *hai_list, int status, char *error);
+			struct recv_items *items, int status, char *error);
 int protocol_reply_queue(struct client *client, int enqueued, int skipped,
 			 int status, char *error);
 int protocol_reply_simple(struct client *client, const char *cmd, int status,
 			  char *error);
 
+/* action_hash */
+
+struct item_info *hsm_action_hash_find(struct hsm_action_hash *hash,
+				       uint64_t cookie,
+				       const struct lu_fid *dfid);
+// insert info, or return already present entry with same key
+struct item_info *hsm_action_hash_insert(struct hsm_action_hash *hash,
+					 struct item_info *info);
+bool hsm_action_hash_remove(struct hsm_action_hash *hash, uint64_t cookie,
+			    const struct lu_fid *dfid);
+size_t hsm_action_hash_count(struct hsm_action_hash *hash);
+// free hash, calling free_cb on all entries if set
+void hsm_action_hash_destroy(struct hsm_action_hash *hash,
+			     void (*free_cb)(struct item_info *info));
+
+/* action_list */
+
+// waiting order: by timestamp, then arrival
+static inline bool hsm_action_older(struct hsm_action_node *a,
+				    struct hsm_action_node *b)
+{
+	if (a->info.timestamp != b->info.timestamp)
+		return a->info.timestamp < b->info.timestamp;
+	return a->seq < b->seq;
+}
+// insert han in list, oldest (timestamp, arrival) first
+void hsm_action_list_add(struct cds_list_head *list,
+			 struct hsm_action_node *han);
+// remove han from whatever list it is in
+void hsm_action_list_del(struct hsm_action_node *han);
+// move all of from into list keeping order, from is left empty
+void hsm_action_list_splice(struct cds_list_head *from,
+			    struct cds_list_head *list);
+// number of hans before han in its list
+size_t hsm_action_list_rank(struct hsm_action_node *han);
+// number of hans in list older than han (which is not in list)
+size_t hsm_action_list_count_older(struct cds_list_head *list,
+				   struct hsm_action_node *han);
+// number of hans in list with a timestamp up to timestamp
+size_t hsm_action_list_count_until(struct cds_list_head *list,
+				   int64_t timestamp);
+
 /* queue */
 
 // create new actions (foom json or lustre)
@@ -318,18 +568,33 @@ int hsm_action_new_lustre(struct hsm_action_item *hai, uint32_t archive_id,
 			  uint64_t hal_flags, int64_t timestamp);
 // free one action
 void hsm_action_free(struct hsm_action_node *han);
+// rebuild lustre hai header, without data
+void hsm_action_item_fill(struct hsm_action_node *han,
+			  struct hsm_action_item *hai);
+// build json hai as sent to clients and stored in redis
+json_t *hsm_action_json(struct hsm_action_node *han);
+// append hai to buf, as compact json or binary item
+int hsm_action_encode_json(struct hsm_action_node *han,
+			   struct protocol_bin_buf *buf);
+// drop cached json after changing info
+void hsm_action_json_reset(struct hsm_action_node *han);
+void hsm_action_encode_bin(struct hsm_action_node *han,
+			   struct protocol_bin_buf *buf);
 // free all actions (cleanup on shutdown)
 void hsm_action_free_all(void);
-// enqueue action on specific list
+// enqueue action on specific queue
 // (remove from current list it's in and update stats)
-// if list is empty, try to schedule action
-int hsm_action_enqueue(struct hsm_action_node *han, struct cds_list_head *list);
+// if queue is NULL, try to schedule action
+int hsm_action_enqueue(struct hsm_action_node *han,
+		       struct hsm_action_queue *queue);
+// remove han from its waiting queue or active list
+void hsm_action_dequeue(struct hsm_action_node *han);
 // same as above but remove han from old list first
 static inline int hsm_action_requeue(struct hsm_action_node *han,
-				     struct cds_list_head *list)
+				     struct hsm_action_queue *queue)
 {
-	cds_list_del(&han->node);
-	return hsm_action_enqueue(han, list);
+	hsm_action_dequeue(han);
+	return hsm_action_enqueue(han, queue);
 }
 // same as above but for iterating through a list
 static inline int hsm_action_requeue_all(struct cds_list_head *list)
@@ -349,6 +614,22 @@ static inline int hsm_action_requeue_all(struct cds_list_head *list)
 	}
 	return total;
 }
+// same for all subqueues of a queue
+static inline int hsm_action_queue_requeue_all(struct hsm_action_queue *queue)
+{
+	struct hsm_action_subqueue *subqueue;
+	int rc, total = 0;
+
+	cds_list_for_each_entry(subqueue, &queue->subqueues, node)
+	{
+		rc = hsm_action_requeue_all(&subqueue->actions);
+		if (rc < 0)
+			total = rc;
+		else if (total >= 0)
+			total += rc;
+	}
+	return total;
+}
 // handle cancel from han
 void hsm_action_cancel(struct hsm_action_node *han);
 // start action on given client
@@ -360,9 +641,37 @@ struct hsm_action_node *hsm_action_search(unsigned long cookie,
 
 // init queue lists
 void hsm_action_queues_init(struct hsm_action_queues *queues);
-// get list in queue (by action type)
-struct cds_list_head *get_queue_list(struct hsm_action_queues *queues,
-				     struct hsm_action_node *han);
+void hsm_action_queues_free(struct hsm_action_queues *queues);
+// get queue (by action type)
+struct hsm_action_queue *get_queue_list(struct hsm_action_queues *queues,
+					struct hsm_action_node *han);
+void hsm_action_queue_init(struct hsm_action_queue *queue);
+// free subqueues, actions must have been moved or freed
+void hsm_action_queue_free(struct hsm_action_queue *queue);
+// free the subqueue index, at shutdown
+void hsm_action_subqueue_hash_destroy(void);
+static inline bool hsm_action_queue_empty(struct hsm_action_queue *queue)
+{
+	return queue->count == 0;
+}
+// oldest action of a non-empty subqueue
+static inline struct hsm_action_node *
+hsm_action_subqueue_head(struct hsm_action_subqueue *subqueue)
+{
+	return caa_container_of(subqueue->actions.next, struct hsm_action_node,
+				node);
+}
+// non-empty subqueue with the oldest action of the highest priority class,
+// among accepted archive ids
+struct hsm_action_subqueue *
+hsm_action_queue_oldest(struct hsm_action_queue *queue, int *archives);
+// 1-based position of han by age in all of its queue, 0 if not waiting
+size_t hsm_action_queue_position(struct hsm_action_node *han);
+// move all actions of from into queue keeping age order
+void hsm_action_queue_splice(struct hsm_action_queue *from,
+			     struct hsm_action_queue *queue);
+// accept the archive_id if it is in the list, or if there is no list
+bool accept_archive_id(int *archives, uint32_t archive_id);
 
 /* redis */
 
@@ -374,12 +683,18 @@ int redis_delete_request(uint64_t cookie, struct lu_fid *dfid);
 int redis_recovery(void);
 
 /* batch */
-struct cds_list_head *schedule_batch_slot_active(struct hsm_action_node *han);
-struct cds_list_head *schedule_batch_slot_new(struct hsm_action_node *han);
-struct cds_list_head *
+struct hsm_action_queue *schedule_batch_slot_active(struct hsm_action_node *han);
+struct hsm_action_queue *schedule_batch_slot_new(struct hsm_action_node *han);
+struct hsm_action_queue *
 schedule_batch_slot_on_client(struct client *client,
 			      struct hsm_action_node *han);
 void batch_reschedule_client(struct client *client);
+// give old_client's batch slots and their pending work to client
+void batch_slots_takeover(struct client *client, struct client *old_client);
+// forget client's batch slots before freeing it
+void batch_slots_free(struct client *client);
+void batch_hints_destroy(void);
+// false if han must be rescheduled rather than sent to client
 bool batch_slot_can_send(struct client *client, struct hsm_action_node *han);
 uint64_t batch_next_expiry(void);
 void batch_clear_expired(uint64_t now_ns);
@@ -394,20 +709,119 @@ int report_action(struct hsm_action_node *han, const char *format, ...)
 int64_t report_next_schedule(void);
 void report_pending_receives(int64_t now_ns);
 
+/* slab */
+
+#define SLAB_SIZE (256 * 1024)
+
+struct slab_pool {
+	const char *name;
+	size_t obj_size;
+	unsigned int objs_per_slab; /* 0 until first allocation */
+	struct cds_list_head partial; /* slabs with free objects */
+	struct cds_list_head full;
+	struct slab *empty; /* kept for reuse */
+	size_t slabs;
+	size_t in_use;
+	struct cds_list_head node; /* in slab_pools */
+};
+#define SLAB_POOL_INIT(_name, _size) { .name = (_name), .obj_size = (_size) }
+
+/* all pools that allocated at least once, for status */
+extern struct cds_list_head slab_pools;
+
+// zeroed object from pool
+void *slab_alloc(struct slab_pool *pool);
+void slab_free(void *obj);
+// variable size allocation, from pools for small sizes.
+// Must be freed with slab_blob_free with the same size.
+void *slab_blob_alloc(size_t size);
+void slab_blob_free(const void *blob, size_t size);
+
+/* intern */
+
+// shared nul-terminated copy of data: equal data gets the same pointer
+const char *intern_dup(const char *data, size_t len);
+// take another reference on an interned string
+const char *intern_get(const char *str);
+// drop a reference, NULL is ignored
+void intern_put(const char *str);
+// hash of an interned string, computed once
+size_t intern_hash(const char *str);
+void intern_destroy(void);
+
+/* tenant */
+
+// tenant of a new action from its fair_share_hint, NULL if not configured.
+// Returns a reference, dropped by tenant_put
+struct tenant *tenant_get(struct hsm_action_node *han);
+// take another reference, NULL is ignored
+struct tenant *tenant_ref(struct tenant *tenant);
+// drop a reference, the tenant goes away with its last action, NULL is ignored
+void tenant_put(struct tenant *tenant);
+void tenants_destroy(void);
+
+/* priority */
+
+// priority class of a new action
+int priority_get(struct hsm_action_node *han);
+
+/* client_hash */
+
+// index client by id once it is final (post-EHLO or disconnected)
+void client_hash_add(struct client *client);
+// remove client from index, no-op if it wasn't there
+void client_hash_del(struct client *client);
+// find client by id among connected or disconnected clients
+struct client *find_client(const char *id, bool disconnected);
+void client_hash_destroy(void);
+
 /* scheduler */
 
-struct client *find_client(struct cds_list_head *clients, const char *hostname);
-struct cds_list_head *schedule_on_client(struct client *client,
-					 struct hsm_action_node *han);
-struct cds_list_head *hsm_action_node_schedule(struct hsm_action_node *han);
+struct hsm_action_queue *schedule_on_client(struct client *client,
+					    struct hsm_action_node *han);
+struct hsm_action_queue *hsm_action_node_schedule(struct hsm_action_node *han);
 void ct_schedule(bool rearm_timers);
 void ct_schedule_client(struct client *client);
+// class han of subqueue sq gets sent in at now, with aging
+int schedule_priority(struct hsm_action_subqueue *sq,
+		      struct hsm_action_node *han, int64_t now);
+// record successful completion of han by client at now_ns
+void client_perf_done(struct client *client, struct hsm_action_node *han,
+		      int64_t now_ns);
+// index of the host value maps to in consistent hash mapping
+int host_mapping_pick(struct host_mapping *mapping, const char *value,
+		      size_t value_len);
 
 /* tcp */
 
 int tcp_listen(void);
+int unix_listen(void);
 char *sockaddr2str(struct sockaddr_storage *addr, socklen_t len);
-int handle_client_connect(void);
+int handle_client_connect(int listen_fd);
+void handle_client_event(struct client *client, uint32_t events);
+/**
+ * queue message to client and try to send it immediately
+ * This never disconnects the client: write errors are caught from the main
+ * loop, so it is safe to call while processing a message from client.
+ *
+ * @return 0 on success, -errno on error
+ */
+int client_write(struct client *client, json_t *json);
+/**
+ * queue already encoded data (binary, or preformatted json) without
+ * sending it, call client_write_flush() once the whole message is queued.
+ * client_queue_take takes ownership of buf to avoid copying it.
+ */
+int client_queue_raw(struct client *client, const char *buf, size_t len);
+int client_queue_take(struct client *client, char *buf, size_t len);
+int client_write_flush(struct client *client);
+/* stop scheduling work to clients with too much data left to send */
+static inline bool client_send_throttled(struct client *client)
+{
+	return client->wbuf.pending > state->config.client_send_hwm;
+}
+/* zeroed client with its queues and batch slots set up, listed nowhere */
+struct client *client_alloc(void);
 struct client *client_new_disconnected(const char *id);
 void client_free(struct client *client);
 void client_disconnect(struct client *client);
@@ -421,6 +835,24 @@ void handle_expired_timers(void);
 char *parse_hint(struct hsm_action_node *han, const char *hint_needle,
 		 size_t *hint_len);
 size_t dbj2(const char *buf, size_t size);
+// splitmix64 finalizer: spreads regular keys (dbj2, pointers) over all bits
+uint64_t hash_mix(uint64_t x);
+// chain node with hash value hash, growing the table at load 1
+void chain_hash_add(struct chain_hash *table, struct chain_hash_node *node,
+		    size_t hash);
+// unchain node, no-op if it isn't in table
+void chain_hash_del(struct chain_hash *table, struct chain_hash_node *node);
+// first node with that hash value, or the next one after node.
+// Callers still compare keys, see chain_hash_for_each
+struct chain_hash_node *chain_hash_first(struct chain_hash *table,
+					 size_t hash);
+struct chain_hash_node *chain_hash_next(struct chain_hash_node *node,
+					size_t hash);
+#define chain_hash_for_each(node, table, hash)           \
+	for (node = chain_hash_first(table, hash); node; \
+	     node = chain_hash_next(node, hash))
+// free buckets, entries are left to the caller
+void chain_hash_destroy(struct chain_hash *table);
 /**
  * Replace a substring
  *
@@ -434,8 +866,9 @@ char *replace_string(const char *orig, size_t orig_len, const char *new_value,
 /* phobos */
 #if HAVE_PHOBOS
 int phobos_enrich(struct hsm_action_node *han);
-struct cds_list_head *phobos_schedule(struct hsm_action_node *han);
-bool phobos_can_send(struct client *client, struct hsm_action_node *han);
+struct hsm_action_queue *phobos_schedule(struct hsm_action_node *han);
+bool phobos_can_send(struct client *client, struct hsm_action_node *han,
+		     struct hsm_action_queue **requeue);
 #endif
 
 #endif
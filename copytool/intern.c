@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Refcounted table of hsm data strings.
+ *
+ * Large archive waves typically share a handful of distinct hai_data
+ * values (batch tags, archive_on_hosts tags...). Actions and batch slots
+ * hold references to a single copy, so equal data is also equal by
+ * pointer: batch matching does not need strcmp.
+ * The table itself holds no reference, strings go away with their last
+ * user.
+ */
+
+#include <assert.h>
+
+#include "coordinatool.h"
+
+struct intern {
+	struct chain_hash_node node; /* in state->interned */
+	uint32_t refcount;
+	uint32_t len;
+	char str[];
+};
+
+static inline struct intern *intern_from_str(const char *str)
+{
+	return caa_container_of(str, struct intern, str);
+}
+
+static inline size_t intern_size(uint32_t len)
+{
+	return sizeof(struct intern) + len + 1;
+}
+
+const char *intern_dup(const char *data, size_t len)
+{
+	size_t hash = dbj2(data, len);
+	struct chain_hash_node *node;
+	struct intern *entry;
+
+	assert(len < UINT32_MAX);
+	chain_hash_for_each(node, &state->interned, hash)
+	{
+		entry = caa_container_of(node, struct intern, node);
+		if (entry->len == len && !memcmp(entry->str, data, len)) {
+			entry->refcount++;
+			return entry->str;
+		}
+	}
+
+	entry = slab_blob_alloc(intern_size(len));
+	entry->refcount = 1;
+	entry->len = len;
+	memcpy(entry->str, data, len);
+	entry->str[len] = '\0';
+	chain_hash_add(&state->interned, &entry->node, hash);
+
+	return entry->str;
+}
+
+const char *intern_get(const char *str)
+{
+	intern_from_str(str)->refcount++;
+	return str;
+}
+
+void intern_put(const char *str)
+{
+	struct intern *entry;
+
+	if (!str)
+		return;
+
+	entry = intern_from_str(str);
+	assert(entry->refcount > 0);
+	if (--entry->refcount)
+		return;
+
+	chain_hash_del(&state->interned, &entry->node);
+	slab_blob_free(entry, intern_size(entry->len));
+}
+
+size_t intern_hash(const char *str)
+{
+	return intern_from_str(str)->node.hash;
+}
+
+void intern_destroy(void)
+{
+	struct chain_hash *table = &state->interned;
+	size_t i;
+
+	for (i = 0; i < table->size; i++) {
+		struct chain_hash_node *node = table->buckets[i], *next;
+
+		for (; node; node = next) {
+			struct intern *entry =
+				caa_container_of(node, struct intern, node);
+
+			next = node->next;
+			slab_blob_free(entry, intern_size(entry->len));
+		}
+	}
+	chain_hash_destroy(table);
+}
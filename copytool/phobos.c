@@ -131,17 +131,15 @@ static char *phobos_find_host(struct hsm_action_node *han,
 	return hostname;
 }
 
-struct cds_list_head *phobos_schedule(struct hsm_action_node *han)
+struct hsm_action_queue *phobos_schedule(struct hsm_action_node *han)
 {
 	char *hostname = phobos_find_host(han, NULL);
 	if (hostname == NULL)
 		return NULL;
 
-	struct client *client = find_client(&state->stats.clients, hostname);
-	if (!client) {
-		client = find_client(&state->stats.disconnected_clients,
-				     hostname);
-	}
+	struct client *client = find_client(hostname, false);
+	if (!client)
+		client = find_client(hostname, true);
 	if (!client) {
 		LOG_WARN(-ENOENT,
 			 "phobos: locate " DFID
@@ -153,7 +151,8 @@ struct cds_list_head *phobos_schedule(struct hsm_action_node *han)
 	return schedule_on_client(client, han);
 }
 
-bool phobos_can_send(struct client *client, struct hsm_action_node *han)
+bool phobos_can_send(struct client *client, struct hsm_action_node *han,
+		     struct hsm_action_queue **requeue)
 {
 	char *hostname = phobos_find_host(han, client);
 	bool rc = true;
@@ -166,25 +165,17 @@ bool phobos_can_send(struct client *client, struct hsm_action_node *han)
 		   PFID(&han->info.dfid), hostname, client->id);
 	rc = false;
 
-	struct cds_list_head *n, *found = NULL;
-
-	cds_list_for_each(n, &state->stats.clients)
-	{
-		struct client *client =
-			caa_container_of(n, struct client, node_clients);
+	struct hsm_action_queue *found = NULL;
+	struct client *target = find_client(hostname, false);
 
-		if (!strcmp(hostname, client->id)) {
-			found = schedule_on_client(client, han);
-			break;
-		}
-	}
+	if (target)
+		found = schedule_on_client(target, han);
 	if (!found)
 		found = get_queue_list(&state->queues, han);
 	assert(found);
 
-	/* move the request back into the main queue */
-	/* XXX: cannot report errors back.. */
-	hsm_action_requeue(han, found);
+	/* caller moves the request there */
+	*requeue = found;
 
 out:
 	free(hostname);
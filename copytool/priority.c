@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Priority classes.
+ *
+ * Each request gets a class from 0 to PRIORITY_MAX when it comes in,
+ * higher classes are sent first whatever their action type. The class
+ * comes from, in order:
+ * - the priority_hint value in its hsm data, e.g. prio=6
+ * - the first priority_rule for its action type with a pattern found in
+ *   its hsm data
+ * - defaults that keep the historical restore > remove > archive order,
+ *   with room above and below each for urgent or bulk requests
+ * With priority_aging_sec set, waiting requests also go up one class for
+ * each such interval they waited, so low classes are never starved.
+ */
+
+#include "coordinatool.h"
+
+static int priority_default(enum hsm_copytool_action action)
+{
+	switch (action) {
+	case HSMA_RESTORE:
+		return 4;
+	case HSMA_REMOVE:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+static int priority_from_hint(struct hsm_action_node *han)
+{
+	const char *hint;
+	size_t len, i;
+	int priority = 0;
+
+	hint = parse_hint(han, state->config.priority_hint, &len);
+	if (!hint)
+		return -ENOENT;
+
+	for (i = 0; i < len; i++) {
+		if (hint[i] < '0' || hint[i] > '9' || priority > PRIORITY_MAX)
+			break;
+		priority = priority * 10 + hint[i] - '0';
+	}
+	if (!len || i < len || priority > PRIORITY_MAX) {
+		LOG_INFO("fid " DFID " priority hint '%.*s' is not a class (0-%d)",
+			 PFID(&han->info.dfid), (int)len, hint, PRIORITY_MAX);
+		return -EINVAL;
+	}
+	return priority;
+}
+
+int priority_get(struct hsm_action_node *han)
+{
+	struct priority_rule *rule;
+	int priority;
+
+	if (state->config.priority_hint) {
+		priority = priority_from_hint(han);
+		if (priority >= 0)
+			return priority;
+	}
+
+	cds_list_for_each_entry(rule, &state->config.priority_rules, node)
+	{
+		if (rule->action != han->info.action)
+			continue;
+		if (!rule->pattern || strstr(han->info.data, rule->pattern))
+			return rule->priority;
+	}
+
+	return priority_default(han->info.action);
+}
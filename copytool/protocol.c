@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: LGPL-3.0-or-later */
 
 #include <assert.h>
+#include <inttypes.h>
 #include <limits.h>
 
 #include "coordinatool.h"
@@ -38,15 +39,12 @@ static const char *client_status_to_str(enum client_status status)
 	}
 }
 
-static int protocol_reply_status_dump_list(json_t *parent, const char *key,
-					   struct cds_list_head *list)
+static int protocol_reply_status_append_list(json_t *items,
+					     struct cds_list_head *list)
 {
-	json_t *items = json_array();
-	if (!items)
-		abort();
-
 	struct hsm_action_node *han;
 	int rc;
+
 	cds_list_for_each_entry(han, list, node)
 	{
 		json_t *i = json_pack("{so,sI,ss}", "hai_fid",
@@ -55,7 +53,45 @@ static int protocol_reply_status_dump_list(json_t *parent, const char *key,
 				      han->info.data);
 		if (!i)
 			abort();
-		if ((rc = protocol_setjson_array_append(items, i))) {
+		if ((rc = protocol_setjson_array_append(items, i)))
+			return rc;
+	}
+	return 0;
+}
+
+static int protocol_reply_status_dump_list(json_t *parent, const char *key,
+					   struct cds_list_head *list)
+{
+	json_t *items = json_array();
+	int rc;
+
+	if (!items)
+		abort();
+
+	if ((rc = protocol_reply_status_append_list(items, list))) {
+		json_decref(items);
+		return rc;
+	}
+
+	return protocol_setjson(parent, key, items);
+}
+
+/* queues are dumped one subqueue after the other */
+static int protocol_reply_status_dump_queue(json_t *parent, const char *key,
+					    struct hsm_action_queue *queue)
+{
+	struct hsm_action_subqueue *subqueue;
+	json_t *items = json_array();
+	int rc;
+
+	if (!items)
+		abort();
+
+	cds_list_for_each_entry(subqueue, &queue->subqueues, node)
+	{
+		rc = protocol_reply_status_append_list(items,
+						       &subqueue->actions);
+		if (rc) {
 			json_decref(items);
 			return rc;
 		}
@@ -64,6 +100,26 @@ static int protocol_reply_status_dump_list(json_t *parent, const char *key,
 	return protocol_setjson(parent, key, items);
 }
 
+/* latency_ms_<action>, throughput_<action> (bytes/s) and
+ * done_per_hour_<action> estimates */
+static int protocol_reply_status_perf(json_t *c, const char *action,
+				      struct client_perf *perf)
+{
+	char key[32];
+	int rc;
+
+	snprintf(key, sizeof(key), "latency_ms_%s", action);
+	rc = protocol_setjson_int(c, key, perf->latency_ns / NS_IN_MSEC);
+	if (rc)
+		return rc;
+	snprintf(key, sizeof(key), "throughput_%s", action);
+	rc = protocol_setjson_int(c, key, perf->throughput);
+	if (rc)
+		return rc;
+	snprintf(key, sizeof(key), "done_per_hour_%s", action);
+	return protocol_setjson_int(c, key, perf->done_rate * 3600);
+}
+
 static int protocol_reply_status_client(json_t *clients,
 					struct cds_list_head *head, int verbose)
 {
@@ -84,6 +140,14 @@ static int protocol_reply_status_client(json_t *clients,
 					       client->current_archive)) ||
 		    (rc = protocol_setjson_int(c, "current_remove",
 					       client->current_remove)) ||
+		    (rc = protocol_setjson_int(c, "inflight_bytes",
+					       client->inflight_bytes)) ||
+		    (rc = protocol_reply_status_perf(c, "restore",
+						     &client->perf_restore)) ||
+		    (rc = protocol_reply_status_perf(c, "archive",
+						     &client->perf_archive)) ||
+		    (rc = protocol_reply_status_perf(c, "remove",
+						     &client->perf_remove)) ||
 		    (rc = protocol_setjson_int(c, "done_restore",
 					       client->done_restore)) ||
 		    (rc = protocol_setjson_int(c, "done_archive",
@@ -97,16 +161,16 @@ static int protocol_reply_status_client(json_t *clients,
 		     ((rc = protocol_reply_status_dump_list(
 			       c, "active_requests",
 			       &client->active_requests)) ||
-		      (rc = protocol_reply_status_dump_list(
+		      (rc = protocol_reply_status_dump_queue(
 			       c, "waiting_restore",
 			       &client->queues.waiting_restore)) ||
-		      (rc = protocol_reply_status_dump_list(
+		      (rc = protocol_reply_status_dump_queue(
 			       c, "waiting_remove",
 			       &client->queues.waiting_remove)) ||
-		      (rc = protocol_reply_status_dump_list(
+		      (rc = protocol_reply_status_dump_queue(
 			       c, "waiting_archive",
 			       &client->queues.waiting_archive)) ||
-		      (rc = protocol_reply_status_dump_list(
+		      (rc = protocol_reply_status_dump_queue(
 			       c, "cancels", &client->cancels))))) {
 			json_decref(c);
 			return rc;
@@ -131,7 +195,7 @@ static int protocol_reply_status_client(json_t *clients,
 						       batch->expire_max_ns /
 							       NS_IN_SEC)) ||
 			    (verbose >= LLAPI_MSG_DEBUG &&
-			     (rc = protocol_reply_status_dump_list(
+			     (rc = protocol_reply_status_dump_queue(
 				      b, "waiting_archive",
 				      &batch->waiting_archive)))) {
 				json_decref(b);
@@ -164,6 +228,104 @@ static int protocol_reply_status_client(json_t *clients,
 	return 0;
 }
 
+static int protocol_reply_status_slabs(json_t *reply)
+{
+	struct slab_pool *pool;
+	json_t *slabs;
+	int rc;
+
+	slabs = json_array();
+	if (!slabs)
+		abort();
+
+	cds_list_for_each_entry(pool, &slab_pools, node)
+	{
+		size_t free_objs =
+			pool->slabs * pool->objs_per_slab - pool->in_use;
+		json_t *s = json_object();
+
+		if (!s)
+			abort();
+		if ((rc = protocol_setjson_str(s, "name", pool->name)) ||
+		    (rc = protocol_setjson_int(s, "object_size",
+					       pool->obj_size)) ||
+		    (rc = protocol_setjson_int(s, "in_use", pool->in_use)) ||
+		    (rc = protocol_setjson_int(s, "free", free_objs)) ||
+		    (rc = protocol_setjson_int(s, "bytes",
+					       pool->slabs * SLAB_SIZE))) {
+			json_decref(s);
+			json_decref(slabs);
+			return rc;
+		}
+		if ((rc = protocol_setjson_array_append(slabs, s))) {
+			json_decref(slabs);
+			return rc;
+		}
+	}
+
+	return protocol_setjson(reply, "slabs", slabs);
+}
+
+/* waiting requests by priority class, lowest first */
+static int protocol_reply_status_priorities(json_t *reply)
+{
+	json_t *classes;
+	int i, rc;
+
+	classes = json_array();
+	if (!classes)
+		abort();
+
+	for (i = 0; i < PRIORITY_CLASSES; i++) {
+		rc = protocol_setjson_array_append(
+			classes,
+			json_integer(state->stats.pending_priority[i]));
+		if (rc) {
+			json_decref(classes);
+			return rc;
+		}
+	}
+
+	return protocol_setjson(reply, "pending_priority", classes);
+}
+
+static int protocol_reply_status_tenants(json_t *reply)
+{
+	struct tenant *tenant;
+	json_t *tenants;
+	int rc;
+
+	if (cds_list_empty(&state->tenants))
+		return 0;
+
+	tenants = json_array();
+	if (!tenants)
+		abort();
+
+	cds_list_for_each_entry(tenant, &state->tenants, node)
+	{
+		json_t *t = json_object();
+
+		if (!t)
+			abort();
+		if ((rc = protocol_setjson_str(t, "name", tenant->name)) ||
+		    (rc = protocol_setjson_int(t, "weight", tenant->weight)) ||
+		    (rc = protocol_setjson_int(t, "waiting",
+					       tenant->waiting)) ||
+		    (rc = protocol_setjson_int(t, "served", tenant->served))) {
+			json_decref(t);
+			json_decref(tenants);
+			return rc;
+		}
+		if ((rc = protocol_setjson_array_append(tenants, t))) {
+			json_decref(tenants);
+			return rc;
+		}
+	}
+
+	return protocol_setjson(reply, "tenants", tenants);
+}
+
 int protocol_reply_status(struct client *client, int verbose, int status,
 			  char *error)
 {
@@ -191,6 +353,10 @@ int protocol_reply_status(struct client *client, int verbose, int status,
 				       ct_stats->pending_remove)) ||
 	    (rc = protocol_setjson_int(reply, "pending_cancel",
 				       ct_stats->pending_cancel)) ||
+	    (rc = protocol_setjson_int(reply, "running_bytes",
+				       ct_stats->running_bytes)) ||
+	    (rc = protocol_setjson_int(reply, "pending_bytes",
+				       ct_stats->pending_bytes)) ||
 	    (rc = protocol_setjson_int(reply, "done_restore",
 				       ct_stats->done_restore)) ||
 	    (rc = protocol_setjson_int(reply, "done_archive",
@@ -218,23 +384,30 @@ int protocol_reply_status(struct client *client, int verbose, int status,
 		goto out_freereply_clients;
 	}
 
-	if ((rc = protocol_setjson(reply, "clients", clients))) {
+	/* reply owns clients now, even on error */
+	rc = protocol_setjson(reply, "clients", clients);
+	clients = NULL;
+	if (rc)
+		goto out_freereply;
+
+	if ((rc = protocol_reply_status_slabs(reply)) ||
+	    (rc = protocol_reply_status_priorities(reply)) ||
+	    (rc = protocol_reply_status_tenants(reply)))
 		goto out_freereply;
-	}
 
 	if (verbose >= LLAPI_MSG_DEBUG &&
-	    ((rc = protocol_reply_status_dump_list(
+	    ((rc = protocol_reply_status_dump_queue(
 		      reply, "waiting_restore",
 		      &state->queues.waiting_restore)) ||
-	     (rc = protocol_reply_status_dump_list(
+	     (rc = protocol_reply_status_dump_queue(
 		      reply, "waiting_remove", &state->queues.waiting_remove)) ||
-	     (rc = protocol_reply_status_dump_list(
+	     (rc = protocol_reply_status_dump_queue(
 		      reply, "waiting_archive",
 		      &state->queues.waiting_archive)))) {
 		goto out_freereply;
 	}
 
-	if (protocol_write(reply, client->fd, client->id, 0) != 0) {
+	if (client_write(client, reply) != 0) {
 		char *json_str = json_dumps(reply, 0);
 		rc = -EIO;
 		LOG_ERROR(rc, "%s (%d): Could not write reply: %s", client->id,
@@ -262,6 +435,8 @@ static int recv_cb(void *fd_arg, json_t *json, void *arg UNUSED)
 	client->max_restore = protocol_getjson_int(json, "max_restore", -1);
 	client->max_archive = protocol_getjson_int(json, "max_archive", -1);
 	client->max_remove = protocol_getjson_int(json, "max_remove", -1);
+	client->max_inflight_bytes =
+		protocol_getjson_int(json, "max_inflight_bytes", 0);
 
 	if (client->max_archive > 0 && state->config.batch_slots &&
 	    client->max_archive % state->config.batch_slots != 0) {
@@ -296,43 +471,127 @@ static int recv_cb(void *fd_arg, json_t *json, void *arg UNUSED)
 	return 0;
 }
 
-int protocol_reply_recv(struct client *client, const char *fsname,
-			uint32_t archive_id, uint64_t hal_flags,
-			json_t *hai_list, int status, char *error)
+/* binary variant of successful recv reply, see protocol.h for format */
+static int protocol_reply_recv_bin(struct client *client, const char *fsname,
+				   uint32_t archive_id, uint64_t hal_flags,
+				   struct recv_items *items)
 {
-	json_t *reply;
+	struct protocol_bin_buf bin = { 0 };
+	size_t fsname_len = strlen(fsname);
 	int rc;
 
-	reply = json_object();
-	if (!reply)
+	protocol_bin_init(&bin, RECV);
+	protocol_bin_put_u32(&bin, HAL_VERSION);
+	protocol_bin_put_u32(&bin, archive_id);
+	protocol_bin_put_u64(&bin, hal_flags);
+	protocol_bin_put_u32(&bin, items->count);
+	protocol_bin_put_u32(&bin, fsname_len);
+	protocol_bin_put_bytes(&bin, fsname, fsname_len);
+	/* items are sent as is after this header */
+	protocol_bin_set_u32(&bin, 4,
+			     bin.len - PROTOCOL_BINARY_HEADER_SIZE +
+				     items->buf.len);
+
+	rc = client_queue_raw(client, bin.data, bin.len);
+	if (rc == 0) {
+		/* buffer now belongs to client write buffer */
+		rc = client_queue_take(client, items->buf.data,
+				       items->buf.len);
+		items->buf.data = NULL;
+	}
+	if (rc == 0)
+		rc = client_write_flush(client);
+	if (rc)
+		LOG_ERROR(rc, "%s (%d): Could not write binary recv reply",
+			  client->id, client->fd);
+
+	protocol_bin_free(&bin);
+	return rc;
+}
+
+/* json variant: items are already encoded, so we format the envelope
+ * around them ourselves instead of building a json object */
+static int protocol_reply_recv_json(struct client *client, const char *fsname,
+				    uint32_t archive_id, uint64_t hal_flags,
+				    struct recv_items *items)
+{
+	json_t *json_fsname;
+	char *fsname_str, *header;
+	int header_len, rc;
+
+	json_fsname = json_string(fsname);
+	if (!json_fsname)
+		abort();
+	fsname_str = json_dumps(json_fsname, JSON_ENCODE_ANY);
+	json_decref(json_fsname);
+	if (!fsname_str)
 		abort();
 
-	if (hai_list) {
-		assert(fsname);
-		assert(archive_id != 0);
+	header_len = asprintf(
+		&header,
+		"{\"command\":\"recv\",\"status\":0,\"hsm_action_list\":{\"hal_version\":%d,\"hal_archive_id\":%u,\"hal_flags\":%" PRIu64
+		",\"hal_fsname\":%s,\"list\":[",
+		HAL_VERSION, archive_id, hal_flags, fsname_str);
+	free(fsname_str);
+	if (header_len < 0)
+		abort();
 
-		json_t *hal = json_object();
+	LOG_DEBUG("%s (%d): recv reply: %s%.*s]}}", client->id, client->fd,
+		  header, (int)items->buf.len, items->buf.data);
 
-		/* XXX common fields are assumed to be the same for now */
-		if (!hal ||
-		    protocol_setjson_int(hal, "hal_version", HAL_VERSION) ||
-		    protocol_setjson_int(hal, "hal_archive_id", archive_id) ||
-		    protocol_setjson_int(hal, "hal_flags", hal_flags) ||
-		    protocol_setjson_str(hal, "hal_fsname", fsname) ||
-		    protocol_setjson(hal, "list", hai_list))
-			abort();
+	rc = client_queue_raw(client, header, header_len);
+	if (rc == 0) {
+		/* buffer now belongs to client write buffer */
+		rc = client_queue_take(client, items->buf.data,
+				       items->buf.len);
+		items->buf.data = NULL;
+	}
+	if (rc == 0)
+		rc = client_queue_raw(client, "]}}", 3);
+	if (rc == 0)
+		rc = client_write_flush(client);
+	if (rc)
+		LOG_ERROR(rc, "%s (%d): Could not write recv reply",
+			  client->id, client->fd);
+
+	free(header);
+	return rc;
+}
+
+int protocol_reply_recv(struct client *client, const char *fsname,
+			uint32_t archive_id, uint64_t hal_flags,
+			struct recv_items *items, int status, char *error)
+{
+	json_t *reply;
+	int rc;
 
-		if (hal &&
-		    (rc = protocol_setjson(reply, "hsm_action_list", hal)))
-			goto out_freereply;
+	if (items) {
+		assert(fsname);
+		assert(archive_id != 0);
+		assert(status == 0);
+
+		if (client->binary)
+			rc = protocol_reply_recv_bin(client, fsname,
+						     archive_id, hal_flags,
+						     items);
+		else
+			rc = protocol_reply_recv_json(client, fsname,
+						      archive_id, hal_flags,
+						      items);
+		protocol_bin_free(&items->buf);
+		return rc;
 	}
 
+	reply = json_object();
+	if (!reply)
+		abort();
+
 	if ((rc = protocol_setjson_str(reply, "command", "recv")) ||
 	    (rc = protocol_setjson_int(reply, "status", status)) ||
 	    (rc = protocol_setjson_str(reply, "error", error)))
 		goto out_freereply;
 
-	if (protocol_write(reply, client->fd, client->id, 0) != 0) {
+	if (client_write(client, reply) != 0) {
 		char *json_str = json_dumps(reply, 0);
 		rc = -EIO;
 		LOG_ERROR(rc, "%s (%d): Could not write reply: %s", client->id,
@@ -357,38 +616,37 @@ static bool has_running_xfers(void)
 /**
  * DONE
  */
-static int done_cb(void *fd_arg, json_t *json, void *arg UNUSED)
-{
-	struct client *client = fd_arg;
 
-	uint64_t cookie;
-	struct lu_fid dfid;
-
-	if (json_hsm_action_key_get(json, &cookie, &dfid))
-		return protocol_reply_simple(
-			client, "done", EINVAL,
-			"cookie or fid not set -- old client?");
-
-	struct hsm_action_node *han = hsm_action_search(cookie, &dfid);
+/**
+ * release a finished action
+ *
+ * @return 0 on success (including unknown action), -errno on error
+ */
+static int done_action(struct client *client, uint64_t cookie,
+		       struct lu_fid *dfid, int status)
+{
+	struct hsm_action_node *han = hsm_action_search(cookie, dfid);
 	if (!han) {
 		/* This can happen on cancel if we're ack'd on both the cancel and the cancelled
 		 * request -- this is probably fine: ignore */
 		LOG_INFO("%s (%d): Done for non-existing request " DFID
 			 " (cookie %#lx): double-ack on cancel?",
-			 client->id, client->fd, PFID(&dfid), cookie);
-		return protocol_reply_simple(client, "done", 0, NULL);
+			 client->id, client->fd, PFID(dfid), cookie);
+		return 0;
 	}
 
-	int status = protocol_getjson_int(json, "status", 0);
 	LOG_INFO("%s (%d): Finished processing " DFID
 		 " (cookie %#lx): status %d",
-		 client->id, client->fd, PFID(&dfid), cookie, status);
+		 client->id, client->fd, PFID(dfid), cookie, status);
 
-	report_action(han, "done " DFID " %d\n", PFID(&dfid), status);
+	report_action(han, "done " DFID " %d\n", PFID(dfid), status);
 
 	int action = han->info.action;
 	if (han->current_count)
 		(*han->current_count)--;
+	/* errors can be quick, only learn from successes */
+	if (!status)
+		client_perf_done(client, han, gettime_ns());
 	hsm_action_free(han);
 
 	/* adjust running action count */
@@ -414,20 +672,104 @@ static int done_cb(void *fd_arg, json_t *json, void *arg UNUSED)
 	default:
 		return -EINVAL;
 	}
+	return 0;
+}
 
+/* common end of done processing, after done_action() for each item */
+static int done_reply(struct client *client, int status, char *error)
+{
 	if (client->status == CLIENT_WAITING) {
 		ct_schedule_client(client);
 	}
 
-	int rc = protocol_reply_simple(client, "done", 0, NULL);
+	int rc = protocol_reply_simple(client, "done", status, error);
 
 	// can't use client after initiate_termination()
-	if (state->locked == CTOOL_LOCK_AND_QUIT && !has_running_xfers())
+	if (state->locked == CTOOL_LOCK_AND_QUIT && !has_running_xfers()) {
 		initiate_termination();
+		/* tell reader to stop processing this client */
+		return 1;
+	}
 
 	return rc;
 }
 
+static int done_cb(void *fd_arg, json_t *json, void *arg UNUSED)
+{
+	struct client *client = fd_arg;
+
+	uint64_t cookie;
+	struct lu_fid dfid;
+	int rc;
+
+	json_t *list = json_object_get(json, "list");
+	if (list) {
+		unsigned int count;
+		json_t *item;
+		int final_rc = 0;
+
+		json_array_foreach(list, count, item)
+		{
+			if (json_hsm_action_key_get(item, &cookie, &dfid)) {
+				LOG_WARN(
+					-EINVAL,
+					"%s (%d): cookie or fid not set in done list item %u",
+					client->id, client->fd, count);
+				final_rc = EINVAL;
+				continue;
+			}
+			int status = protocol_getjson_int(item, "status", 0);
+			rc = done_action(client, cookie, &dfid, status);
+			if (rc)
+				return rc;
+		}
+		return done_reply(client, final_rc,
+				  final_rc ? "bad item(s) in done list" : NULL);
+	}
+
+	if (json_hsm_action_key_get(json, &cookie, &dfid))
+		return protocol_reply_simple(
+			client, "done", EINVAL,
+			"cookie or fid not set -- old client?");
+
+	int status = protocol_getjson_int(json, "status", 0);
+	rc = done_action(client, cookie, &dfid, status);
+	if (rc)
+		return rc;
+
+	return done_reply(client, 0, NULL);
+}
+
+static int done_bin_cb(void *fd_arg, const char *payload, size_t len,
+		       void *arg UNUSED)
+{
+	struct client *client = fd_arg;
+	struct protocol_bin_reader reader = {
+		.data = payload,
+		.len = len,
+	};
+	uint32_t count, i;
+	uint64_t cookie;
+	struct lu_fid dfid;
+	int status, rc;
+
+	count = protocol_bin_get_u32(&reader);
+	for (i = 0; i < count; i++) {
+		if (protocol_bin_get_done(&reader, &cookie, &dfid, &status)) {
+			LOG_WARN(-EINVAL,
+				 "%s (%d): truncated binary done (%u/%u items)",
+				 client->id, client->fd, i, count);
+			return done_reply(client, EINVAL,
+					  "truncated binary done");
+		}
+		rc = done_action(client, cookie, &dfid, status);
+		if (rc)
+			return rc;
+	}
+
+	return done_reply(client, 0, NULL);
+}
+
 /**
  * QUEUE
  */
@@ -497,7 +839,7 @@ int protocol_reply_queue(struct client *client, int enqueued, int skipped,
 	    (rc = protocol_setjson_int(reply, "skipped", skipped)))
 		goto out_freereply;
 
-	if (protocol_write(reply, client->fd, client->id, 0) != 0) {
+	if (client_write(client, reply) != 0) {
 		char *json_str = json_dumps(reply, 0);
 		rc = -EIO;
 		LOG_ERROR(rc, "%s (%d): Could not write reply: %s", client->id,
@@ -513,23 +855,38 @@ out_freereply:
 
 static bool ehlo_is_id_unique(const char *id)
 {
-	struct cds_list_head *n;
-	cds_list_for_each(n, &state->stats.clients)
-	{
-		struct client *client =
-			caa_container_of(n, struct client, node_clients);
+	// initializing clients are not indexed yet, and disconnected
+	// clients are taken over below
+	return find_client(id, false) == NULL;
+}
 
-		// skip initializing clients
-		// note disconnected clients are not in this list
-		if (client->status == CLIENT_INIT) {
-			continue;
-		}
+/* successful ehlo reply, errors use protocol_reply_simple */
+static int protocol_reply_ehlo(struct client *client)
+{
+	json_t *reply;
+	int rc;
 
-		if (!strcmp(id, client->id)) {
-			return false;
-		}
-	}
-	return true;
+	reply = json_object();
+	if (!reply)
+		abort();
+	if ((rc = protocol_setjson_str(reply, "command", "ehlo")) ||
+	    (rc = protocol_setjson_int(reply, "status", 0)) ||
+	    (rc = protocol_setjson_bool(reply, "binary", client->binary)) ||
+	    (rc = protocol_setjson_bool(reply, "compress",
+					state->config.compress_threshold != 0)) ||
+	    (rc = protocol_setjson_bool(reply, "done_list", true)))
+		goto out_freereply;
+
+	if (client_write(client, reply) != 0) {
+		rc = -EIO;
+		LOG_ERROR(rc, "%s (%d): Could not write ehlo reply",
+			  client->id, client->fd);
+		goto out_freereply;
+	};
+
+out_freereply:
+	json_decref(reply);
+	return rc;
 }
 
 static int ehlo_cb(void *fd_arg, json_t *json, void *arg UNUSED)
@@ -542,6 +899,7 @@ static int ehlo_cb(void *fd_arg, json_t *json, void *arg UNUSED)
 		return protocol_reply_simple(client, "ehlo", EINVAL,
 					     "Client cannot send EHLO twice");
 	}
+	state->ehlo_budget--;
 
 	json_archives = json_object_get(json, "archive_ids");
 	if (json_archives) {
@@ -579,9 +937,14 @@ static int ehlo_cb(void *fd_arg, json_t *json, void *arg UNUSED)
 			"id already used by another client");
 	}
 	client->status = CLIENT_READY;
+	client->binary = protocol_getjson_bool(json, "binary", false);
+	client->compress = state->config.compress_threshold != 0 &&
+			   protocol_getjson_bool(json, "compress", false);
+	client->rbuf.reject_compressed = !client->compress;
 	if (!id) {
 		// no id: no special treatment
-		return protocol_reply_simple(client, "ehlo", 0, NULL);
+		client_hash_add(client);
+		return protocol_reply_ehlo(client);
 	}
 
 	LOG_INFO("Clients: '%s' renamed to %s (%d)", client->id, id,
@@ -589,59 +952,49 @@ static int ehlo_cb(void *fd_arg, json_t *json, void *arg UNUSED)
 	free((void *)client->id);
 	client->id = xstrdup(id);
 	client->id_set = true;
+	client_hash_add(client);
 
-	struct cds_list_head *n;
-	cds_list_for_each(n, &state->stats.disconnected_clients)
-	{
-		struct client *old_client =
-			caa_container_of(n, struct client, node_clients);
-
-		if (strcmp(id, old_client->id))
-			continue;
-
+	struct client *old_client = find_client(id, true);
+	if (old_client) {
 		LOG_INFO(
 			"Clients: restoring state from previously disconnected client %s (%d)",
 			id, client->fd);
 		/* move all requests to new client: splice then update pointers in han */
-		struct cds_list_head *old_lists[] = {
-			&old_client->active_requests,
+		cds_list_splice(&old_client->active_requests,
+				&client->active_requests);
+		CDS_INIT_LIST_HEAD(&old_client->active_requests);
+		struct hsm_action_node *han;
+		cds_list_for_each_entry(han, &client->active_requests, node)
+			han->client = client;
+		client->inflight_bytes += old_client->inflight_bytes;
+		old_client->inflight_bytes = 0;
+		/* same mover, same speed */
+		client->perf_restore = old_client->perf_restore;
+		client->perf_archive = old_client->perf_archive;
+		client->perf_remove = old_client->perf_remove;
+
+		struct hsm_action_queue *old_queues[] = {
 			&old_client->queues.waiting_restore,
 			&old_client->queues.waiting_archive,
 			&old_client->queues.waiting_remove,
 		};
-		struct cds_list_head *new_lists[] = {
-			&client->active_requests,
+		struct hsm_action_queue *new_queues[] = {
 			&client->queues.waiting_restore,
 			&client->queues.waiting_archive,
 			&client->queues.waiting_remove,
 		};
-		static_assert(sizeof(old_lists) == sizeof(new_lists),
-			      "must keep old/new list in sync for copy");
-		for (unsigned int i = 0; i < countof(old_lists); i++) {
-			cds_list_splice(old_lists[i], new_lists[i]);
-			CDS_INIT_LIST_HEAD(old_lists[i]);
-		}
+		static_assert(sizeof(old_queues) == sizeof(new_queues),
+			      "must keep old/new queues in sync for copy");
+		for (unsigned int i = 0; i < countof(old_queues); i++)
+			hsm_action_queue_splice(old_queues[i], new_queues[i]);
 
 		/* .. and batch slots too */
-		for (int i = 0; i < state->config.batch_slots; i++) {
-			client->batch[i] = old_client->batch[i];
-			client->batch[i].current_count = 0;
-			CDS_INIT_LIST_HEAD(&client->batch[i].waiting_archive);
-			cds_list_splice(&old_client->batch[i].waiting_archive,
-					&client->batch[i].waiting_archive);
-			/* avoid frees */
-			old_client->batch[i].hint = NULL;
-			CDS_INIT_LIST_HEAD(
-				&old_client->batch[i].waiting_archive);
-		}
+		batch_slots_takeover(client, old_client);
 
 		// we no longer need it, free it immediately (unset id_set to lower debug message)
 		// note we cannot free it right here as queued entries
 		old_client->id_set = false;
 		client_free(old_client);
-
-		// there can only be one
-		break;
 	}
 
 	struct cds_list_head free_hai;
@@ -702,7 +1055,7 @@ static int ehlo_cb(void *fd_arg, json_t *json, void *arg UNUSED)
 	/* requeue anything left */
 	hsm_action_requeue_all(&free_hai);
 
-	return protocol_reply_simple(client, "ehlo", 0, NULL);
+	return protocol_reply_ehlo(client);
 }
 
 static int lock_cb(void *fd_arg, json_t *json, void *arg UNUSED)
@@ -724,8 +1077,12 @@ static int lock_cb(void *fd_arg, json_t *json, void *arg UNUSED)
 		break;
 	case CTOOL_LOCK_AND_QUIT:
 		// if no transfer in progress quit now
-		if (!has_running_xfers())
+		if (!has_running_xfers()) {
 			initiate_termination();
+			/* tell reader to stop processing this client */
+			return 1;
+		}
+		break;
 	default:
 		break;
 	}
@@ -747,7 +1104,7 @@ int protocol_reply_simple(struct client *client, const char *cmd, int status,
 	    (rc = protocol_setjson_str(reply, "error", error)))
 		goto out_freereply;
 
-	if (protocol_write(reply, client->fd, client->id, 0) != 0) {
+	if (client_write(client, reply) != 0) {
 		char *json_str = json_dumps(reply, 0);
 		rc = -EIO;
 		LOG_ERROR(rc, "%s (%d): Could not write reply: %s", client->id,
@@ -765,3 +1122,7 @@ protocol_read_cb protocol_cbs[PROTOCOL_COMMANDS_MAX] = {
 	[STATUS] = status_cb, [RECV] = recv_cb, [DONE] = done_cb,
 	[QUEUE] = queue_cb,   [EHLO] = ehlo_cb, [LOCK] = lock_cb,
 };
+
+protocol_read_bin_cb protocol_bin_cbs[PROTOCOL_COMMANDS_MAX] = {
+	[DONE] = done_bin_cb,
+};
@@ -1,20 +1,320 @@
 /* SPDX-License-Identifier: LGPL-3.0-or-later */
 
 #include <assert.h>
-#include <search.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "coordinatool.h"
 
+static struct slab_pool han_pool =
+	SLAB_POOL_INIT("hsm_action_node", sizeof(struct hsm_action_node));
+
+void hsm_action_queue_init(struct hsm_action_queue *queue)
+{
+	CDS_INIT_LIST_HEAD(&queue->subqueues);
+	CDS_INIT_LIST_HEAD(&queue->empty);
+	queue->count = 0;
+	queue->drr_next = NULL;
+	queue->schedule_gen = 0;
+}
+
+static inline size_t hsm_action_subqueue_hash(struct hsm_action_queue *queue,
+					      uint32_t archive_id,
+					      uint64_t hal_flags,
+					      struct tenant *tenant,
+					      int priority)
+{
+	uint64_t h;
+
+	h = hash_mix((uintptr_t)queue ^ ((uint64_t)archive_id << 32) ^
+		     (uint32_t)priority);
+	h = hash_mix(h ^ hal_flags);
+	return hash_mix(h ^ (uintptr_t)tenant);
+}
+
+static void hsm_action_subqueue_hash_add(struct hsm_action_subqueue *subqueue)
+{
+	chain_hash_add(&state->subqueues, &subqueue->hash_node,
+		       hsm_action_subqueue_hash(subqueue->queue,
+						subqueue->archive_id,
+						subqueue->hal_flags,
+						subqueue->tenant,
+						subqueue->priority));
+}
+
+static void hsm_action_subqueue_hash_del(struct hsm_action_subqueue *subqueue)
+{
+	chain_hash_del(&state->subqueues, &subqueue->hash_node);
+}
+
+void hsm_action_subqueue_hash_destroy(void)
+{
+	chain_hash_destroy(&state->subqueues);
+}
+
+void hsm_action_queue_free(struct hsm_action_queue *queue)
+{
+	struct hsm_action_subqueue *subqueue, *next;
+
+	/* actions were either moved away or freed by hsm_action_free_all */
+	cds_list_for_each_entry_safe(subqueue, next, &queue->subqueues, node)
+	{
+		hsm_action_subqueue_hash_del(subqueue);
+		tenant_put(subqueue->tenant);
+		free(subqueue);
+	}
+	hsm_action_queue_init(queue);
+}
+
 void hsm_action_queues_init(struct hsm_action_queues *queues)
 {
-	CDS_INIT_LIST_HEAD(&queues->waiting_restore);
-	CDS_INIT_LIST_HEAD(&queues->waiting_archive);
-	CDS_INIT_LIST_HEAD(&queues->waiting_remove);
+	hsm_action_queue_init(&queues->waiting_restore);
+	hsm_action_queue_init(&queues->waiting_archive);
+	hsm_action_queue_init(&queues->waiting_remove);
+}
+
+void hsm_action_queues_free(struct hsm_action_queues *queues)
+{
+	hsm_action_queue_free(&queues->waiting_restore);
+	hsm_action_queue_free(&queues->waiting_archive);
+	hsm_action_queue_free(&queues->waiting_remove);
+}
+
+bool accept_archive_id(int *archives, uint32_t archive_id)
+{
+	bool rc = true;
+
+	if (!archives)
+		return true;
+
+	while (*archives) {
+		if ((uint32_t)*archives == archive_id)
+			return true;
+		archives++;
+		rc = false;
+	}
+
+	return rc;
+}
+
+static struct hsm_action_subqueue *
+hsm_action_subqueue_find(struct hsm_action_queue *queue, uint32_t archive_id,
+			 uint64_t hal_flags, struct tenant *tenant,
+			 int priority)
+{
+	struct chain_hash_node *node;
+
+	chain_hash_for_each(node, &state->subqueues,
+			    hsm_action_subqueue_hash(queue, archive_id,
+						     hal_flags, tenant,
+						     priority))
+	{
+		struct hsm_action_subqueue *subqueue = caa_container_of(
+			node, struct hsm_action_subqueue, hash_node);
+
+		if (subqueue->queue == queue &&
+		    subqueue->archive_id == archive_id &&
+		    subqueue->hal_flags == hal_flags &&
+		    subqueue->tenant == tenant &&
+		    subqueue->priority == priority)
+			return subqueue;
+	}
+	return NULL;
+}
+
+static struct hsm_action_subqueue *
+hsm_action_subqueue_get(struct hsm_action_queue *queue, uint32_t archive_id,
+			uint64_t hal_flags, struct tenant *tenant,
+			int priority)
+{
+	struct hsm_action_subqueue *subqueue;
+
+	subqueue = hsm_action_subqueue_find(queue, archive_id, hal_flags,
+					    tenant, priority);
+	if (subqueue)
+		return subqueue;
+
+	if (!cds_list_empty(&queue->empty)) {
+		/* reuse an empty one: it keeps its place in the queue, so
+		 * a scheduling pass walking it is not disturbed */
+		subqueue = caa_container_of(queue->empty.next,
+					    struct hsm_action_subqueue,
+					    empty_node);
+		hsm_action_subqueue_hash_del(subqueue);
+		tenant_put(subqueue->tenant);
+		subqueue->schedule_gen = 0;
+	} else {
+		subqueue = xcalloc(1, sizeof(*subqueue));
+		subqueue->queue = queue;
+		CDS_INIT_LIST_HEAD(&subqueue->actions);
+		cds_list_add_tail(&subqueue->node, &queue->subqueues);
+		cds_list_add(&subqueue->empty_node, &queue->empty);
+	}
+	subqueue->archive_id = archive_id;
+	subqueue->hal_flags = hal_flags;
+	subqueue->tenant = tenant_ref(tenant);
+	subqueue->priority = priority;
+	hsm_action_subqueue_hash_add(subqueue);
+	return subqueue;
+}
+
+struct hsm_action_subqueue *
+hsm_action_queue_oldest(struct hsm_action_queue *queue, int *archives)
+{
+	struct hsm_action_subqueue *subqueue, *oldest = NULL;
+
+	cds_list_for_each_entry(subqueue, &queue->subqueues, node)
+	{
+		if (!subqueue->count ||
+		    !accept_archive_id(archives, subqueue->archive_id))
+			continue;
+		if (!oldest || subqueue->priority > oldest->priority ||
+		    (subqueue->priority == oldest->priority &&
+		     hsm_action_older(hsm_action_subqueue_head(subqueue),
+				      hsm_action_subqueue_head(oldest))))
+			oldest = subqueue;
+	}
+	return oldest;
+}
+
+static void hsm_action_queue_add(struct hsm_action_queue *queue,
+				 struct hsm_action_node *han)
+{
+	struct hsm_action_subqueue *subqueue = hsm_action_subqueue_get(
+		queue, han->info.archive_id, han->info.hal_flags, han->tenant,
+		han->priority);
+
+	hsm_action_list_add(&subqueue->actions, han);
+	han->subqueue = subqueue;
+	if (!subqueue->count++)
+		cds_list_del(&subqueue->empty_node);
+	queue->count++;
+	if (han->tenant)
+		han->tenant->waiting++;
+	if (han->info.action != HSMA_CANCEL) {
+		state->stats.pending_priority[han->priority]++;
+		state->stats.pending_bytes += han->info.size;
+	}
+}
+
+void hsm_action_dequeue(struct hsm_action_node *han)
+{
+	struct hsm_action_subqueue *subqueue = han->subqueue;
+
+	if (subqueue) {
+		/* round robin credit does not carry over idle periods */
+		if (!--subqueue->count) {
+			subqueue->deficit = 0;
+			cds_list_add(&subqueue->empty_node,
+				     &subqueue->queue->empty);
+		}
+		subqueue->queue->count--;
+		if (han->tenant)
+			han->tenant->waiting--;
+		if (han->info.action != HSMA_CANCEL) {
+			state->stats.pending_priority[han->priority]--;
+			state->stats.pending_bytes -= han->info.size;
+		}
+		han->subqueue = NULL;
+	}
+	hsm_action_list_del(han);
+}
+
+/* requests of sq sent before han, which is in another subqueue of the same
+ * queue and gets sent in class priority */
+static size_t hsm_action_subqueue_ahead(struct hsm_action_subqueue *sq,
+					struct hsm_action_node *han,
+					int priority, int64_t now)
+{
+	int64_t aging = state->config.priority_aging_ns;
+	int gap = priority - sq->priority;
+	size_t higher = 0, same, older;
+
+	/* aging only raises classes */
+	if (gap < 0)
+		return sq->count;
+	older = hsm_action_list_count_older(&sq->actions, han);
+	if (!aging)
+		return gap ? 0 : older;
+
+	/* sq is in age order: its requests that waited gap + 1 agings are in a
+	 * higher class whatever their age, then those that waited gap agings
+	 * are in the same class and only count if older */
+	if (priority < PRIORITY_MAX)
+		higher = hsm_action_list_count_until(&sq->actions,
+						     now - (gap + 1) * aging);
+	same = hsm_action_list_count_until(&sq->actions, now - gap * aging);
+	if (same > older)
+		same = older;
+	return higher > same ? higher : same;
+}
+
+size_t hsm_action_queue_position(struct hsm_action_node *han)
+{
+	struct hsm_action_subqueue *subqueue = han->subqueue, *other;
+	int64_t now = 0;
+	int priority;
+	size_t pos;
+
+	if (!subqueue)
+		return 0;
+
+	if (state->config.priority_aging_ns)
+		now = gettime_ns();
+	priority = schedule_priority(subqueue, han, now);
+
+	/* higher classes are served first, then oldest first (fair share
+	 * rounds are not accounted for): what is older in its subqueue, and
+	 * what comes first in the others */
+	pos = hsm_action_list_rank(han) + 1;
+	cds_list_for_each_entry(other, &subqueue->queue->subqueues, node)
+	{
+		if (other != subqueue && other->count)
+			pos += hsm_action_subqueue_ahead(other, han, priority,
+							 now);
+	}
+	return pos;
+}
+
+void hsm_action_queue_splice(struct hsm_action_queue *from,
+			     struct hsm_action_queue *queue)
+{
+	struct hsm_action_subqueue *subqueue, *next, *dest;
+	struct hsm_action_node *han;
+
+	cds_list_for_each_entry_safe(subqueue, next, &from->subqueues, node)
+	{
+		if (!subqueue->count)
+			continue;
+		dest = hsm_action_subqueue_find(
+			queue, subqueue->archive_id, subqueue->hal_flags,
+			subqueue->tenant, subqueue->priority);
+		if (!dest) {
+			/* hans keep pointing to it, just move it over */
+			hsm_action_subqueue_hash_del(subqueue);
+			cds_list_del(&subqueue->node);
+			cds_list_add_tail(&subqueue->node, &queue->subqueues);
+			subqueue->queue = queue;
+			hsm_action_subqueue_hash_add(subqueue);
+			queue->count += subqueue->count;
+			continue;
+		}
+		if (!dest->count)
+			cds_list_del(&dest->empty_node);
+		cds_list_for_each_entry(han, &subqueue->actions, node)
+			han->subqueue = dest;
+		hsm_action_list_splice(&subqueue->actions, &dest->actions);
+		dest->count += subqueue->count;
+		queue->count += subqueue->count;
+		subqueue->count = 0;
+		subqueue->deficit = 0;
+	}
+	hsm_action_queue_free(from);
 }
 
-struct cds_list_head *get_queue_list(struct hsm_action_queues *queues,
-				     struct hsm_action_node *han)
+struct hsm_action_queue *get_queue_list(struct hsm_action_queues *queues,
+					struct hsm_action_node *han)
 {
 	switch (han->info.action) {
 	case HSMA_RESTORE:
@@ -33,21 +333,19 @@ struct cds_list_head *get_queue_list(struct hsm_action_queues *queues,
 	}
 }
 
-static int tree_compare(const void *a, const void *b)
+/* account han size in what client is working on */
+static void hsm_action_running_bytes(struct hsm_action_node *han,
+				     struct client *client, bool start)
 {
-	const struct item_info *va = a, *vb = b;
-
-	/* lustre only guarantees identity per mdt.
-	 * We don't have mdt index in action info, so use cookie and fid
-	 * (there can be multiple requests on a single fid as well, but these
-	 * must be on the same mdt so cookie will be different)
-	 */
-
-	if (va->cookie < vb->cookie)
-		return -1;
-	if (va->cookie > vb->cookie)
-		return 1;
-	return memcmp(&va->dfid, &vb->dfid, sizeof(va->dfid));
+	if (!client || !han->info.size)
+		return;
+	if (start) {
+		client->inflight_bytes += han->info.size;
+		state->stats.running_bytes += han->info.size;
+	} else {
+		client->inflight_bytes -= han->info.size;
+		state->stats.running_bytes -= han->info.size;
+	}
 }
 
 static void _hsm_action_free(struct hsm_action_node *han, bool final_cleanup)
@@ -57,13 +355,16 @@ static void _hsm_action_free(struct hsm_action_node *han, bool final_cleanup)
 #endif
 	LOG_DEBUG("freeing han for " DFID " node %p", PFID(&han->info.dfid),
 		  (void *)&han->node);
-	if (!final_cleanup)
-		cds_list_del(&han->node);
+	if (!final_cleanup) {
+		hsm_action_dequeue(han);
+		hsm_action_running_bytes(han, han->client, false);
+	}
 	if (han->info.action != HSMA_CANCEL) {
 		if (!final_cleanup) {
 			redis_delete_request(han->info.cookie, &han->info.dfid);
-			if (!tdelete(&han->info, &state->hsm_actions_tree,
-				     tree_compare))
+			if (!hsm_action_hash_remove(&state->hsm_actions,
+						    han->info.cookie,
+						    &han->info.dfid))
 				abort();
 		}
 		report_free_action(han);
@@ -71,10 +372,10 @@ static void _hsm_action_free(struct hsm_action_node *han, bool final_cleanup)
 #if HAVE_PHOBOS
 	free(han->info.hsm_fuid);
 #endif
-	free((void *)han->info.data);
-	if (han->hai)
-		json_decref(han->hai);
-	free(han);
+	tenant_put(han->tenant);
+	intern_put(han->info.data);
+	free(han->json);
+	slab_free(han);
 }
 
 void hsm_action_free(struct hsm_action_node *han)
@@ -82,10 +383,76 @@ void hsm_action_free(struct hsm_action_node *han)
 	_hsm_action_free(han, false);
 }
 
-static void tree_free_cb(void *nodep)
+void hsm_action_item_fill(struct hsm_action_node *han,
+			  struct hsm_action_item *hai)
+{
+	hai->hai_len = han->info.hai_len;
+	hai->hai_action = han->info.action;
+	hai->hai_fid = han->info.fid;
+	hai->hai_dfid = han->info.dfid;
+	hai->hai_extent = han->info.extent;
+	hai->hai_cookie = han->info.cookie;
+	hai->hai_gid = han->info.gid;
+}
+
+json_t *hsm_action_json(struct hsm_action_node *han)
+{
+	json_t *json;
+
+	json = json_pack("{si,so,so,sI,sI,sI,sI,sI,sI,ss#,sI}", "hai_action",
+			 han->info.action, "hai_fid", json_fid(&han->info.fid),
+			 "hai_dfid", json_fid(&han->info.dfid),
+			 "hai_extent_offset", han->info.extent.offset,
+			 "hai_extent_length", han->info.extent.length,
+			 "hai_cookie", han->info.cookie, "hai_gid",
+			 han->info.gid, "hal_archive_id", han->info.archive_id,
+			 "hal_flags", han->info.hal_flags, "hai_data",
+			 han->info.data, (size_t)han_data_len(han),
+			 "timestamp", han->info.timestamp);
+	if (!json)
+		LOG_WARN(-ENOMEM, "Could not build json hai for " DFID,
+			 PFID(&han->info.dfid));
+	return json;
+}
+
+/* requests are sent again when requeued after a mover left or
+ * refused them, only build json the first time */
+int hsm_action_encode_json(struct hsm_action_node *han,
+			   struct protocol_bin_buf *buf)
+{
+	if (!han->json) {
+		json_t *json = hsm_action_json(han);
+
+		if (!json)
+			return -ENOMEM;
+		han->json = json_dumps(json, JSON_COMPACT);
+		json_decref(json);
+		if (!han->json)
+			return -EINVAL;
+		han->json_len = strlen(han->json);
+	}
+	protocol_bin_put_bytes(buf, han->json, han->json_len);
+	return 0;
+}
+
+void hsm_action_json_reset(struct hsm_action_node *han)
+{
+	free(han->json);
+	han->json = NULL;
+	han->json_len = 0;
+}
+
+void hsm_action_encode_bin(struct hsm_action_node *han,
+			   struct protocol_bin_buf *buf)
+{
+	struct hsm_action_item hai;
+
+	hsm_action_item_fill(han, &hai);
+	protocol_bin_put_hai(buf, &hai, han->info.data, han_data_len(han));
+}
+
+static void hash_free_cb(struct item_info *item_info)
 {
-	struct item_info *item_info =
-		caa_container_of(nodep, struct item_info, cookie);
 	struct hsm_action_node *han =
 		caa_container_of(item_info, struct hsm_action_node, info);
 
@@ -94,23 +461,18 @@ static void tree_free_cb(void *nodep)
 
 void hsm_action_free_all(void)
 {
-	tdestroy(state->hsm_actions_tree, tree_free_cb);
+	hsm_action_hash_destroy(&state->hsm_actions, hash_free_cb);
 }
 
 struct hsm_action_node *hsm_action_search(unsigned long cookie,
 					  struct lu_fid *dfid)
 {
-	struct item_info search_item = {
-		.cookie = cookie,
-		.dfid = *dfid,
-	};
-	void *key = tfind(&search_item, &state->hsm_actions_tree, tree_compare);
+	struct item_info *item_info =
+		hsm_action_hash_find(&state->hsm_actions, cookie, dfid);
 
-	if (!key)
+	if (!item_info)
 		return NULL;
 
-	struct item_info *item_info = *(void **)key;
-
 	struct hsm_action_node *han =
 		caa_container_of(item_info, struct hsm_action_node, info);
 #ifdef DEBUG_ACTION_NODE
@@ -120,13 +482,14 @@ struct hsm_action_node *hsm_action_search(unsigned long cookie,
 }
 
 /* actually inserts action node to its queue */
-int hsm_action_enqueue(struct hsm_action_node *han, struct cds_list_head *list)
+int hsm_action_enqueue(struct hsm_action_node *han,
+		       struct hsm_action_queue *queue)
 {
-	if (!list)
-		list = hsm_action_node_schedule(han);
-	if (!list)
-		list = get_queue_list(&state->queues, han);
-	if (!list) {
+	if (!queue)
+		queue = hsm_action_node_schedule(han);
+	if (!queue)
+		queue = get_queue_list(&state->queues, han);
+	if (!queue) {
 		/* We're losing track of the action here, free it.
 		 * (it should never happen, get queue list logged error)
 		 * free expects a list in good shape */
@@ -144,6 +507,7 @@ int hsm_action_enqueue(struct hsm_action_node *han, struct cds_list_head *list)
 					    cds_list_empty(&han->node));
 
 	if (was_running) {
+		hsm_action_running_bytes(han, han->client, false);
 		/* unset client anyway, we're pending now! */
 		han->client = NULL;
 		redis_deassign_request(han);
@@ -179,31 +543,61 @@ int hsm_action_enqueue(struct hsm_action_node *han, struct cds_list_head *list)
 #ifdef DEBUG_ACTION_NODE
 	assert(han->magic == DEBUG_ACTION_NODE);
 	LOG_DEBUG("Inserting han for " DFID " node %p in %p",
-		  PFID(&han->info.dfid), (void *)&han->node, (void *)list);
+		  PFID(&han->info.dfid), (void *)&han->node, (void *)queue);
 #endif
-	// XXX insert at timestamp-appropriate position in list
-	// - if timestamp later than tail add last
-	// - otherwise start comparing from head
-	cds_list_add_tail(&han->node, list);
+	/* requeued requests keep their age */
+	hsm_action_queue_add(queue, han);
 	return 1;
 }
 
-static int hsm_action_new_common(struct hsm_action_node *han)
+/* bytes the mover will have to copy: the extent if lustre gave a bounded
+ * one, else the file size if we may stat it */
+static uint64_t hsm_action_size(struct hsm_action_node *han)
 {
-	struct item_info **tree_key;
+	struct stat st;
+	int rc, fd;
+
+	if (han->info.action != HSMA_RESTORE &&
+	    han->info.action != HSMA_ARCHIVE)
+		return 0;
+	/* whole file is [0, -1) */
+	if (han->info.extent.length != (uint64_t)-1)
+		return han->info.extent.length;
+	if (!state->config.size_from_stat)
+		return 0;
+
+	fd = llapi_open_by_fid(state->mntpath, &han->info.dfid,
+			       O_RDONLY | O_NOATIME | O_NOFOLLOW);
+	if (fd < 0) {
+		rc = -errno;
+		LOG_WARN(rc, "Could not open " DFID " (size)",
+			 PFID(&han->info.dfid));
+		return 0;
+	}
+	rc = fstat(fd, &st);
+	if (rc) {
+		rc = -errno;
+		LOG_WARN(rc, "Could not stat " DFID, PFID(&han->info.dfid));
+		st.st_size = 0;
+	}
+	close(fd);
+	return st.st_size;
+}
 
-	tree_key = tsearch(&han->info, &state->hsm_actions_tree, tree_compare);
-	if (!tree_key)
-		abort();
-	if (*tree_key != &han->info) {
+static int hsm_action_new_common(struct hsm_action_node *han)
+{
+	if (hsm_action_hash_insert(&state->hsm_actions, &han->info) !=
+	    &han->info) {
 		/* duplicate */
-		free((void *)han->info.data);
-		json_decref(han->hai);
-		free(han);
+		intern_put(han->info.data);
+		slab_free(han);
 		return -EEXIST;
 	}
 
 	report_new_action(han);
+	han->tenant = tenant_get(han);
+	han->priority = priority_get(han);
+	han->info.size = hsm_action_size(han);
 
 #if HAVE_PHOBOS
 	(void)phobos_enrich(han);
@@ -228,7 +622,7 @@ int hsm_action_new_json(json_t *json_hai, int64_t timestamp,
 		return rc;
 	}
 
-	han = xcalloc(1, sizeof(struct hsm_action_node));
+	han = slab_alloc(&han_pool);
 #ifdef DEBUG_ACTION_NODE
 	han->magic = DEBUG_ACTION_NODE;
 	CDS_INIT_LIST_HEAD(&han->node);
@@ -236,6 +630,9 @@ int hsm_action_new_json(json_t *json_hai, int64_t timestamp,
 	han->info.cookie = hai.hai_cookie;
 	han->info.action = hai.hai_action;
 	han->info.dfid = hai.hai_dfid;
+	han->info.fid = hai.hai_fid;
+	han->info.extent = hai.hai_extent;
+	han->info.gid = hai.hai_gid;
 	han->info.hai_len = hai.hai_len;
 	han->info.archive_id =
 		protocol_getjson_int(json_hai, "hal_archive_id", 0);
@@ -243,7 +640,7 @@ int hsm_action_new_json(json_t *json_hai, int64_t timestamp,
 	if (!han->info.archive_id) {
 		LOG_WARN(-EINVAL, "%s: hai did not contain archive_id",
 			 requestor);
-		free(han);
+		slab_free(han);
 		return -EINVAL;
 	}
 	switch (hai.hai_action) {
@@ -254,19 +651,16 @@ int hsm_action_new_json(json_t *json_hai, int64_t timestamp,
 	default:
 		LOG_WARN(rc, "%s: hai had invalid action %d\n", requestor,
 			 hai.hai_action);
-		free(han);
+		slab_free(han);
 		return -EINVAL;
 	}
 
 	han->info.timestamp = protocol_getjson_int(json_hai, "timestamp", 0);
-	if (!han->info.timestamp) {
+	if (!han->info.timestamp)
 		han->info.timestamp = timestamp;
-		(void)protocol_setjson_int(json_hai, "timestamp", timestamp);
-	}
 
 	// allocations last
-	han->info.data = xmemdup0(data, han_data_len(han));
-	han->hai = json_incref(json_hai);
+	han->info.data = intern_dup(data, han_data_len(han));
 
 	rc = hsm_action_new_common(han);
 	if (rc < 0 && rc != -EEXIST) {
@@ -292,19 +686,12 @@ void hsm_action_cancel(struct hsm_action_node *han)
 	assert(!orig_han->client);
 	hsm_action_free(orig_han);
 
-	/* build hai to notify lustre.. */
+	/* build hai to notify lustre.. reset hai->hai_len because
+	 * ct_report_error does not need hai_data, avoiding having to
+	 * prepare a larger buffer */
 	struct hsm_action_item hai;
-	const char *data;
-	int rc;
-	/* use external data and reset hai->hai_len because ct_report_error
-                 * does not need hai_data, avoiding having to prepare a larger buffer */
-	rc = json_hsm_action_item_get(han->hai, &hai, sizeof(hai), &data);
-	if (rc) {
-		LOG_WARN(rc, "Could not rebuild hai for " DFID " / %#lx?",
-			 PFID(&han->info.dfid), han->info.cookie);
-		hsm_action_free(han);
-		return;
-	}
+
+	hsm_action_item_fill(han, &hai);
 	hai.hai_len = sizeof(hai);
 
 	ct_report_error(&hai, ECANCELED);
@@ -336,8 +723,8 @@ int hsm_action_new_lustre(struct hsm_action_item *hai, uint32_t archive_id,
 		report_action(han, "cancel " DFID, PFID(&han->info.dfid));
 		if (!han->client) {
 			/* pop request and report to lustre
-			 * We need to report to lustre either han->hai (original request) or
-			 * hai (cancel request), since han->hai is json report the cancel */
+			 * We need to report to lustre either the original
+			 * request or hai (cancel request): report the cancel */
 			hsm_action_free(han);
 			ct_report_error(hai, ECANCELED);
 			return 0;
@@ -356,29 +743,31 @@ int hsm_action_new_lustre(struct hsm_action_item *hai, uint32_t archive_id,
 		return -EINVAL;
 	}
 
-	han = xcalloc(1, sizeof(struct hsm_action_node));
+	/* data is sent as a json string: refuse it early if invalid */
+	json_t *json_data = json_stringn((const char *)hai->hai_data,
+					 hai->hai_len - sizeof(*hai));
+	if (!json_data)
+		return -EINVAL;
+	json_decref(json_data);
+
+	han = slab_alloc(&han_pool);
 #ifdef DEBUG_ACTION_NODE
 	han->magic = DEBUG_ACTION_NODE;
 	CDS_INIT_LIST_HEAD(&han->node);
 #endif
-	han->hai = json_hsm_action_item(hai, archive_id, hal_flags);
-	if (!han->hai) {
-		free(han);
-		return -ENOMEM;
-	}
 	han->info.cookie = hai->hai_cookie;
 	han->info.action = hai->hai_action;
 	/* XXX check usage of hai_fid vs. hai_dfid (in particular for logs,
 	 * we logged hai_fid in lhsm.c... */
 	han->info.dfid = hai->hai_dfid;
+	han->info.fid = hai->hai_fid;
+	han->info.extent = hai->hai_extent;
+	han->info.gid = hai->hai_gid;
 	han->info.hai_len = hai->hai_len;
-	han->info.data = xmemdup0(hai->hai_data, han_data_len(han));
+	han->info.data = intern_dup(hai->hai_data, han_data_len(han));
 	han->info.archive_id = archive_id;
 	han->info.hal_flags = hal_flags;
 	han->info.timestamp = timestamp;
-	// ignore failure here: the worst that can happen is we'll get
-	// order wrong on recovery
-	(void)protocol_setjson_int(han->hai, "timestamp", timestamp);
 
 	if (cancel_client) {
 		// can't fail. We need the assert for scan-build...
@@ -447,9 +836,17 @@ void hsm_action_start(struct hsm_action_node *han, struct client *client)
 
 	if (han->current_count)
 		(*han->current_count)++;
+	if (han->tenant)
+		han->tenant->served++;
+	if (!was_running)
+		han->sent_ns = gettime_ns();
+	if (han->client != client) {
+		hsm_action_running_bytes(han, han->client, false);
+		hsm_action_running_bytes(han, client, true);
+	}
 
 	redis_assign_request(client, han);
-	cds_list_del(&han->node);
+	hsm_action_dequeue(han);
 	han->client = client;
 	cds_list_add_tail(&han->node, &client->active_requests);
 }
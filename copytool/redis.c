@@ -195,7 +195,7 @@ static void cb_insert(redisAsyncContext *ac, void *_reply, void *private)
 }
 
 static int redis_insert(const char *hash, uint64_t cookie, struct lu_fid *dfid,
-			const char *data)
+			const char *data, size_t data_len)
 {
 	int rc;
 	char key[KEY_SIZE];
@@ -205,7 +205,7 @@ static int redis_insert(const char *hash, uint64_t cookie, struct lu_fid *dfid,
 
 	format_key(key, cookie, dfid);
 	rc = redisAsyncCommand(state->redis_ac, cb_insert, (void *)cookie,
-			       "hset %s %s %s", hash, key, data);
+			       "hset %s %s %b", hash, key, data, data_len);
 	if (rc) {
 		rc = redis_error_to_errno(rc);
 		LOG_WARN(rc, "Redis error trying to set cookie %#lx in %s",
@@ -248,29 +248,30 @@ static int redis_delete(const char *hash, const char *key, uint64_t cookie)
 int redis_store_request(struct hsm_action_node *han)
 {
 	char *hai_json_str;
+	json_t *json;
 	int rc;
 
 	if (!state->redis_ac)
 		return 0;
 
-	hai_json_str = json_dumps(han->hai, JSON_COMPACT);
-	if (!hai_json_str) {
-		LOG_WARN(-EINVAL,
-			 "Could not dump hsm action item to json (" DFID ")",
-			 PFID(&han->info.dfid));
-	}
+	json = hsm_action_json(han);
+	if (!json)
+		return -ENOMEM;
+	hai_json_str = json_dumps(json, JSON_COMPACT);
+	json_decref(json);
+	if (!hai_json_str)
+		return -ENOMEM;
 
 	rc = redis_insert("coordinatool_requests", han->info.cookie,
-			  &han->info.dfid, hai_json_str);
+			  &han->info.dfid, hai_json_str, strlen(hai_json_str));
 	free(hai_json_str);
-
 	return rc;
 }
 
 int redis_assign_request(struct client *client, struct hsm_action_node *han)
 {
 	return redis_insert("coordinatool_assigned", han->info.cookie,
-			    &han->info.dfid, client->id);
+			    &han->info.dfid, client->id, strlen(client->id));
 }
 
 int redis_deassign_request(struct hsm_action_node *han)
@@ -465,8 +466,6 @@ static int redis_scan_requests(const char *key UNUSED, const char *value)
 
 static int redis_scan_assigned(const char *key, const char *client_id)
 {
-	struct cds_list_head *n;
-	bool found = false;
 	struct client *client;
 	uint64_t cookie;
 	struct lu_fid dfid;
@@ -488,17 +487,9 @@ static int redis_scan_assigned(const char *key, const char *client_id)
 		return redis_delete("coordinatool_assigned", key, cookie);
 	}
 
-	cds_list_for_each(n, &state->stats.disconnected_clients)
-	{
-		client = caa_container_of(n, struct client, node_clients);
-		if (!strcmp(client_id, client->id)) {
-			found = true;
-			break;
-		}
-	}
-	if (!found) {
+	client = find_client(client_id, true);
+	if (!client)
 		client = client_new_disconnected(client_id);
-	}
 
 #ifdef DEBUG_ACTION_NODE
 	LOG_DEBUG("%s: Moving han %p to active requests %p (redis)", client_id,
@@ -127,6 +127,12 @@ int report_new_action(struct hsm_action_node *han)
 
 	report->refcount++;
 	han->reporting = report;
+	/* only waiting restores get progress reports */
+	if (han->info.action == HSMA_RESTORE) {
+		han->reporting_pos = 0;
+		cds_list_add_tail(&han->reporting_node,
+				  &state->reporting_actions);
+	}
 
 	LOG_DEBUG("Reporting %s refcount++ %d", report->hint, report->refcount);
 
@@ -150,6 +156,8 @@ int report_free_action(struct hsm_action_node *han)
 	if (!han->reporting)
 		return 0;
 
+	if (han->info.action == HSMA_RESTORE)
+		cds_list_del(&han->reporting_node);
 	han->reporting->refcount--;
 
 	LOG_DEBUG("Reporting %s refcount-- %d", han->reporting->hint,
@@ -220,38 +228,13 @@ int64_t report_next_schedule(void)
 	return reporting_schedule_ns;
 }
 
-static bool report_pending_receives_one(struct client *client,
-					struct cds_list_head *list)
+/* restores wait either on the global queue or on their client's */
+static const char *report_queue_owner(struct hsm_action_queue *queue)
 {
-	struct hsm_action_node *han;
-	bool client_found = false;
-	int waiting_count = 0, current_pos = 0;
-
-	/* walk list once to count, a second time to report if needed */
-	cds_list_for_each_entry(han, list, node)
-	{
-		waiting_count++;
-
-		if (!han->reporting)
-			continue;
-		client_found = true;
-	}
-	if (!client_found)
-		return false;
-
-	cds_list_for_each_entry(han, list, node)
-	{
-		current_pos++;
-
-		if (!han->reporting)
-			continue;
-
-		report_action(han, "progress " DFID " %s %d/%d\n",
-			      PFID(&han->info.dfid),
-			      client ? client->id : "global_queue", current_pos,
-			      waiting_count);
-	}
-	return true;
+	if (queue == &state->queues.waiting_restore)
+		return "global_queue";
+	return caa_container_of(queue, struct client, queues.waiting_restore)
+		->id;
 }
 
 void report_pending_receives(int64_t now_ns)
@@ -266,16 +249,25 @@ void report_pending_receives(int64_t now_ns)
 
 	bool found_work = false;
 
-	struct client *client;
-	cds_list_for_each_entry(client, &state->stats.clients, node_clients)
+	/* only look at reported requests, and only report those that moved */
+	struct hsm_action_node *han;
+	cds_list_for_each_entry(han, &state->reporting_actions, reporting_node)
 	{
-		if (report_pending_receives_one(
-			    client, &client->queues.waiting_restore))
-			found_work = true;
-	}
-	if (report_pending_receives_one(NULL, &state->queues.waiting_restore))
+		if (!han->subqueue)
+			continue;
 		found_work = true;
 
+		unsigned int pos = hsm_action_queue_position(han);
+		if (pos == han->reporting_pos)
+			continue;
+		han->reporting_pos = pos;
+
+		report_action(han, "progress " DFID " %s %u/%u\n",
+			      PFID(&han->info.dfid),
+			      report_queue_owner(han->subqueue->queue), pos,
+			      han->subqueue->queue->count);
+	}
+
 	struct reporting *report, *nreport;
 	cds_list_for_each_entry_safe(report, nreport,
 				     &state->reporting_cleanup_list, node)
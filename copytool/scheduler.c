@@ -6,34 +6,17 @@
 
 /* schedule decision helper.
  * sub-helpers return > 0 if scheduled, 0 if skipped */
-struct client *find_client(struct cds_list_head *clients_list,
-			   const char *hostname)
-{
-	struct cds_list_head *n;
-
-	cds_list_for_each(n, clients_list)
-	{
-		struct client *client =
-			caa_container_of(n, struct client, node_clients);
-
-		if (!strcmp(hostname, client->id)) {
-			return client;
-		}
-	}
-	return NULL;
-}
-
-struct cds_list_head *schedule_on_client(struct client *client,
-					 struct hsm_action_node *han)
+struct hsm_action_queue *schedule_on_client(struct client *client,
+					    struct hsm_action_node *han)
 {
 	report_action(han, "assign " DFID " %s\n", PFID(&han->info.dfid),
 		      client->id);
 	/* for archive, respect slots if used. Otherwise just get queue */
 	if (han->info.action == HSMA_ARCHIVE) {
-		struct cds_list_head *list =
+		struct hsm_action_queue *queue =
 			schedule_batch_slot_on_client(client, han);
-		if (list)
-			return list;
+		if (queue)
+			return queue;
 	}
 	return get_queue_list(&client->queues, han);
 }
@@ -43,34 +26,65 @@ schedule_host_mapping_find_client(struct host_mapping *mapping)
 {
 	int first_idx = rand() % mapping->count;
 	int idx = first_idx;
-	const char *hostname = mapping->hosts[idx];
-	struct cds_list_head *clients = &state->stats.clients;
+	const char *hostname = mapping->hosts[idx].name;
+	bool disconnected = false;
 	struct client *client;
 	/* try all configured hosts until one found online,
 	 * and if none all hosts again with disconnected clients,
 	 * and if none of that either we'll create a dummy disconnected
 	 * client for this request: if host settings are set this should
 	 * never go to a global queue. */
-	while ((client = find_client(clients, hostname)) == NULL) {
+	while ((client = find_client(hostname, disconnected)) == NULL) {
 		idx = (idx + 1) % mapping->count;
 		if (idx == first_idx) {
-			if (clients == &state->stats.disconnected_clients)
+			if (disconnected)
 				break;
-			clients = &state->stats.disconnected_clients;
+			disconnected = true;
 		}
-		hostname = mapping->hosts[idx];
+		hostname = mapping->hosts[idx].name;
 	}
 
 	if (!client) {
 		/* note: it's a disconnected client with expiry, but if it expires
 		 * without any client connecting then requests here will be rescheduled
 		 * through this function again, and that'll recreate a new client.. */
-		client = client_new_disconnected(mapping->hosts[idx]);
+		client = client_new_disconnected(mapping->hosts[idx].name);
 	}
 
 	return client;
 }
 
+/* Weighted rendezvous hashing: each host draws one pseudo-random number
+ * from (value, host) per unit of weight and the highest draw wins.
+ * A host then gets values in proportion to its weight and, since draws
+ * do not depend on other hosts, adding or removing one only moves the
+ * values it wins or had won (unlike hash % count that moves almost
+ * everything). */
+int host_mapping_pick(struct host_mapping *mapping, const char *value,
+		      size_t value_len)
+{
+	uint64_t key = hash_mix(dbj2(value, value_len));
+	uint64_t best = 0, seed, draw;
+	int index = 0, i;
+	unsigned int j;
+
+	for (i = 0; i < mapping->count; i++) {
+		struct host_mapping_host *host = &mapping->hosts[i];
+
+		for (j = 0; j < host->weight; j++) {
+			/* splitmix64 steps: hashes of similar host
+			 * names are close, their draws must not collide */
+			seed = host->hash + j * 0x9e3779b97f4a7c15ULL;
+			draw = hash_mix(key ^ hash_mix(seed));
+			if (draw > best) {
+				best = draw;
+				index = i;
+			}
+		}
+	}
+	return index;
+}
+
 static struct client *
 schedule_host_mapping_consistent_hash(struct host_mapping *mapping,
 				      struct hsm_action_node *han)
@@ -81,7 +95,6 @@ schedule_host_mapping_consistent_hash(struct host_mapping *mapping,
 	const char *value;
 	size_t value_len;
 	size_t hash_len;
-	size_t index;
 	size_t hash;
 
 	value = parse_hint(han, mapping->tag, &value_len);
@@ -104,29 +117,28 @@ schedule_host_mapping_consistent_hash(struct host_mapping *mapping,
 		data = replace_string(han->info.data, han_data_len(han),
 				      hash_str, hash_len, value, value_len);
 
-		free((void *)han->info.data);
-		han->info.data = data;
+		/* keep hai_len in sync with data */
+		intern_put(han->info.data);
+		han->info.hai_len += hash_len - value_len;
+		han->info.data = intern_dup(data, han_data_len(han));
+		hsm_action_json_reset(han);
 
-		if (json_object_set_new(han->hai, "hai_data",
-					json_string(data)) != 0)
-			return NULL;
+		free(data);
 
 		value = hash_str;
 		value_len = hash_len;
 	}
 
-	hash = dbj2(value, value_len);
-	index = hash % mapping->count;
-
-	hostname = mapping->hosts[index];
+	hostname = mapping->hosts[host_mapping_pick(mapping, value, value_len)]
+			   .name;
 
 	free(hash_str);
 
-	client = find_client(&state->stats.clients, hostname);
+	client = find_client(hostname, false);
 	if (client)
 		return client;
 
-	client = find_client(&state->stats.disconnected_clients, hostname);
+	client = find_client(hostname, true);
 	if (client)
 		return client;
 
@@ -135,7 +147,8 @@ schedule_host_mapping_consistent_hash(struct host_mapping *mapping,
 	return client;
 }
 
-static struct cds_list_head *schedule_host_mapping(struct hsm_action_node *han)
+static struct hsm_action_queue *
+schedule_host_mapping(struct hsm_action_node *han)
 {
 	/* only doing this for archive for now */
 	if (han->info.action != HSMA_ARCHIVE)
@@ -171,25 +184,25 @@ static struct cds_list_head *schedule_host_mapping(struct hsm_action_node *han)
 }
 
 /* fill in static action item informations */
-struct cds_list_head *hsm_action_node_schedule(struct hsm_action_node *han)
+struct hsm_action_queue *hsm_action_node_schedule(struct hsm_action_node *han)
 {
-	struct cds_list_head *list;
+	struct hsm_action_queue *queue;
 
 	/* If host mapping is active with multiple candidates, we'd need to
 	 * look for slots in all matches first so just look for currently
 	 * running slots first. If host mapping is removed the two schedule
 	 * batch slot functions can likely be merged together */
-	list = schedule_batch_slot_active(han);
-	if (list)
-		return list;
+	queue = schedule_batch_slot_active(han);
+	if (queue)
+		return queue;
 
-	list = schedule_host_mapping(han);
-	if (list)
-		return list;
+	queue = schedule_host_mapping(han);
+	if (queue)
+		return queue;
 
-	list = schedule_batch_slot_new(han);
-	if (list)
-		return list;
+	queue = schedule_batch_slot_new(han);
+	if (queue)
+		return queue;
 
 #if HAVE_PHOBOS
 	return phobos_schedule(han);
@@ -197,25 +210,52 @@ struct cds_list_head *hsm_action_node_schedule(struct hsm_action_node *han)
 }
 
 /* check if we still want to schedule action to client.
- * We can put node back in global queue or just skip it
- * returns true if can schedule
+ * returns true if can schedule, otherwise sets where han should go
+ * instead (NULL to reschedule it).
+ * Refused requests must only be moved once the pass is over: requeueing
+ * can splice or reorder the queues being walked.
  * if needed later we can make this return a decision enum
  * OK/NEXT_ACTION/NEXT_CLIENT
  */
 static bool schedule_can_send(struct client *client,
-			      struct hsm_action_node *han)
+			      struct hsm_action_node *han,
+			      struct hsm_action_queue **requeue)
 {
+	*requeue = NULL;
 	if (!batch_slot_can_send(client, han))
 		return false;
 #if HAVE_PHOBOS
-	return phobos_can_send(client, han);
+	return phobos_can_send(client, han, requeue);
 #else
 	return true;
 #endif
 }
 
-/* enqueue to json list */
-static int recv_enqueue(struct client *client, json_t *hai_list,
+/* append han to items, encoded for client */
+static int recv_items_append(struct client *client, struct recv_items *items,
+			     struct hsm_action_node *han)
+{
+	size_t len = items->buf.len;
+	int rc;
+
+	if (client->binary) {
+		hsm_action_encode_bin(han, &items->buf);
+	} else {
+		if (items->count)
+			protocol_bin_put_bytes(&items->buf, ",", 1);
+		rc = hsm_action_encode_json(han, &items->buf);
+		if (rc) {
+			/* drop partial item */
+			items->buf.len = len;
+			return rc;
+		}
+	}
+	items->count++;
+	return 0;
+}
+
+/* enqueue to recv items */
+static int recv_enqueue(struct client *client, struct recv_items *items,
 			struct hsm_action_node *han, size_t *enqueued_bytes)
 {
 	int max_action;
@@ -249,7 +289,8 @@ static int recv_enqueue(struct client *client, json_t *hai_list,
 	if (max_action >= 0 && max_action <= *current_count)
 		return -ERANGE;
 
-	json_array_append(hai_list, han->hai);
+	if (recv_items_append(client, items, han))
+		return -EINVAL;
 	(*enqueued_bytes) += sizeof(struct hsm_action_item) + han->info.hai_len;
 
 	LOG_INFO("%s (%d): Sending " DFID " (cookie %#lx)", client->id,
@@ -258,25 +299,388 @@ static int recv_enqueue(struct client *client, json_t *hai_list,
 	return 0;
 }
 
-/* accept the archive_id if it is in the list, but also if there
- * is no list or if it is empty (no archive_id set by client) */
-static bool accept_archive_id(int *archives, int archive_id)
+/* what subqueues looked at during one priority class of a
+ * ct_schedule_client() pass must match */
+struct schedule_pass {
+	struct client *client;
+	int priority;
+	int64_t now;
+	/* subqueues stamped with it are done for this class */
+	uint64_t gen;
+	/* gen of the pass' first class */
+	uint64_t first_gen;
+	/* set once something is enqueued: the reply's archive_id/hal_flags */
+	bool match;
+	uint32_t archive_id;
+	uint64_t hal_flags;
+	/* known bytes per connected mover, 0 if only one */
+	uint64_t bytes_share;
+	/* requests schedule_can_send() refused, requeued after the pass */
+	struct schedule_refused {
+		struct hsm_action_node *han;
+		struct hsm_action_queue *queue;
+	} *refused;
+	size_t refused_count, refused_size;
+	/* without fair share: ready subqueues of the queue being looked at,
+	 * oldest head first */
+	struct hsm_action_subqueue **order;
+	size_t order_count, order_pos, order_size;
+};
+
+/* han was taken out of its queue, keep it aside until the pass is over */
+static void schedule_refuse(struct schedule_pass *pass,
+			    struct hsm_action_node *han,
+			    struct hsm_action_queue *queue)
 {
-	bool rc = true;
+	if (pass->refused_count == pass->refused_size) {
+		pass->refused_size = pass->refused_size ?
+					     pass->refused_size * 2 :
+					     16;
+		pass->refused = xrealloc(pass->refused,
+					 pass->refused_size *
+						 sizeof(*pass->refused));
+	}
+	pass->refused[pass->refused_count].han = han;
+	pass->refused[pass->refused_count].queue = queue;
+	pass->refused_count++;
+}
 
-	if (!archives)
+static void schedule_requeue_refused(struct schedule_pass *pass)
+{
+	for (size_t i = 0; i < pass->refused_count; i++) {
+		struct hsm_action_node *han = pass->refused[i].han;
+		int rc = hsm_action_enqueue(han, pass->refused[i].queue);
+
+		/* XXX: cannot report errors back.. */
+		if (rc < 0)
+			LOG_ERROR(rc, "Could not requeue " DFID,
+				  PFID(&han->info.dfid));
+	}
+	free(pass->refused);
+}
+
+/* client can take one more request of that type */
+static bool client_action_room(struct client *client,
+			       enum hsm_copytool_action action)
+{
+	switch (action) {
+	case HSMA_RESTORE:
+		return client->max_restore < 0 ||
+		       client->current_restore < client->max_restore;
+	case HSMA_ARCHIVE:
+		return client->max_archive < 0 ||
+		       client->current_archive < client->max_archive;
+	case HSMA_REMOVE:
+		return client->max_remove < 0 ||
+		       client->current_remove < client->max_remove;
+	default:
 		return true;
+	}
+}
+
+/* han would not fit in what client accepts in flight */
+static bool client_bytes_full(struct client *client,
+			      struct hsm_action_node *han)
+{
+	return client->max_inflight_bytes &&
+	       client->inflight_bytes + han->info.size >
+		       client->max_inflight_bytes;
+}
 
-	while (*archives) {
-		if (*archives == archive_id)
+/* han should not go to the pass client because of its size: it would
+ * exceed the client max_inflight_bytes, or its share of all known bytes
+ * while a less loaded mover able to take it waits for work.
+ * A client with nothing in flight takes anything, however big. */
+static bool schedule_bytes_full(struct schedule_pass *pass,
+				struct hsm_action_node *han)
+{
+	struct client *client = pass->client, *other;
+
+	if (!han->info.size || !client->inflight_bytes)
+		return false;
+	if (client_bytes_full(client, han))
+		return true;
+	if (!pass->bytes_share ||
+	    client->inflight_bytes + han->info.size <= pass->bytes_share)
+		return false;
+
+	cds_list_for_each_entry(other, &state->waiting_clients, waiting_node)
+	{
+		if (other != client &&
+		    other->inflight_bytes < client->inflight_bytes &&
+		    accept_archive_id(other->archives, han->info.archive_id) &&
+		    client_action_room(other, han->info.action) &&
+		    !client_bytes_full(other, han))
 			return true;
-		archives++;
-		rc = false;
 	}
+	return false;
+}
+
+/* class han gets sent in: the one it came with, raised by one for every
+ * priority_aging_sec it waited */
+int schedule_priority(struct hsm_action_subqueue *sq,
+		      struct hsm_action_node *han, int64_t now)
+{
+	int64_t aging = state->config.priority_aging_ns;
+	int64_t waited = now - (int64_t)han->info.timestamp;
+
+	if (!aging || waited < aging)
+		return sq->priority;
+	waited /= aging;
+	if (waited >= PRIORITY_MAX - sq->priority)
+		return PRIORITY_MAX;
+	return sq->priority + waited;
+}
+
+static bool schedule_subqueue_ready(struct schedule_pass *pass,
+				    struct hsm_action_subqueue *sq)
+{
+	if (!sq->count || sq->schedule_gen == pass->gen ||
+	    !accept_archive_id(pass->client->archives, sq->archive_id))
+		return false;
+	if (pass->match && (sq->archive_id != pass->archive_id ||
+			    sq->hal_flags != pass->hal_flags))
+		return false;
+	/* oldest first, so the head has the highest class */
+	return schedule_priority(sq, hsm_action_subqueue_head(sq), pass->now) >=
+	       pass->priority;
+}
+
+/* fair share: next subqueue in round robin order starting after sq, or
+ * from the queue cursor if sq is NULL (the last subqueue visited, if it
+ * has some of its round left). sq itself comes last, for another round */
+static struct hsm_action_subqueue *
+schedule_drr_next(struct schedule_pass *pass, struct hsm_action_queue *queue,
+		  struct hsm_action_subqueue *sq)
+{
+	struct cds_list_head *n, *start;
+
+	if (sq)
+		n = sq->node.next;
+	else if (!queue->drr_next)
+		n = queue->subqueues.next;
+	else if (queue->drr_next->deficit)
+		n = &queue->drr_next->node;
+	else
+		n = queue->drr_next->node.next;
+
+	start = n;
+	do {
+		if (n == &queue->subqueues)
+			continue;
+		sq = caa_container_of(n, struct hsm_action_subqueue, node);
+		if (schedule_subqueue_ready(pass, sq))
+			return sq;
+	} while ((n = n->next) != start);
+	return NULL;
+}
+
+static int schedule_subqueue_cmp(const void *a, const void *b)
+{
+	struct hsm_action_node *ha =
+		hsm_action_subqueue_head(*(struct hsm_action_subqueue **)a);
+	struct hsm_action_node *hb =
+		hsm_action_subqueue_head(*(struct hsm_action_subqueue **)b);
+
+	if (hsm_action_older(ha, hb))
+		return -1;
+	return hsm_action_older(hb, ha);
+}
+
+/* start looking at queue for the pass class: false if none of its
+ * subqueues can have anything of that class.
+ * Subqueues only lose requests during a pass, so the highest class of
+ * their heads can only go down and is remembered for the next classes:
+ * they do not rescan the queue if it is already below them.
+ * Without fair share, subqueues are then taken oldest head first: the
+ * ready ones are sorted once here rather than searched for each time */
+static bool schedule_queue_ready(struct schedule_pass *pass,
+				 struct hsm_action_queue *queue)
+{
+	bool fair_share = state->config.fair_share_hint != NULL;
+	struct hsm_action_subqueue *sq;
+	int priority, max = -1;
+
+	if (queue->schedule_gen >= pass->first_gen &&
+	    queue->schedule_priority < pass->priority)
+		return false;
+
+	pass->order_count = pass->order_pos = 0;
+	cds_list_for_each_entry(sq, &queue->subqueues, node)
+	{
+		if (!sq->count ||
+		    !accept_archive_id(pass->client->archives, sq->archive_id))
+			continue;
+		priority = schedule_priority(sq, hsm_action_subqueue_head(sq),
+					     pass->now);
+		if (priority > max)
+			max = priority;
+		if (fair_share || !schedule_subqueue_ready(pass, sq))
+			continue;
+		if (pass->order_count == pass->order_size) {
+			pass->order_size = pass->order_size ?
+						   pass->order_size * 2 :
+						   16;
+			pass->order = xrealloc(pass->order,
+					       pass->order_size *
+						       sizeof(*pass->order));
+		}
+		pass->order[pass->order_count++] = sq;
+	}
+	queue->schedule_gen = pass->gen;
+	queue->schedule_priority = max;
+
+	if (pass->order_count > 1)
+		qsort(pass->order, pass->order_count, sizeof(*pass->order),
+		      schedule_subqueue_cmp);
+	return max >= pass->priority;
+}
+
+/* subqueue to look at next in queue: in round robin order with fair
+ * share, else the one with the oldest request.
+ * schedule_queue_ready() must have been called first for this class */
+static struct hsm_action_subqueue *
+schedule_next_subqueue(struct schedule_pass *pass,
+		       struct hsm_action_queue *queue,
+		       struct hsm_action_subqueue *sq)
+{
+	if (state->config.fair_share_hint)
+		return schedule_drr_next(pass, queue, sq);
+
+	/* others did not change since sorted, but pass->match may have
+	 * been set since */
+	while (pass->order_pos < pass->order_count) {
+		sq = pass->order[pass->order_pos++];
+		if (schedule_subqueue_ready(pass, sq))
+			return sq;
+	}
+	return NULL;
+}
 
-	return rc;
+static struct client_perf *client_perf(struct client *client,
+				       enum hsm_copytool_action action)
+{
+	switch (action) {
+	case HSMA_RESTORE:
+		return &client->perf_restore;
+	case HSMA_ARCHIVE:
+		return &client->perf_archive;
+	case HSMA_REMOVE:
+		return &client->perf_remove;
+	default:
+		return NULL;
+	}
 }
 
+/* new samples count for 1/PERF_EWMA_WEIGHT of the moving averages */
+#define PERF_EWMA_WEIGHT 8
+/* busy time a completion rate sample is measured over */
+#define PERF_WINDOW_NS (10 * NS_IN_SEC)
+
+/* since when client has been working on han's action type without a
+ * break: its oldest request of that type in flight, unless it completed
+ * another one since */
+static int64_t client_busy_since(struct client *client,
+				 struct hsm_action_node *han,
+				 struct client_perf *perf)
+{
+	struct hsm_action_node *oldest = han, *cur;
+
+	/* sent order */
+	cds_list_for_each_entry(cur, &client->active_requests, node)
+	{
+		if (cur->info.action == han->info.action) {
+			oldest = cur;
+			break;
+		}
+	}
+	if (oldest->sent_ns < perf->last_done_ns)
+		return perf->last_done_ns;
+	return oldest->sent_ns;
+}
+
+void client_perf_done(struct client *client, struct hsm_action_node *han,
+		      int64_t now_ns)
+{
+	struct client_perf *perf = client_perf(client, han->info.action);
+	int64_t latency = now_ns - han->sent_ns;
+	uint64_t rate;
+	double done_rate;
+
+	if (!perf || latency <= 0)
+		return;
+
+	/* completion rate: completions over the time spent with work of that
+	 * type in flight, so that neither idle time nor how many requests
+	 * wait on the mover's side change it */
+	perf->window_busy_ns += now_ns - client_busy_since(client, han, perf);
+	perf->window_done++;
+	perf->last_done_ns = now_ns;
+	if (perf->window_busy_ns >= PERF_WINDOW_NS) {
+		done_rate = (double)perf->window_done * NS_IN_SEC /
+			    perf->window_busy_ns;
+		if (!perf->done_rate)
+			perf->done_rate = done_rate;
+		else
+			perf->done_rate += (done_rate - perf->done_rate) /
+					   PERF_EWMA_WEIGHT;
+		perf->window_done = 0;
+		perf->window_busy_ns = 0;
+	}
+
+	if (!perf->latency_ns)
+		perf->latency_ns = latency;
+	else
+		perf->latency_ns +=
+			(latency - perf->latency_ns) / PERF_EWMA_WEIGHT;
+
+	if (!han->info.size)
+		return;
+	rate = han->info.size * 1000 / ((uint64_t)latency / NS_IN_MSEC ?: 1);
+	if (!perf->throughput)
+		perf->throughput = rate;
+	else
+		perf->throughput += rate / PERF_EWMA_WEIGHT -
+				    perf->throughput / PERF_EWMA_WEIGHT;
+}
+
+/* how many of the pending requests of that type client should get in
+ * one pass: in proportion to its completion rate among connected movers.
+ * Movers without an estimate yet count as average ones, so without any
+ * this is an even split */
+static unsigned int schedule_share(struct client *client,
+				   enum hsm_copytool_action action,
+				   unsigned int pending)
+{
+	unsigned int movers = state->stats.clients_connected, known = 0;
+	double rate = client_perf(client, action)->done_rate, rates = 0;
+	struct client *other;
+
+	if (movers <= 1)
+		return pending;
+
+	cds_list_for_each_entry(other, &state->stats.clients, node_clients)
+	{
+		double other_rate = client_perf(other, action)->done_rate;
+
+		if (other_rate) {
+			rates += other_rate;
+			known++;
+		}
+	}
+	if (!known)
+		return pending / movers;
+
+	if (!rate)
+		rate = rates / known;
+	rates += (movers - known) * rates / known;
+	return pending * rate / rates;
+}
+
+/* bumped for every priority class of a ct_schedule_client() pass,
+ * see struct schedule_pass */
+static uint64_t schedule_gen;
+
 void ct_schedule_client(struct client *client)
 {
 	if (client->status != CLIENT_WAITING)
@@ -285,178 +689,239 @@ void ct_schedule_client(struct client *client)
 	if (state->locked != CTOOL_LOCK_UNLOCKED)
 		return;
 
-	json_t *hai_list = json_array();
-	if (!hai_list)
-		abort();
+	/* client is not reading its replies fast enough: wait until it
+	 * caught up, handle_client_event will reschedule it */
+	if (client_send_throttled(client))
+		return;
+
+	struct recv_items items = { 0 };
 
-	/* check if there are pending requests
-	 * priority restore > remove > archive is hardcoded for now */
+	/* check if there are pending requests */
 	size_t enqueued_bytes = 0;
-	struct cds_list_head *schedule_restore_lists[] = {
+	struct hsm_action_queue *schedule_restore_queues[] = {
 		&client->queues.waiting_restore, &state->queues.waiting_restore,
 		NULL
 	};
-	struct cds_list_head *schedule_remove_lists[] = {
+	struct hsm_action_queue *schedule_remove_queues[] = {
 		&client->queues.waiting_remove, &state->queues.waiting_remove,
 		NULL
 	};
-	/* for archives we either only use the "global" lists or the batch lists,
+	/* for archives we either only use the "global" queues or the batch queues,
 	 * this is a config-time switch. */
-	struct cds_list_head *schedule_archive_lists[] = {
+	struct hsm_action_queue *schedule_archive_queues[] = {
 		&client->queues.waiting_archive, &state->queues.waiting_archive,
 		NULL
 	};
 	/* VLAs are bad, but batch_slots is supposed to be tiny.. */
-	struct cds_list_head
-		*schedule_archive_batch_lists[state->config.batch_slots + 1];
+	struct hsm_action_queue
+		*schedule_archive_batch_queues[state->config.batch_slots + 1];
 	int i;
 	for (i = 0; i < state->config.batch_slots; i++) {
-		schedule_archive_batch_lists[i] =
+		schedule_archive_batch_queues[i] =
 			&client->batch[i].waiting_archive;
 	}
-	schedule_archive_batch_lists[state->config.batch_slots] = NULL;
+	schedule_archive_batch_queues[state->config.batch_slots] = NULL;
 
 	/* move anything we can from client archive queue to each batch */
 	batch_reschedule_client(client);
 
-	struct cds_list_head **schedule_lists[] = {
-		schedule_restore_lists,
-		schedule_remove_lists,
-		state->config.batch_slots ? schedule_archive_batch_lists :
-					    schedule_archive_lists,
+	struct hsm_action_queue **schedule_queues[] = {
+		schedule_restore_queues,
+		schedule_remove_queues,
+		state->config.batch_slots ? schedule_archive_batch_queues :
+					    schedule_archive_queues,
 	};
 	int *max_action[] = { &client->max_restore, &client->max_remove,
 			      &client->max_archive };
 	int *current_count[] = { &client->current_restore,
 				 &client->current_remove,
 				 &client->current_archive };
+	enum hsm_copytool_action actions[] = { HSMA_RESTORE, HSMA_REMOVE,
+					       HSMA_ARCHIVE };
 	unsigned int *pending_count[] = { &state->stats.pending_restore,
 					  &state->stats.pending_remove,
 					  &state->stats.pending_archive };
-	uint32_t archive_id;
-	uint64_t hal_flags;
+	unsigned int enqueued_pass[countof(max_action)] = { 0 };
+	unsigned int share_pass[countof(max_action)];
+	bool type_done[countof(max_action)] = { false };
+	struct schedule_pass pass = { .client = client };
+	struct hsm_action_subqueue *sq;
+	bool fair_share = state->config.fair_share_hint != NULL;
+
+	if (state->config.priority_aging_ns)
+		pass.now = gettime_ns();
+	if (state->stats.clients_connected > 1)
+		pass.bytes_share = (state->stats.running_bytes +
+				    state->stats.pending_bytes) /
+				   state->stats.clients_connected;
+	for (size_t i = 0; i < countof(max_action); i++)
+		share_pass[i] =
+			schedule_share(client, actions[i], *pending_count[i]);
+
 	/* special-case cancels first: these don't get acked and are freed immediately after
 	 * enqueue, enqueueing guarantees they're sent */
 	struct hsm_action_node *han, *nexthan;
-	cds_list_for_each_entry_safe(han, nexthan, &client->cancels, node)
-	{
-		if (enqueued_bytes == 0) {
-			archive_id = han->info.archive_id;
-			hal_flags = han->info.hal_flags;
-		}
-		if ((archive_id != han->info.archive_id ||
-		     hal_flags != han->info.hal_flags)) {
-			/* can only send one archive id at a time */
-			continue;
+	sq = hsm_action_queue_oldest(&client->cancels, NULL);
+	if (sq) {
+		pass.archive_id = sq->archive_id;
+		pass.hal_flags = sq->hal_flags;
+		cds_list_for_each_entry_safe(han, nexthan, &sq->actions, node)
+		{
+			if (recv_enqueue(client, &items, han, &enqueued_bytes))
+				break;
+			LOG_INFO("%s (%d): Sending cancel for " DFID
+				 " (cookie %#lx)",
+				 client->id, client->fd, PFID(&han->info.dfid),
+				 han->info.cookie);
+			hsm_action_free(han);
 		}
-		if (recv_enqueue(client, hai_list, han, &enqueued_bytes))
-			break;
-		LOG_INFO("%s (%d): Sending cancel for " DFID " (cookie %#lx)",
-			 client->id, client->fd, PFID(&han->info.dfid),
-			 han->info.cookie);
-		hsm_action_free(han);
+		pass.match = enqueued_bytes != 0;
 	}
-	for (size_t i = 0; i < countof(max_action); i++) {
-		unsigned int enqueued_pass = 0,
-			     pending_pass = *pending_count[i];
-		struct cds_list_head *n, *nnext;
-		int j, stuck = 0;
-		/* note: cds_manylists_for_each_safe() is a double-for loop, so break
-		 * only breaks up halfway, and goto is used for more flow control:
-		 * - continue: skip to next archive in current list
-		 * - break: skip to next list of the same action type (e.g. next slot)
-		 * - goto real_break: break out of the double-loop and continue to next action
+	/* highest priority class first, and within a class restore > remove >
+	 * archive. Limits are per action type, across classes. */
+	pass.first_gen = schedule_gen + 1;
+	for (size_t k = 0; k < PRIORITY_CLASSES * countof(max_action); k++) {
+		size_t i = k % countof(max_action);
+		struct hsm_action_queue *queue;
+		int j;
+
+		if (i == 0) {
+			pass.priority = PRIORITY_MAX - k / countof(max_action);
+			pass.gen = ++schedule_gen;
+		}
+		if (type_done[i])
+			continue;
+		/* queues are split by (archive_id, hal_flags) and a reply can only
+		 * carry one such pair: the first item picked fixes it, then only
+		 * matching subqueues of each following queue are looked at.
+		 * Until then, subqueues for archive ids the client does not serve
+		 * are skipped altogether.
+		 * Subqueues are taken oldest first or, with fair share, in deficit
+		 * round robin order.
+		 * - break: done with this subqueue, try the next one
+		 * - goto next_queue: skip to next queue of the same action type
+		 *   (e.g. next slot)
+		 * - goto real_break: done with this action type, in all classes
 		 * - goto schedule_done: break out of this (outer) loop and send what was added
 		 *   to client
 		 */
-		cds_manylists_for_each_safe(j, n, nnext, schedule_lists[i])
-		{
-			int *extra_count = NULL;
-			if (stuck++ > 100) {
-				/* this is a poor workaround until a better solution
-				 * is ready: at least the can send callback can re-enqueue
-				 * in the same queue we're pulling from, making this loop never
-				 * end. Just stop after 100 items, we can always send more work
-				 * in next iteration if it was actually progressing.
-				 */
-				goto real_break;
+		for (j = 0; (queue = schedule_queues[i][j]); j++) {
+			struct cds_list_head *n, *nnext;
+			bool more;
+
+			sq = NULL;
+			if (schedule_queue_ready(&pass, queue))
+				sq = schedule_next_subqueue(&pass, queue, NULL);
+next_subqueue:
+			if (!sq)
+				continue;
+			if (fair_share) {
+				queue->drr_next = sq;
+				if (!sq->deficit)
+					sq->deficit = sq->tenant->weight;
 			}
-			if (client->max_archive >= 0 &&
-			    state->config.batch_slots &&
-			    max_action[i] == &client->max_archive) {
-				/* this is a batch */
-				assert(j < state->config.batch_slots);
-				extra_count = &client->batch[j].current_count;
-				if (*max_action[i] >= 0) {
-					/* check one batch doesn't hog all the actions (round up) */
-					int batch_max =
-						(*max_action[i] +
-						 state->config.batch_slots -
-						 1) /
-						state->config.batch_slots;
-					if (*extra_count >= batch_max) {
-						/* skip to next batch slot */
-						break;
+			more = false;
+			cds_list_for_each_safe(n, nnext, &sq->actions)
+			{
+				int *extra_count = NULL;
+				if (client->max_archive >= 0 &&
+				    state->config.batch_slots &&
+				    max_action[i] == &client->max_archive) {
+					/* this is a batch */
+					assert(j < state->config.batch_slots);
+					extra_count =
+						&client->batch[j].current_count;
+					if (*max_action[i] >= 0) {
+						/* check one batch doesn't hog all the actions (round up) */
+						int batch_max =
+							(*max_action[i] +
+							 state->config.batch_slots -
+							 1) /
+							state->config.batch_slots;
+						if (*extra_count >= batch_max) {
+							/* skip to next batch slot */
+							goto next_queue;
+						}
 					}
 				}
-			}
-			if (enqueued_bytes >
-			    client->max_bytes - HAI_SIZE_MARGIN) {
-				goto schedule_done;
-			}
-			if (*max_action[i] >= 0 &&
-			    *max_action[i] <= *current_count[i]) {
-				goto real_break;
-			}
+				if (enqueued_bytes >
+				    client->max_bytes - HAI_SIZE_MARGIN) {
+					goto schedule_done;
+				}
+				if (*max_action[i] >= 0 &&
+				    *max_action[i] <= *current_count[i]) {
+					goto real_break;
+				}
 
-			struct hsm_action_node *han = caa_container_of(
-				n, struct hsm_action_node, node);
-			if (enqueued_bytes == 0) {
-				if (!accept_archive_id(client->archives,
-						       han->info.archive_id)) {
+				struct hsm_action_node *han = caa_container_of(
+					n, struct hsm_action_node, node);
+				struct hsm_action_queue *requeue;
+				/* the rest waited less: left to lower classes */
+				if (schedule_priority(sq, han, pass.now) <
+				    pass.priority)
+					break;
+				/* keep order: no smaller request overtakes it */
+				if (schedule_bytes_full(&pass, han))
+					goto real_break;
+				if (!schedule_can_send(client, han, &requeue)) {
+					/* only han leaves sq, nnext stays valid */
+					hsm_action_dequeue(han);
+					schedule_refuse(&pass, han, requeue);
 					continue;
 				}
-				archive_id = han->info.archive_id;
-				hal_flags = han->info.hal_flags;
-			}
-			if ((archive_id != han->info.archive_id ||
-			     hal_flags != han->info.hal_flags)) {
-				/* can only send one archive id at a time */
-				continue;
-			}
-			if (!schedule_can_send(client, han)) {
-				continue;
-			}
-			if (recv_enqueue(client, hai_list, han,
-					 &enqueued_bytes)) {
-				goto real_break;
+				if (recv_enqueue(client, &items, han,
+						 &enqueued_bytes)) {
+					goto real_break;
+				}
+				pass.match = true;
+				pass.archive_id = sq->archive_id;
+				pass.hal_flags = sq->hal_flags;
+				/* before start: dequeue resets it if sq empties */
+				if (fair_share)
+					sq->deficit--;
+				report_action(han, "sent " DFID " %s\n",
+					      PFID(&han->info.dfid), client->id);
+				han->current_count = extra_count;
+				hsm_action_start(han, client);
+				enqueued_pass[i]++;
+				/* don't hand in more than its share of the work
+				 * if other clients waiting */
+				if (enqueued_pass[i] > share_pass[i])
+					goto next_queue;
+				/* tenant used its share for this round */
+				if (fair_share && !sq->deficit) {
+					more = true;
+					break;
+				}
 			}
-			report_action(han, "sent " DFID " %s\n",
-				      PFID(&han->info.dfid), client->id);
-			han->current_count = extra_count;
-			hsm_action_start(han, client);
-			enqueued_pass++;
-			/* don't hand in too much work if other clients waiting */
-			if (enqueued_pass >
-			    pending_pass / state->stats.clients_connected)
-				break;
+			/* done with it for this class, unless it only used up
+			 * its round robin share */
+			if (!more)
+				sq->schedule_gen = pass.gen;
+			sq = schedule_next_subqueue(&pass, queue, sq);
+			goto next_subqueue;
+next_queue:
+			(void)0;
 		}
+		continue;
 real_break:
-		(void)0;
+		type_done[i] = true;
 	}
 schedule_done:
+	schedule_requeue_refused(&pass);
+	free(pass.order);
 
 	if (!enqueued_bytes) {
-		json_decref(hai_list);
+		protocol_bin_free(&items.buf);
 		return;
 	}
 
 	cds_list_del(&client->waiting_node);
 	client->status = CLIENT_READY;
 
-	// frees hai_list
-	int rc = protocol_reply_recv(client, state->fsname, archive_id,
-				     hal_flags, hai_list, 0, NULL);
+	// frees items
+	int rc = protocol_reply_recv(client, state->fsname, pass.archive_id,
+				     pass.hal_flags, &items, 0, NULL);
 	if (rc < 0) {
 		LOG_ERROR(rc, "%s (%d): Could not send reply", client->id,
 			  client->fd);
@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Fixed size object pools for hsm action nodes and small blobs.
+ *
+ * Objects are carved from SLAB_SIZE mappings aligned on their size, so
+ * the slab header is found by masking the object address. Freed objects
+ * go back to their slab; a slab that empties is unmapped (keeping one
+ * per pool around) so memory actually goes back to the system after a
+ * big wave of actions drained, unlike malloc's heap.
+ */
+
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "coordinatool.h"
+
+#define SLAB_OBJ_ALIGN 16
+
+struct slab {
+	/* in pool partial or full list */
+	struct cds_list_head node;
+	struct slab_pool *pool;
+	/* freed objects, linked through their first word */
+	void *free_list;
+	/* objects past this were never handed out */
+	char *unused;
+	unsigned int in_use;
+};
+
+CDS_LIST_HEAD(slab_pools);
+
+static struct slab_pool slab_blob_pools[] = {
+	SLAB_POOL_INIT("blob16", 16),	SLAB_POOL_INIT("blob32", 32),
+	SLAB_POOL_INIT("blob64", 64),	SLAB_POOL_INIT("blob128", 128),
+	SLAB_POOL_INIT("blob256", 256), SLAB_POOL_INIT("blob512", 512),
+	SLAB_POOL_INIT("blob1024", 1024),
+};
+
+#define SLAB_BLOB_POOLS \
+	(sizeof(slab_blob_pools) / sizeof(slab_blob_pools[0]))
+
+static inline size_t slab_header_size(void)
+{
+	return (sizeof(struct slab) + SLAB_OBJ_ALIGN - 1) &
+	       ~(size_t)(SLAB_OBJ_ALIGN - 1);
+}
+
+static void slab_pool_init(struct slab_pool *pool)
+{
+	pool->obj_size = (pool->obj_size + SLAB_OBJ_ALIGN - 1) &
+			 ~(size_t)(SLAB_OBJ_ALIGN - 1);
+	pool->objs_per_slab =
+		(SLAB_SIZE - slab_header_size()) / pool->obj_size;
+	assert(pool->objs_per_slab > 1);
+	CDS_INIT_LIST_HEAD(&pool->partial);
+	CDS_INIT_LIST_HEAD(&pool->full);
+	cds_list_add_tail(&pool->node, &slab_pools);
+}
+
+static struct slab *slab_new(struct slab_pool *pool)
+{
+	struct slab *slab;
+	uintptr_t addr, aligned;
+
+	/* map twice the size and trim to get an aligned slab */
+	addr = (uintptr_t)mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ((void *)addr == MAP_FAILED)
+		abort();
+	aligned = (addr + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1);
+	if (aligned != addr)
+		munmap((void *)addr, aligned - addr);
+	if (aligned + SLAB_SIZE != addr + 2 * SLAB_SIZE)
+		munmap((void *)(aligned + SLAB_SIZE),
+		       addr + SLAB_SIZE - aligned);
+
+	/* fresh mapping is zeroed, only set what isn't 0 */
+	slab = (struct slab *)aligned;
+	slab->pool = pool;
+	slab->unused = (char *)slab + slab_header_size();
+	pool->slabs++;
+
+	return slab;
+}
+
+static void slab_release(struct slab *slab)
+{
+	slab->pool->slabs--;
+	munmap(slab, SLAB_SIZE);
+}
+
+void *slab_alloc(struct slab_pool *pool)
+{
+	struct slab *slab;
+	void *obj;
+
+	if (!pool->objs_per_slab)
+		slab_pool_init(pool);
+
+	if (cds_list_empty(&pool->partial)) {
+		slab = pool->empty;
+		pool->empty = NULL;
+		if (!slab)
+			slab = slab_new(pool);
+		cds_list_add(&slab->node, &pool->partial);
+	}
+	slab = caa_container_of(pool->partial.next, struct slab, node);
+
+	if (slab->free_list) {
+		obj = slab->free_list;
+		slab->free_list = *(void **)obj;
+		memset(obj, 0, pool->obj_size);
+	} else {
+		obj = slab->unused;
+		slab->unused += pool->obj_size;
+	}
+
+	slab->in_use++;
+	pool->in_use++;
+	if (slab->in_use == pool->objs_per_slab)
+		cds_list_move(&slab->node, &pool->full);
+
+	return obj;
+}
+
+void slab_free(void *obj)
+{
+	struct slab *slab;
+	struct slab_pool *pool;
+
+	if (!obj)
+		return;
+
+	slab = (struct slab *)((uintptr_t)obj & ~(uintptr_t)(SLAB_SIZE - 1));
+	pool = slab->pool;
+	if (slab->in_use == pool->objs_per_slab)
+		cds_list_move(&slab->node, &pool->partial);
+
+	*(void **)obj = slab->free_list;
+	slab->free_list = obj;
+	slab->in_use--;
+	pool->in_use--;
+
+	if (slab->in_use)
+		return;
+
+	/* keep the last empty slab to avoid mmap churn around zero */
+	cds_list_del(&slab->node);
+	if (pool->empty)
+		slab_release(pool->empty);
+	pool->empty = slab;
+}
+
+/* smallest blob pool fitting size, NULL if too large */
+static struct slab_pool *slab_blob_pool(size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < SLAB_BLOB_POOLS; i++) {
+		if (size <= slab_blob_pools[i].obj_size)
+			return &slab_blob_pools[i];
+	}
+	return NULL;
+}
+
+void *slab_blob_alloc(size_t size)
+{
+	struct slab_pool *pool = slab_blob_pool(size);
+
+	if (!pool)
+		return xmalloc(size);
+
+	return slab_alloc(pool);
+}
+
+void slab_blob_free(const void *blob, size_t size)
+{
+	if (slab_blob_pool(size))
+		slab_free((void *)blob);
+	else
+		free((void *)blob);
+}
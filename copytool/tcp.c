@@ -1,9 +1,32 @@
 /* SPDX-License-Identifier: LGPL-3.0-or-later */
 
 #include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include "coordinatool.h"
 
+static int listen_fd_init(int sfd, int *listen_fd)
+{
+	int rc;
+
+	rc = listen(sfd, state->config.listen_backlog);
+	if (rc < 0) {
+		rc = -errno;
+		LOG_ERROR(rc, "Could not listen");
+		close(sfd);
+		return rc;
+	}
+	*listen_fd = sfd;
+	rc = epoll_addfd(state->epoll_fd, sfd, (void *)(uintptr_t)sfd);
+	if (rc < 0) {
+		LOG_ERROR(rc, "Could not add listen socket to epoll");
+		return rc;
+	}
+	return 0;
+}
+
 int tcp_listen(void)
 {
 	struct addrinfo hints;
@@ -36,7 +59,9 @@ again:
 	}
 
 	for (rp = result; rp != NULL; rp = rp->ai_next) {
-		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		sfd = socket(rp->ai_family,
+			     rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			     rp->ai_protocol);
 		if (sfd == -1)
 			continue;
 
@@ -60,24 +85,120 @@ again:
 
 	freeaddrinfo(result);
 
-	rc = listen(sfd, 10);
-	if (rc < 0) {
+	rc = listen_fd_init(sfd, &state->listen_fd);
+	if (rc < 0)
+		return rc;
+	LOG_INFO("Listening on %s:%s", state->config.host, state->config.port);
+
+	return 0;
+}
+
+/* remove a socket left over by a previous run, same as SO_REUSEADDR: only
+ * if it is a socket nobody listens on anymore, anything else is not ours
+ * to remove */
+static int unix_remove_stale(struct sockaddr_un *addr)
+{
+	const char *path = addr->sun_path;
+	struct stat st;
+	int fd, rc;
+
+	if (lstat(path, &st) < 0) {
+		if (errno == ENOENT)
+			return 0;
 		rc = -errno;
-		LOG_ERROR(rc, "Could not listen");
-		close(sfd);
+		LOG_ERROR(rc, "Could not stat %s", path);
 		return rc;
 	}
-	state->listen_fd = sfd;
-	rc = epoll_addfd(state->epoll_fd, sfd, (void *)(uintptr_t)sfd);
+	if (!S_ISSOCK(st.st_mode)) {
+		rc = -EEXIST;
+		LOG_ERROR(rc, "%s exists and is not a socket, not removing it",
+			  path);
+		return rc;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		rc = -errno;
+		LOG_ERROR(rc, "Could not create unix socket");
+		return rc;
+	}
+	rc = connect(fd, (struct sockaddr *)addr, sizeof(*addr));
+	if (rc == 0) {
+		rc = -EADDRINUSE;
+		LOG_ERROR(rc, "%s is in use by another process", path);
+	} else if (errno != ECONNREFUSED) {
+		rc = -errno;
+		LOG_ERROR(rc, "Could not check if %s is in use", path);
+	} else if (unlink(path) < 0) {
+		rc = -errno;
+		LOG_ERROR(rc, "Could not remove stale socket %s", path);
+	} else {
+		LOG_INFO("Removed stale socket %s", path);
+		rc = 0;
+	}
+	close(fd);
+	return rc;
+}
+
+int unix_listen(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *path = state->config.listen_unix;
+	int sfd, rc;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		rc = -ENAMETOOLONG;
+		LOG_ERROR(rc, "unix socket path %s too long", path);
+		return rc;
+	}
+	strcpy(addr.sun_path, path);
+
+	sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sfd < 0) {
+		rc = -errno;
+		LOG_ERROR(rc, "Could not create unix socket");
+		return rc;
+	}
+
+	rc = unix_remove_stale(&addr);
 	if (rc < 0) {
-		LOG_ERROR(rc, "Could not add listen socket to epoll");
+		close(sfd);
 		return rc;
 	}
-	LOG_INFO("Listening on %s:%s", state->config.host, state->config.port);
+
+	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		rc = -errno;
+		LOG_ERROR(rc, "Could not bind unix socket %s", path);
+		close(sfd);
+		return rc;
+	}
+
+	rc = listen_fd_init(sfd, &state->listen_unix_fd);
+	if (rc < 0)
+		return rc;
+	LOG_INFO("Listening on unix:%s", path);
 
 	return 0;
 }
 
+/* unix sockets have no peer address, identify clients by pid */
+static char *unix_peer2str(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	char *addrstring;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		LOG_DEBUG("ERROR getting unix peer credentials: %d", errno);
+		return NULL;
+	}
+
+	if (asprintf(&addrstring, "unix:%d", cred.pid) < 0)
+		return NULL;
+
+	return addrstring;
+}
+
 char *sockaddr2str(struct sockaddr_storage *addr, socklen_t len)
 {
 	char host[NI_MAXHOST], service[NI_MAXSERV];
@@ -104,6 +225,12 @@ static void client_closefd(struct client *client)
 		state->stats.clients_connected--;
 		client->fd = -1;
 	}
+	protocol_read_buffer_free(&client->rbuf);
+	protocol_write_buffer_free(&client->wbuf);
+	protocol_write_buffer_free(&client->msgbuf);
+	client->epollout = false;
+	client->binary = false;
+	client->compress = false;
 }
 
 void client_free(struct client *client)
@@ -115,23 +242,34 @@ void client_free(struct client *client)
 			  client->fd);
 	}
 	client_closefd(client);
+	client_hash_del(client);
 	cds_list_del(&client->node_clients);
 	if (client->status == CLIENT_WAITING)
 		cds_list_del(&client->waiting_node);
+	// no new work can be matched to its batches
+	batch_slots_free(client);
 	// reassign any request that would be lost
 	hsm_action_requeue_all(&client->active_requests);
-	hsm_action_requeue_all(&client->queues.waiting_restore);
-	hsm_action_requeue_all(&client->queues.waiting_archive);
-	hsm_action_requeue_all(&client->queues.waiting_remove);
-	for (int i = 0; i < state->config.batch_slots; i++) {
-		hsm_action_requeue_all(&client->batch[i].waiting_archive);
-		free(client->batch[i].hint);
-	}
-	struct hsm_action_node *han, *nexthan;
-	cds_list_for_each_entry_safe(han, nexthan, &client->cancels, node)
+	hsm_action_queue_requeue_all(&client->queues.waiting_restore);
+	hsm_action_queue_requeue_all(&client->queues.waiting_archive);
+	hsm_action_queue_requeue_all(&client->queues.waiting_remove);
+	for (int i = 0; i < state->config.batch_slots; i++)
+		hsm_action_queue_requeue_all(&client->batch[i].waiting_archive);
+	struct hsm_action_subqueue *subqueue;
+	cds_list_for_each_entry(subqueue, &client->cancels.subqueues, node)
 	{
-		hsm_action_cancel(han);
+		struct hsm_action_node *han, *nexthan;
+
+		cds_list_for_each_entry_safe(han, nexthan, &subqueue->actions,
+					     node)
+		{
+			hsm_action_cancel(han);
+		}
 	}
+	hsm_action_queues_free(&client->queues);
+	for (int i = 0; i < state->config.batch_slots; i++)
+		hsm_action_queue_free(&client->batch[i].waiting_archive);
+	hsm_action_queue_free(&client->cancels);
 	free((void *)client->id);
 	free((void *)client->archives);
 	free(client);
@@ -168,7 +306,7 @@ void client_disconnect(struct client *client)
 	}
 }
 
-static struct client *client_alloc(void)
+struct client *client_alloc(void)
 {
 	size_t client_size =
 		sizeof(struct client) +
@@ -177,7 +315,7 @@ static struct client *client_alloc(void)
 	struct client *client = xcalloc(client_size, 1);
 
 	CDS_INIT_LIST_HEAD(&client->active_requests);
-	CDS_INIT_LIST_HEAD(&client->cancels);
+	hsm_action_queue_init(&client->cancels);
 #ifdef DEBUG_ACTION_NODE
 	CDS_INIT_LIST_HEAD(&client->node_clients);
 #endif
@@ -185,33 +323,30 @@ static struct client *client_alloc(void)
 
 	int i;
 	for (i = 0; i < state->config.batch_slots; i++) {
-		CDS_INIT_LIST_HEAD(&client->batch[i].waiting_archive);
+		hsm_action_queue_init(&client->batch[i].waiting_archive);
+		client->batch[i].client = client;
 	}
 
 	return client;
 }
 
-int handle_client_connect(void)
+static int client_accept(int fd, struct sockaddr_storage *peer_addr,
+			 socklen_t peer_addr_len)
 {
-	int fd, rc;
-	struct sockaddr_storage peer_addr;
-	socklen_t peer_addr_len = sizeof(peer_addr);
-
-	fd = accept(state->listen_fd, (struct sockaddr *)&peer_addr,
-		    &peer_addr_len);
-	if (fd < 0) {
-		rc = -errno;
-		LOG_ERROR(rc, "Could not accept connection");
-		return rc;
-	}
-
 	struct client *client = client_alloc();
+	int rc;
 
 	client->fd = fd;
-	client->id = sockaddr2str(&peer_addr, peer_addr_len);
+	if (peer_addr->ss_family == AF_UNIX)
+		client->id = unix_peer2str(fd);
+	else
+		client->id = sockaddr2str(peer_addr, peer_addr_len);
 	cds_list_add(&client->node_clients, &state->stats.clients);
 	client->status = CLIENT_INIT;
 	state->stats.clients_connected++;
+	/* only a reconnecting client's EHLO can be compressed before it
+	 * negotiates compression again */
+	client->rbuf.reject_compressed = state->config.compress_threshold == 0;
 
 	LOG_DEBUG("Clients: new connection %s (%d)", client->id, client->fd);
 
@@ -225,6 +360,171 @@ int handle_client_connect(void)
 	return rc;
 }
 
+int handle_client_connect(int listen_fd)
+{
+	struct sockaddr_storage peer_addr;
+	socklen_t peer_addr_len;
+	int fd, rc;
+
+	/* drain the backlog: after a restart all movers reconnect at once.
+	 * We read whatever is available and keep partial messages for later,
+	 * never wait on a client, so client sockets are nonblocking too */
+	while (1) {
+		peer_addr_len = sizeof(peer_addr);
+		fd = accept4(listen_fd, (struct sockaddr *)&peer_addr,
+			     &peer_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			rc = -errno;
+			if (rc == -EAGAIN || rc == -EWOULDBLOCK)
+				return 0;
+			if (rc == -EINTR || rc == -ECONNABORTED)
+				continue;
+			LOG_ERROR(rc, "Could not accept connection");
+			return rc;
+		}
+
+		/* errors only concern this client, keep going */
+		client_accept(fd, &peer_addr, peer_addr_len);
+	}
+}
+
+static void client_set_epollout(struct client *client, bool epollout)
+{
+	if (client->epollout == epollout)
+		return;
+
+	if (epoll_modfd(state->epoll_fd, client->fd,
+			epollout ? EPOLLIN | EPOLLOUT : EPOLLIN, client) < 0)
+		return;
+	client->epollout = epollout;
+}
+
+/* send as much as we can and only watch EPOLLOUT if anything is left */
+static int client_flush(struct client *client)
+{
+	int rc;
+
+	if (client->fd < 0)
+		return -ENOTCONN;
+
+	rc = protocol_write_flush(client->fd, client->id, &client->wbuf);
+	if (rc < 0)
+		return rc;
+
+	client_set_epollout(client, client->wbuf.pending != 0);
+	return 0;
+}
+
+/* messages are built aside when compressing, as each is compressed alone
+ * so the reader never has to deal with partial messages in compressed
+ * data. Otherwise they go straight to the send buffer. */
+static struct protocol_write_buffer *client_msgbuf(struct client *client)
+{
+	return client->compress ? &client->msgbuf : &client->wbuf;
+}
+
+int client_write_flush(struct client *client)
+{
+	if (client->fd < 0)
+		return -ENOTCONN;
+
+	/* message is complete */
+	if (client->compress) {
+		protocol_write_buffer_compress(
+			&client->msgbuf, state->config.compress_threshold);
+		protocol_write_buffer_splice(&client->wbuf, &client->msgbuf);
+	}
+
+	if (client_flush(client) < 0) {
+		/* we might be processing a request from this client so
+		 * cannot disconnect here: keep EPOLLOUT so main loop gets
+		 * the error */
+		client_set_epollout(client, true);
+	}
+	return 0;
+}
+
+int client_write(struct client *client, json_t *json)
+{
+	int rc;
+
+	if (client->fd < 0)
+		return -ENOTCONN;
+
+	rc = protocol_write_buffered(json, client_msgbuf(client), client->id, 0);
+	if (rc < 0)
+		return rc;
+
+	return client_write_flush(client);
+}
+
+int client_queue_raw(struct client *client, const char *buf, size_t len)
+{
+	if (client->fd < 0)
+		return -ENOTCONN;
+
+	protocol_write_buffered_raw(client_msgbuf(client), buf, len);
+	return 0;
+}
+
+int client_queue_take(struct client *client, char *buf, size_t len)
+{
+	if (client->fd < 0) {
+		free(buf);
+		return -ENOTCONN;
+	}
+
+	protocol_write_buffered_take(client_msgbuf(client), buf, len);
+	return 0;
+}
+
+/* reconnect storms: only process a few EHLO per main loop iteration so
+ * clients already connected keep being served. epoll is level triggered,
+ * deferred clients are just reported again on next iteration */
+static bool client_admission_deferred(struct client *client, uint32_t events)
+{
+	if (client->status != CLIENT_INIT || !state->config.ehlo_per_iteration)
+		return false;
+	if (events & (EPOLLERR | EPOLLHUP))
+		return false;
+	return state->ehlo_budget <= 0;
+}
+
+void handle_client_event(struct client *client, uint32_t events)
+{
+	int rc;
+
+	if (client_admission_deferred(client, events))
+		return;
+
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		rc = protocol_read_buffered(client->fd, client->id,
+					    &client->rbuf, client, protocol_cbs,
+					    protocol_bin_cbs, NULL);
+		if (rc < 0) {
+			client_disconnect(client);
+			return;
+		}
+		/* positive return means client is no longer valid
+		 * (termination) */
+		if (rc > 0)
+			return;
+	}
+
+	if ((events & EPOLLOUT) && client->fd >= 0) {
+		bool throttled = client_send_throttled(client);
+
+		if (client_flush(client) < 0) {
+			client_disconnect(client);
+			return;
+		}
+		/* client was skipped while it had too much to read */
+		if (throttled && !client_send_throttled(client) &&
+		    client->status == CLIENT_WAITING)
+			ct_schedule_client(client);
+	}
+}
+
 struct client *client_new_disconnected(const char *id)
 {
 	/* create client in disconnected state for recovery */
@@ -234,6 +534,7 @@ struct client *client_new_disconnected(const char *id)
 	client->id = xstrdup(id);
 	cds_list_add(&client->node_clients, &state->stats.disconnected_clients);
 	client->status = CLIENT_DISCONNECTED;
+	client_hash_add(client);
 	client->disconnected_timestamp = gettime_ns();
 	timer_rearm();
 
@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Tenants for fair share scheduling.
+ *
+ * With fair_share_hint set, a request belongs to the tenant named by that
+ * hint's value in its hsm data (requests without it share the "" tenant)
+ * and waiting queues are also split by tenant. The scheduler then serves
+ * the subqueues of a queue in deficit round robin, each tenant getting as
+ * many requests per round as its weight, instead of oldest first: one
+ * user queueing a million archives no longer delays everybody else's.
+ * Tenants are indexed by interned name pointer and go away with the last
+ * action or subqueue referencing them, so hint values used once (job ids
+ * and the like) do not pile up.
+ */
+
+#include "coordinatool.h"
+
+static struct tenant *tenant_find(const char *name)
+{
+	struct chain_hash_node *node;
+
+	chain_hash_for_each(node, &state->tenants_by_name, intern_hash(name))
+	{
+		struct tenant *tenant =
+			caa_container_of(node, struct tenant, hash_node);
+
+		if (tenant->name == name)
+			return tenant;
+	}
+	return NULL;
+}
+
+static unsigned int tenant_weight(const char *name)
+{
+	struct fair_share_weight *weight;
+
+	cds_list_for_each_entry(weight, &state->config.fair_share_weights,
+				node)
+	{
+		if (!strcmp(weight->tenant, name))
+			return weight->weight;
+	}
+	return 1;
+}
+
+struct tenant *tenant_get(struct hsm_action_node *han)
+{
+	struct tenant *tenant;
+	const char *hint, *name;
+	size_t len;
+
+	if (!state->config.fair_share_hint)
+		return NULL;
+
+	hint = parse_hint(han, state->config.fair_share_hint, &len);
+	if (!hint)
+		len = 0;
+	name = intern_dup(hint ?: "", len);
+
+	tenant = tenant_find(name);
+	if (tenant) {
+		intern_put(name);
+		return tenant_ref(tenant);
+	}
+
+	tenant = xcalloc(1, sizeof(*tenant));
+	tenant->name = name;
+	tenant->weight = tenant_weight(name);
+	tenant->refcount = 1;
+	cds_list_add_tail(&tenant->node, &state->tenants);
+	chain_hash_add(&state->tenants_by_name, &tenant->hash_node,
+		       intern_hash(name));
+	LOG_INFO("New tenant '%s' with weight %u", name, tenant->weight);
+	return tenant;
+}
+
+struct tenant *tenant_ref(struct tenant *tenant)
+{
+	if (tenant)
+		tenant->refcount++;
+	return tenant;
+}
+
+void tenant_put(struct tenant *tenant)
+{
+	if (!tenant || --tenant->refcount)
+		return;
+
+	LOG_DEBUG("Tenant '%s' done, served %lu", tenant->name,
+		  tenant->served);
+	chain_hash_del(&state->tenants_by_name, &tenant->hash_node);
+	cds_list_del(&tenant->node);
+	intern_put(tenant->name);
+	free(tenant);
+}
+
+void tenants_destroy(void)
+{
+	struct tenant *tenant, *next;
+
+	cds_list_for_each_entry_safe(tenant, next, &state->tenants, node)
+	{
+		intern_put(tenant->name);
+		free(tenant);
+	}
+	CDS_INIT_LIST_HEAD(&state->tenants);
+	chain_hash_destroy(&state->tenants_by_name);
+}
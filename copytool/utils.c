@@ -49,6 +49,103 @@ size_t dbj2(const char *buf, size_t size)
 	return hash;
 }
 
+uint64_t hash_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+#define CHAIN_HASH_MIN_SIZE 64
+
+static void chain_hash_grow(struct chain_hash *table)
+{
+	struct chain_hash_node **old = table->buckets;
+	size_t old_size = table->size, i;
+
+	if (table->count < table->size)
+		return;
+
+	table->size = old_size ? old_size * 2 : CHAIN_HASH_MIN_SIZE;
+	table->buckets = xcalloc(table->size, sizeof(*table->buckets));
+	for (i = 0; i < old_size; i++) {
+		struct chain_hash_node *node = old[i], *next;
+
+		for (; node; node = next) {
+			size_t b = node->hash & (table->size - 1);
+
+			next = node->next;
+			node->next = table->buckets[b];
+			table->buckets[b] = node;
+		}
+	}
+	free(old);
+}
+
+void chain_hash_add(struct chain_hash *table, struct chain_hash_node *node,
+		    size_t hash)
+{
+	size_t b;
+
+	chain_hash_grow(table);
+	b = hash & (table->size - 1);
+	node->hash = hash;
+	node->next = table->buckets[b];
+	table->buckets[b] = node;
+	table->count++;
+}
+
+void chain_hash_del(struct chain_hash *table, struct chain_hash_node *node)
+{
+	struct chain_hash_node **p;
+
+	if (!table->size)
+		return;
+
+	for (p = &table->buckets[node->hash & (table->size - 1)]; *p;
+	     p = &(*p)->next) {
+		if (*p == node) {
+			*p = node->next;
+			node->next = NULL;
+			table->count--;
+			return;
+		}
+	}
+}
+
+struct chain_hash_node *chain_hash_first(struct chain_hash *table,
+					 size_t hash)
+{
+	struct chain_hash_node *node;
+
+	if (!table->size)
+		return NULL;
+
+	node = table->buckets[hash & (table->size - 1)];
+	if (node && node->hash != hash)
+		return chain_hash_next(node, hash);
+	return node;
+}
+
+struct chain_hash_node *chain_hash_next(struct chain_hash_node *node,
+					size_t hash)
+{
+	for (node = node->next; node; node = node->next) {
+		if (node->hash == hash)
+			return node;
+	}
+	return NULL;
+}
+
+void chain_hash_destroy(struct chain_hash *table)
+{
+	free(table->buckets);
+	memset(table, 0, sizeof(*table));
+}
+
 char *replace_string(const char *orig, size_t orig_len, const char *new_value,
 		     size_t new_len, const char *old_value, size_t old_len)
 {
@@ -95,6 +95,8 @@ int llapi_hsm_copytool_register(struct hsm_copytool_private **priv,
 		goto err_out;
 	}
 
+	/* we handle binary recv replies in copytool_bin_cbs */
+	ct->state.binary_capable = true;
 	rc = tcp_connect(&ct->state, NULL);
 	if (rc) {
 		LOG_ERROR(rc, "Could not connect to server");
@@ -134,19 +136,32 @@ int llapi_hsm_copytool_unregister(struct hsm_copytool_private **priv)
 	return 0;
 }
 
+/* max number of dones acknowledged in a single request */
+#define DONE_BATCH_MAX 256
+
 static int process_dones(struct hsm_copytool_private *ct)
 {
 	int rc = 0, rc_proto = 0;
-	struct notify_done done;
-
-	while ((rc = read(ct->notify_done_fd[0], &done, sizeof(done))) ==
-	       sizeof(done)) {
-		action_delete(ct, &done.key);
+	struct notify_done dones[DONE_BATCH_MAX];
+	struct protocol_done_item items[DONE_BATCH_MAX];
+	size_t count, i;
+
+	/* writes to the pipe are atomic and we read multiples of
+	 * struct size, so we never get partial items */
+	while ((rc = read(ct->notify_done_fd[0], dones, sizeof(dones))) > 0) {
+		if (rc % sizeof(dones[0])) // short reads are not normally possible
+			return -EIO;
+		count = rc / sizeof(dones[0]);
+		for (i = 0; i < count; i++) {
+			action_delete(ct, &dones[i].key);
+			items[i].cookie = dones[i].key.cookie;
+			items[i].dfid = dones[i].key.dfid;
+			items[i].status = dones[i].rc;
+		}
 		// XXX remember cookie in another list, free from that list when done_cb kicks in
 		// (repeat cookie in done reply for convenience)
 		// and send that list in ehlo too.
-		rc_proto = protocol_request_done(&ct->state, done.key.cookie,
-						 &done.key.dfid, done.rc);
+		rc_proto = protocol_request_done_list(&ct->state, items, count);
 		if (rc_proto < 0) {
 			LOG_WARN(
 				rc_proto,
@@ -156,8 +171,6 @@ static int process_dones(struct hsm_copytool_private *ct)
 	}
 	if (rc < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
 		return rc_proto;
-	if (rc > 0) // short reads are not normally possible
-		return -EIO;
 	if (rc < 0) {
 		rc = -errno;
 		LOG_ERROR(rc, "Read error reading from notify done pipe?");
@@ -226,7 +239,7 @@ again:
 		}
 
 		rc = protocol_read_command(ct->state.socket_fd, "server", NULL,
-					   copytool_cbs, ct);
+					   copytool_cbs, copytool_bin_cbs, ct);
 		if (rc) {
 			LOG_WARN(rc, "read from server failed. Reconnecting.");
 			goto reconnect;
@@ -70,6 +70,7 @@ struct notify_done {
 
 /* protocol.c */
 extern protocol_read_cb copytool_cbs[];
+extern protocol_read_bin_cb copytool_bin_cbs[];
 
 /* tree.c */
 void action_insert(struct hsm_copytool_private *ct,
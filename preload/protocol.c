@@ -42,6 +42,44 @@ static int recv_cb(void *fd_arg UNUSED, json_t *json, void *arg)
 	return 0;
 }
 
+static int action_list_bin_get_cb(struct hsm_action_list *hal,
+				  struct hsm_action_item *hai, size_t data_len,
+				  void *arg)
+{
+	struct hsm_copytool_private *priv = arg;
+	struct action_tree_node *node = xmalloc(sizeof(*node));
+	__u32 hai_len = hai->hai_len;
+
+	node->key.cookie = hai->hai_cookie;
+	node->key.dfid = hai->hai_dfid;
+	/* remember the item as json to send back in ehlo on reconnect,
+	 * without padding */
+	hai->hai_len = sizeof(*hai) + data_len;
+	node->hai = json_hsm_action_item(hai, hal->hal_archive_id,
+					 hal->hal_flags);
+	hai->hai_len = hai_len;
+	if (!node->hai)
+		abort();
+
+	action_insert(priv, node);
+	return 0;
+}
+
+static int recv_bin_cb(void *fd_arg UNUSED, const char *payload, size_t len,
+		       void *arg)
+{
+	struct hsm_copytool_private *priv = arg;
+	int rc;
+
+	rc = protocol_bin_hal_get(payload, len, priv->hal,
+				  priv->state.config.hsm_action_list_size,
+				  action_list_bin_get_cb, priv);
+	if (rc < 0)
+		return rc;
+	priv->msgsize = rc;
+	return 0;
+}
+
 static int done_cb(void *fd_arg UNUSED, json_t *json, void *arg UNUSED)
 {
 	return protocol_checkerror(json);
@@ -51,3 +89,7 @@ protocol_read_cb copytool_cbs[PROTOCOL_COMMANDS_MAX] = {
 	[RECV] = recv_cb,
 	[DONE] = done_cb,
 };
+
+protocol_read_bin_cb copytool_bin_cbs[PROTOCOL_COMMANDS_MAX] = {
+	[RECV] = recv_bin_cb,
+};
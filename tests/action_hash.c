@@ -0,0 +1,164 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Check the action hash, and time insert/lookup/remove against the tsearch
+ * tree it replaced.
+ * usage: action_hash [count...] (default 1M)
+ * Peak memory is about 130 bytes per action, e.g. 7GB for 50M. */
+
+#include <assert.h>
+#include <limits.h>
+#include <search.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "coordinatool.h"
+
+static int tree_compare(const void *a, const void *b)
+{
+	const struct item_info *va = a, *vb = b;
+
+	if (va->cookie < vb->cookie)
+		return -1;
+	if (va->cookie > vb->cookie)
+		return 1;
+	return memcmp(&va->dfid, &vb->dfid, sizeof(va->dfid));
+}
+
+static void tree_free_noop(void *nodep UNUSED)
+{
+}
+
+static void report(const char *what, const char *op, size_t count,
+		   struct timespec *start)
+{
+	struct timespec end;
+	int64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (end.tv_sec - start->tv_sec) * 1000000000L + end.tv_nsec -
+	     start->tv_nsec;
+	printf("%10zu %s %-6s %6.1f ns/op\n", count, what, op,
+	       (double)ns / count);
+}
+
+static void fill_items(struct item_info *items, size_t count)
+{
+	/* cookies are sequential per mdt, fids mostly so */
+	for (size_t i = 0; i < count; i++) {
+		items[i].cookie = 0x5f00000000L + i;
+		items[i].dfid.f_seq = 0x200000401L + i / 100000;
+		items[i].dfid.f_oid = i % 100000 + 1;
+		items[i].dfid.f_ver = 0;
+	}
+}
+
+static void bench_hash(struct item_info *items, size_t count)
+{
+	struct hsm_action_hash hash = { 0 };
+	struct item_info dup = items[0], *found;
+	struct timespec start;
+	bool removed;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		found = hsm_action_hash_insert(&hash, &items[i]);
+		assert(found == &items[i]);
+	}
+	report("hash", "insert", count, &start);
+	assert(hsm_action_hash_count(&hash) == count);
+
+	/* duplicates return existing entry */
+	found = hsm_action_hash_insert(&hash, &dup);
+	assert(found == &items[0]);
+	assert(hsm_action_hash_find(&hash, 0, &dup.dfid) == NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		found = hsm_action_hash_find(&hash, items[i].cookie,
+					     &items[i].dfid);
+		assert(found == &items[i]);
+	}
+	report("hash", "lookup", count, &start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i += 2) {
+		removed = hsm_action_hash_remove(&hash, items[i].cookie,
+						 &items[i].dfid);
+		assert(removed);
+	}
+	report("hash", "remove", (count + 1) / 2, &start);
+	assert(hsm_action_hash_count(&hash) == count / 2);
+	removed = hsm_action_hash_remove(&hash, items[0].cookie,
+					 &items[0].dfid);
+	assert(!removed);
+
+	/* reinsert over tombstones */
+	for (i = 0; i < count; i += 2) {
+		found = hsm_action_hash_insert(&hash, &items[i]);
+		assert(found == &items[i]);
+	}
+	for (i = 0; i < count; i++) {
+		found = hsm_action_hash_find(&hash, items[i].cookie,
+					     &items[i].dfid);
+		assert(found == &items[i]);
+	}
+	assert(hsm_action_hash_count(&hash) == count);
+
+	hsm_action_hash_destroy(&hash, NULL);
+}
+
+static void bench_tree(struct item_info *items, size_t count)
+{
+	struct timespec start;
+	void *tree = NULL;
+	void **node;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		node = tsearch(&items[i], &tree, tree_compare);
+		assert(*node == &items[i]);
+	}
+	report("tree", "insert", count, &start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		node = tfind(&items[i], &tree, tree_compare);
+		assert(*node == &items[i]);
+	}
+	report("tree", "lookup", count, &start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i += 2) {
+		node = tdelete(&items[i], &tree, tree_compare);
+		assert(node);
+	}
+	report("tree", "remove", (count + 1) / 2, &start);
+
+	tdestroy(tree, tree_free_noop);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t count = 1000000;
+	int i = 1;
+
+	do {
+		if (argc > 1) {
+			long val = parse_int(argv[i], LONG_MAX, "count");
+
+			assert(val > 0);
+			count = val;
+		}
+
+		struct item_info *items = xcalloc(count, sizeof(*items));
+
+		fill_items(items, count);
+		bench_hash(items, count);
+		bench_tree(items, count);
+		free(items);
+	} while (++i < argc);
+
+	return 0;
+}
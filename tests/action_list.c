@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Check waiting lists stay in (timestamp, arrival) order through requeues
+ * and splices, that ranks match list positions, and time requeueing old
+ * requests into a deep list.
+ * usage: action_list [count...] (default 1M) */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "coordinatool.h"
+
+static void report(const char *op, size_t count, struct timespec *start)
+{
+	struct timespec end;
+	int64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (end.tv_sec - start->tv_sec) * 1000000000L + end.tv_nsec -
+	     start->tv_nsec;
+	printf("%10zu list %-7s %6.1f ns/op\n", count, op, (double)ns / count);
+}
+
+/* check in-order walk of the tree matches the list, and subtree sizes */
+static size_t check_tree(struct hsm_action_node *han,
+			 struct cds_list_head **expected)
+{
+	size_t count = 0;
+
+	if (!han)
+		return 0;
+
+	for (int dir = 0; dir < 2; dir++) {
+		if (han->order.child[dir])
+			assert(han->order.child[dir]->order.parent == han);
+	}
+	count += check_tree(han->order.child[0], expected);
+	assert(*expected == &han->node);
+	*expected = (*expected)->next;
+	count += check_tree(han->order.child[1], expected);
+	assert(han->order.size == count + 1);
+
+	return count + 1;
+}
+
+static void check_list(struct cds_list_head *list, size_t count)
+{
+	struct hsm_action_node *han, *prev = NULL;
+	struct cds_list_head *expected = list->next;
+	size_t seen = 0, walked;
+
+	cds_list_for_each_entry(han, list, node)
+	{
+		assert(hsm_action_list_rank(han) == seen);
+		if (prev)
+			assert(prev->info.timestamp < han->info.timestamp ||
+			       (prev->info.timestamp == han->info.timestamp &&
+				prev->seq < han->seq));
+		prev = han;
+		seen++;
+	}
+	assert(seen == count);
+	if (!count)
+		return;
+
+	han = caa_container_of(list->prev, struct hsm_action_node, node);
+	while (han->order.parent)
+		han = han->order.parent;
+	walked = check_tree(han, &expected);
+	assert(walked == count);
+	assert(expected == list);
+}
+
+static void run(size_t count)
+{
+	struct hsm_action_node *hans = xcalloc(count, sizeof(*hans));
+	struct cds_list_head list, other;
+	struct timespec start;
+	size_t i;
+
+	CDS_INIT_LIST_HEAD(&list);
+	CDS_INIT_LIST_HEAD(&other);
+
+	/* mostly increasing timestamps with ties and stragglers, as seen
+	 * when several mdts or a redis recovery feed the queue */
+	for (i = 0; i < count; i++) {
+		hans[i].info.timestamp = i / 4;
+		if (i % 7 == 0)
+			hans[i].info.timestamp /= 2;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++)
+		hsm_action_list_add(&list, &hans[i]);
+	report("insert", count, &start);
+	check_list(&list, count);
+
+	/* ties keep arrival order */
+	for (i = 1; i < count; i++) {
+		if (hans[i].info.timestamp == hans[i - 1].info.timestamp)
+			assert(hans[i - 1].node.next == &hans[i].node);
+	}
+
+	/* requeue the oldest request behind everything: it must come back
+	 * to the head, as retried requests do */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		struct hsm_action_node *han = caa_container_of(
+			list.next, struct hsm_action_node, node);
+
+		hsm_action_list_del(han);
+		hsm_action_list_add(&list, han);
+		assert(list.next == &han->node);
+	}
+	report("requeue", count, &start);
+
+	/* move every other request away and merge them back */
+	for (i = 0; i < count; i += 2) {
+		hsm_action_list_del(&hans[i]);
+		hsm_action_list_add(&other, &hans[i]);
+	}
+	check_list(&list, count / 2);
+	check_list(&other, (count + 1) / 2);
+	/* position once merged, as computed for progress reports */
+	size_t probe = (count / 2) & ~1UL;
+	size_t merged_rank = hsm_action_list_rank(&hans[probe]) +
+			     hsm_action_list_count_older(&list, &hans[probe]);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	hsm_action_list_splice(&other, &list);
+	report("splice", (count + 1) / 2, &start);
+	assert(cds_list_empty(&other));
+	check_list(&list, count);
+	assert(hsm_action_list_rank(&hans[probe]) == merged_rank);
+
+	/* requests old enough for a priority class, as computed for
+	 * positions with aging */
+	size_t until = 0;
+	for (i = 0; i < count; i++)
+		if (hans[i].info.timestamp <= hans[probe].info.timestamp)
+			until++;
+	assert(hsm_action_list_count_until(&list,
+					   hans[probe].info.timestamp) == until);
+	assert(hsm_action_list_count_until(&list, -1) == 0);
+
+	/* splice into empty list moves the tree along */
+	hsm_action_list_splice(&list, &other);
+	assert(cds_list_empty(&list));
+	check_list(&other, count);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i += 2)
+		hsm_action_list_del(&hans[i]);
+	for (i = 1; i < count; i += 2)
+		hsm_action_list_del(&hans[i]);
+	report("delete", count, &start);
+	assert(cds_list_empty(&other));
+
+	free(hans);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t count = 1000000;
+	int i = 1;
+
+	do {
+		if (argc > 1) {
+			long val = parse_int(argv[i], LONG_MAX, "count");
+
+			assert(val > 0);
+			count = val;
+		}
+		run(count);
+	} while (++i < argc);
+
+	return 0;
+}
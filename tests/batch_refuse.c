@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Requests a mover's batch slot refuses: the oldest request of a slot's
+ * queue is for another batch, and finding it a slot takes this expired one
+ * over. That must only happen once the pass is done with the slot's queue,
+ * so the mover still gets the rest and the refused request then gets the
+ * slot. */
+
+#include <assert.h>
+
+#include "daemon_helper.h"
+
+#define COUNT 10
+
+static struct hsm_action_node *new_archive(const char *data)
+{
+	struct hsm_action_node *han = test_action_new(HSMA_ARCHIVE, 1, data,
+						      0, 0);
+
+	assert(han);
+	return han;
+}
+
+int main(void)
+{
+	struct hsm_action_node *other, *han[COUNT];
+	struct hsm_action_queue *slot;
+	struct client *client;
+	int i, rc;
+
+	test_state_init();
+	/* slots expire as soon as they are taken */
+	state->config.batch_slots = 1;
+	state->config.batch_slice_idle = 1;
+	state->config.batch_slice_max = 1;
+
+	/* no mover yet: all wait in the global queue */
+	other = new_archive("other");
+	for (i = 0; i < COUNT; i++)
+		han[i] = new_archive("batch");
+
+	client = test_client_new("mover");
+
+	/* slot for "batch", with the older "other" request stuck in it */
+	slot = schedule_batch_slot_on_client(client, han[0]);
+	assert(slot == &client->batch[0].waiting_archive);
+	for (i = 0; i < COUNT; i++) {
+		rc = hsm_action_requeue(han[i], slot);
+		assert(rc == 1);
+	}
+	rc = hsm_action_requeue(other, slot);
+	assert(rc == 1);
+
+	test_client_recv(client);
+
+	assert(client->current_archive == COUNT);
+	for (i = 0; i < COUNT; i++)
+		assert(han[i]->client == client);
+	assert(!strcmp(client->batch[0].hint, "other"));
+	assert(other->subqueue && other->subqueue->queue == slot);
+	assert(state->stats.pending_archive == 1);
+
+	test_state_free();
+	return 0;
+}
@@ -0,0 +1,187 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* archive_on_hosts_ch host picks: count how many tag values move when a
+ * host is removed or added, or its weight raised. Only values won or lost
+ * by that host may move, which is about 1/hosts of them, where the old
+ * hash % count moved almost all of them (printed for comparison).
+ * Also parses host[:weight] lists from a config file. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "daemon_helper.h"
+
+#define HOSTS 10
+#define KEYS 100000
+
+static struct host_mapping *new_mapping(int count)
+{
+	struct host_mapping *mapping = xcalloc(
+		1, sizeof(*mapping) + (HOSTS + 1) * sizeof(mapping->hosts[0]));
+	char name[16];
+	int i;
+
+	mapping->consistent_hash = true;
+	mapping->count = count;
+	for (i = 0; i < HOSTS + 1; i++) {
+		snprintf(name, sizeof(name), "mover%d", i);
+		mapping->hosts[i].name = xstrdup(name);
+		mapping->hosts[i].weight = 1;
+		mapping->hosts[i].hash = dbj2(name, strlen(name));
+	}
+	return mapping;
+}
+
+static void free_mapping(struct host_mapping *mapping)
+{
+	int i;
+
+	for (i = 0; i < HOSTS + 1; i++)
+		free((void *)mapping->hosts[i].name);
+	free(mapping);
+}
+
+static int pick(struct host_mapping *mapping, int key)
+{
+	char value[16];
+	int len = snprintf(value, sizeof(value), "tape%d", key);
+
+	return host_mapping_pick(mapping, value, len);
+}
+
+/* fraction of keys whose host changed from before with hash % count */
+static double modulo_moved(int before, int after)
+{
+	char value[16];
+	int key, len, moved = 0;
+
+	for (key = 0; key < KEYS; key++) {
+		len = snprintf(value, sizeof(value), "tape%d", key);
+		if (dbj2(value, len) % before != dbj2(value, len) % after)
+			moved++;
+	}
+	return (double)moved / KEYS;
+}
+
+/* config_init() on a file with hosts, into state->config */
+static int parse_hosts(const char *hosts)
+{
+	char path[] = "/tmp/consistent_hash.XXXXXX";
+	FILE *conf;
+	int fd, rc;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	conf = fdopen(fd, "w");
+	assert(conf);
+	fprintf(conf, "archive_on_hosts_ch tag= 0 %s\n", hosts);
+	fclose(conf);
+
+	state->config.confpath = xstrdup(path);
+	rc = config_init(&state->config);
+	unlink(path);
+	return rc;
+}
+
+static void check_host(struct host_mapping *mapping, int i, const char *name,
+		       unsigned int weight)
+{
+	assert(!strcmp(mapping->hosts[i].name, name));
+	assert(mapping->hosts[i].weight == weight);
+	assert(mapping->hosts[i].hash == dbj2(name, strlen(name)));
+}
+
+/* only a trailing ':' and digits is a weight, other colons are part of
+ * the name */
+static void test_config_hosts(void)
+{
+	struct host_mapping *mapping;
+	int rc;
+
+	test_state_init();
+	rc = parse_hosts("mover0 mover1:3 unix:1234:1 mover:x fe80::a:2");
+	assert(rc == 0);
+	mapping = caa_container_of(state->config.archive_mappings.next,
+				   struct host_mapping, node);
+	assert(mapping->consistent_hash && mapping->count == 5);
+	check_host(mapping, 0, "mover0", 1);
+	check_host(mapping, 1, "mover1", 3);
+	check_host(mapping, 2, "unix:1234", 1);
+	check_host(mapping, 3, "mover:x", 1);
+	check_host(mapping, 4, "fe80::a", 2);
+	test_state_free();
+
+	/* a pid is no weight, the mapping is refused rather than guessed */
+	test_state_init();
+	assert(parse_hosts("mover0 unix:1234") < 0);
+	test_state_free();
+	test_state_init();
+	assert(parse_hosts("mover0:0") < 0);
+	test_state_free();
+}
+
+int main(void)
+{
+	static int before[KEYS];
+	struct host_mapping *mapping = new_mapping(HOSTS);
+	int key, host, moved, on_host;
+
+	for (key = 0; key < KEYS; key++)
+		before[key] = pick(mapping, key);
+
+	/* remove the last host: only its keys move */
+	mapping->count = HOSTS - 1;
+	moved = on_host = 0;
+	for (key = 0; key < KEYS; key++) {
+		host = pick(mapping, key);
+		if (before[key] == HOSTS - 1)
+			on_host++;
+		else
+			assert(host == before[key]);
+		if (host != before[key])
+			moved++;
+	}
+	assert(moved == on_host);
+	printf("remove 1 of %d hosts: %.1f%% moved (modulo: %.1f%%)\n", HOSTS,
+	       100.0 * moved / KEYS, 100 * modulo_moved(HOSTS, HOSTS - 1));
+	assert(moved > KEYS / HOSTS * 9 / 10 && moved < KEYS / HOSTS * 11 / 10);
+
+	/* add a host: keys only move to it */
+	mapping->count = HOSTS + 1;
+	moved = 0;
+	for (key = 0; key < KEYS; key++) {
+		host = pick(mapping, key);
+		if (host != before[key]) {
+			assert(host == HOSTS);
+			moved++;
+		}
+	}
+	printf("add 1 to %d hosts: %.1f%% moved (modulo: %.1f%%)\n", HOSTS,
+	       100.0 * moved / KEYS, 100 * modulo_moved(HOSTS, HOSTS + 1));
+	assert(moved > KEYS / (HOSTS + 1) * 9 / 10 &&
+	       moved < KEYS / (HOSTS + 1) * 11 / 10);
+
+	/* weight 3 for the first host: a quarter of keys, all from others */
+	mapping->count = HOSTS;
+	mapping->hosts[0].weight = 3;
+	moved = on_host = 0;
+	for (key = 0; key < KEYS; key++) {
+		host = pick(mapping, key);
+		if (host == 0)
+			on_host++;
+		if (host != before[key]) {
+			assert(host == 0);
+			moved++;
+		}
+	}
+	printf("weight 3 for 1 of %d hosts: %.1f%% of keys, %.1f%% moved\n",
+	       HOSTS, 100.0 * on_host / KEYS, 100.0 * moved / KEYS);
+	assert(on_host > KEYS / 4 * 9 / 10 && on_host < KEYS / 4 * 11 / 10);
+
+	free_mapping(mapping);
+
+	test_config_hosts();
+	return 0;
+}
@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "daemon_helper.h"
+
+struct state *state;
+
+static struct state test_state;
+static uint64_t cookie;
+
+/* coordinatool.c is not linked in, no event loop here */
+int epoll_addfd(int epoll_fd UNUSED, int fd UNUSED, void *data UNUSED)
+{
+	return 0;
+}
+
+int epoll_delfd(int epoll_fd UNUSED, int fd UNUSED)
+{
+	return 0;
+}
+
+int epoll_modfd(int epoll_fd UNUSED, int fd UNUSED, uint32_t events UNUSED,
+		void *data UNUSED)
+{
+	return 0;
+}
+
+void initiate_termination(void)
+{
+}
+
+void test_state_init(void)
+{
+	memset(&test_state, 0, sizeof(test_state));
+	state = &test_state;
+	state->listen_fd = -1;
+	state->listen_unix_fd = -1;
+	state->timer_fd = -1;
+	state->reporting_dir_fd = -1;
+	state->fsname = "test";
+	state->config.client_send_hwm = SIZE_MAX;
+	CDS_INIT_LIST_HEAD(&state->config.archive_mappings);
+	CDS_INIT_LIST_HEAD(&state->config.fair_share_weights);
+	CDS_INIT_LIST_HEAD(&state->config.priority_rules);
+	CDS_INIT_LIST_HEAD(&state->stats.clients);
+	CDS_INIT_LIST_HEAD(&state->stats.disconnected_clients);
+	CDS_INIT_LIST_HEAD(&state->waiting_clients);
+	CDS_INIT_LIST_HEAD(&state->reporting_cleanup_list);
+	CDS_INIT_LIST_HEAD(&state->reporting_actions);
+	CDS_INIT_LIST_HEAD(&state->tenants);
+	hsm_action_queues_init(&state->queues);
+}
+
+void test_state_free(void)
+{
+	struct client *client, *next;
+
+	cds_list_for_each_entry_safe(client, next, &state->stats.clients,
+				     node_clients)
+	{
+		test_client_done(client);
+		/* requests still waiting on its side go back to state */
+		client_free(client);
+	}
+	hsm_action_free_all();
+	hsm_action_queues_free(&state->queues);
+	hsm_action_subqueue_hash_destroy();
+	batch_hints_destroy();
+	client_hash_destroy();
+	tenants_destroy();
+	intern_destroy();
+	config_free(&state->config);
+}
+
+struct hsm_action_node *test_action_new(enum hsm_copytool_action action,
+					uint32_t archive_id, const char *data,
+					uint64_t size, int64_t timestamp)
+{
+	char buf[sizeof(struct hsm_action_item) + 64];
+	struct hsm_action_item *hai = (void *)buf;
+	int len, rc;
+
+	memset(hai, 0, sizeof(*hai));
+	hai->hai_action = action;
+	hai->hai_cookie = ++cookie;
+	hai->hai_dfid.f_seq = 0x200000401;
+	hai->hai_dfid.f_oid = cookie;
+	hai->hai_fid = hai->hai_dfid;
+	hai->hai_extent.length = size;
+	len = snprintf(hai->hai_data, 64, "%s", data ?: "");
+	assert(len < 64);
+	hai->hai_len = sizeof(*hai) + len;
+
+	rc = hsm_action_new_lustre(hai, archive_id, 0,
+				   timestamp ?: (int64_t)cookie);
+	if (rc != 1)
+		return NULL;
+	return hsm_action_search(hai->hai_cookie, &hai->hai_dfid);
+}
+
+struct client *test_client_new(const char *id)
+{
+	struct client *client = client_alloc();
+
+	client->id = xstrdup(id);
+	client->fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	assert(client->fd >= 0);
+	client->binary = true;
+	client->max_bytes = 1024 * 1024;
+	client->max_restore = -1;
+	client->max_archive = -1;
+	client->max_remove = -1;
+	client->status = CLIENT_READY;
+	cds_list_add(&client->node_clients, &state->stats.clients);
+	state->stats.clients_connected++;
+	return client;
+}
+
+void test_client_wait(struct client *client)
+{
+	client->status = CLIENT_WAITING;
+	cds_list_add_tail(&client->waiting_node, &state->waiting_clients);
+}
+
+void test_client_recv(struct client *client)
+{
+	test_client_wait(client);
+	ct_schedule_client(client);
+	assert(client->status == CLIENT_READY);
+}
+
+void test_client_done(struct client *client)
+{
+	struct hsm_action_node *han, *next;
+
+	cds_list_for_each_entry_safe(han, next, &client->active_requests, node)
+		hsm_action_free(han);
+	client->current_restore = 0;
+	client->current_archive = 0;
+	client->current_remove = 0;
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Fixtures for tests linking the daemon without its main loop
+ * (coordinatool.c): state, movers and requests. */
+
+#ifndef COORDINATOOL_TESTS_DAEMON_HELPER_H
+#define COORDINATOOL_TESTS_DAEMON_HELPER_H
+
+#include "coordinatool.h"
+
+// state with empty queues, no client and no configured feature, set
+// config after this and before queuing anything
+void test_state_init(void);
+// free clients left, all requests and everything state holds
+void test_state_free(void);
+
+// queue a new request, timestamp 0 for arrival order.
+// hai_data is data, hai_extent.length size
+struct hsm_action_node *test_action_new(enum hsm_copytool_action action,
+					uint32_t archive_id, const char *data,
+					uint64_t size, int64_t timestamp);
+
+// connected binary mover taking anything, with config batch_slots
+struct client *test_client_new(const char *id);
+// mover asks for work, to be sent by the next ct_schedule()
+void test_client_wait(struct client *client);
+// mover asks for work and gets what ct_schedule_client() picks
+void test_client_recv(struct client *client);
+// mover is done with everything it was sent
+void test_client_done(struct client *client);
+
+#endif
@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Time ct_schedule_client() against waiting queue depth: a mover keeps
+ * asking for work while the global queue is refilled to the same depth,
+ * with archive ids it serves or not mixed in. Completed requests are
+ * replaced by new ones with the same archive id, so work the mover does
+ * not serve stays at the head of the queue.
+ * usage: dispatch_bench [depth...] (default 1M) */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "daemon_helper.h"
+
+#define ARCHIVE_IDS 4
+#define RECV_MAX_BYTES (64 * 1024)
+#define RECVS 1000
+
+static void new_archive(uint32_t archive_id)
+{
+	struct hsm_action_node *han;
+	char data[16];
+
+	snprintf(data, sizeof(data), "tag=%u", archive_id);
+	han = test_action_new(HSMA_ARCHIVE, archive_id, data, 0, 0);
+	assert(han);
+}
+
+static void run(size_t depth, int *archives, const char *what)
+{
+	struct client *client = test_client_new("bench");
+	struct hsm_action_node *han, *next;
+	struct timespec start, end;
+	size_t i, sent = 0;
+	int64_t ns = 0;
+	int recv;
+
+	client->max_bytes = RECV_MAX_BYTES;
+	client->archives = archives;
+	for (i = 0; i < depth; i++)
+		new_archive(1 + i % ARCHIVE_IDS);
+
+	for (recv = 0; recv < RECVS; recv++) {
+		test_client_wait(client);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ct_schedule_client(client);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ns += (end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec -
+		      start.tv_nsec;
+		/* there is always something the mover can do */
+		assert(client->status == CLIENT_READY);
+
+		/* mover is done, replace its work */
+		cds_list_for_each_entry_safe(han, next, &client->active_requests,
+					     node)
+		{
+			uint32_t archive_id = han->info.archive_id;
+
+			assert(accept_archive_id(archives, archive_id));
+			hsm_action_free(han);
+			new_archive(archive_id);
+			sent++;
+		}
+		client->current_archive = 0;
+	}
+
+	printf("%10zu depth %-4s %8.1f ns/action %8.1f us/recv\n", depth, what,
+	       (double)ns / sent, (double)ns / RECVS / 1000);
+
+	hsm_action_free_all();
+	hsm_action_queues_free(&state->queues);
+	hsm_action_queues_init(&state->queues);
+	state->stats.pending_archive = 0;
+	state->stats.running_archive = 0;
+	/* not ours to free */
+	client->archives = NULL;
+	client_free(client);
+}
+
+int main(int argc, char *argv[])
+{
+	/* mover only serving the last archive id, behind all the others */
+	int archives[] = { ARCHIVE_IDS, 0 };
+	size_t depth = 1000000;
+	int i = 1;
+
+	test_state_init();
+
+	do {
+		if (argc > 1) {
+			long val = parse_int(argv[i], LONG_MAX, "depth");
+
+			/* need some work for each archive id */
+			assert(val >= ARCHIVE_IDS);
+			depth = val;
+		}
+		run(depth, NULL, "all");
+		run(depth, archives, "one");
+	} while (++i < argc);
+
+	test_state_free();
+	return 0;
+}
@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Weighted fair share between tenants: a heavy tenant queues its archives
+ * first, then two others queue theirs. While all have work waiting, a
+ * mover must get requests from each in proportion to their weights
+ * rather than drain the oldest ones first. */
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "daemon_helper.h"
+
+#define PER_TENANT 1000
+#define RECV_MAX_BYTES 4096
+
+/* same timestamp for all: arrival order decides age */
+static struct hsm_action_node *new_archive(const char *data)
+{
+	struct hsm_action_node *han = test_action_new(HSMA_ARCHIVE, 1, data,
+						      0, 1);
+
+	assert(han);
+	return han;
+}
+
+static size_t count_tenants(void)
+{
+	struct tenant *tenant;
+	size_t count = 0;
+
+	cds_list_for_each_entry(tenant, &state->tenants, node)
+		count++;
+	return count;
+}
+
+static struct tenant *find_tenant(const char *name)
+{
+	struct tenant *tenant;
+
+	cds_list_for_each_entry(tenant, &state->tenants, node)
+	{
+		if (!strcmp(tenant->name, name))
+			return tenant;
+	}
+	abort();
+}
+
+static void add_weight(const char *tenant, unsigned int weight)
+{
+	struct fair_share_weight *entry = xmalloc(sizeof(*entry));
+
+	entry->tenant = xstrdup(tenant);
+	entry->weight = weight;
+	cds_list_add(&entry->node, &state->config.fair_share_weights);
+}
+
+/* rounds are 1 + 3 + 1 requests, the last one can be cut short */
+static void check_share(struct tenant *tenant, unsigned long total)
+{
+	unsigned long expected = total * tenant->weight / 5;
+
+	assert(tenant->served + 3 >= expected);
+	assert(tenant->served <= expected + 3);
+}
+
+int main(void)
+{
+	struct tenant *heavy, *alice, *bob;
+	struct hsm_action_node *han;
+	struct client *client;
+	unsigned long total;
+	size_t subqueues;
+	char data[32];
+	int i;
+
+	test_state_init();
+	state->config.fair_share_hint = xstrdup("user=");
+	add_weight("alice", 3);
+
+	for (i = 0; i < PER_TENANT; i++)
+		new_archive("user=heavy");
+	for (i = 0; i < PER_TENANT; i++) {
+		new_archive("tag=1,user=alice");
+		new_archive("nouser");
+	}
+	heavy = find_tenant("heavy");
+	alice = find_tenant("alice");
+	bob = find_tenant("");
+	assert(heavy->weight == 1 && alice->weight == 3 && bob->weight == 1);
+	assert(heavy->waiting == PER_TENANT && alice->waiting == PER_TENANT);
+
+	client = test_client_new("mover");
+	client->max_bytes = RECV_MAX_BYTES;
+
+	while (heavy->served + alice->served + bob->served < PER_TENANT) {
+		test_client_recv(client);
+		test_client_done(client);
+	}
+
+	total = heavy->served + alice->served + bob->served;
+	printf("served heavy %lu alice %lu other %lu\n", heavy->served,
+	       alice->served, bob->served);
+	check_share(heavy, total);
+	check_share(alice, total);
+	check_share(bob, total);
+	assert(heavy->waiting + heavy->served == PER_TENANT);
+
+	/* one-off tenants go away with their request once the subqueue
+	 * each got is reused by the next one */
+	subqueues = state->subqueues.count;
+	for (i = 0; i < PER_TENANT; i++) {
+		snprintf(data, sizeof(data), "user=job%d", i);
+		han = new_archive(data);
+		assert(han && han->tenant->refcount == 2);
+		hsm_action_free(han);
+	}
+	printf("subqueues %zu, after %d one-off tenants %zu\n", subqueues,
+	       PER_TENANT, state->subqueues.count);
+	assert(state->subqueues.count <= subqueues + 1);
+	/* the last one stays referenced by its empty subqueue */
+	assert(count_tenants() <= 4);
+
+	test_state_free();
+	return 0;
+}
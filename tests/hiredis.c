@@ -19,6 +19,10 @@ struct hsm_action_node *hsm_action_search(unsigned long cookie UNUSED,
 {
 	return NULL;
 }
+struct client *find_client(const char *id UNUSED, bool disconnected UNUSED)
+{
+	return NULL;
+}
 struct client *client_new_disconnected(const char *id UNUSED)
 {
 	return NULL;
@@ -28,6 +32,10 @@ void hsm_action_start(struct hsm_action_node *han UNUSED,
 {
 	return;
 }
+json_t *hsm_action_json(struct hsm_action_node *han UNUSED)
+{
+	return NULL;
+}
 
 /* copy from copytool/coordinatool.c */
 int epoll_addfd(int epoll_fd, int fd, void *data)
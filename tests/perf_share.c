@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Throughput feedback: completions feed per mover moving averages of
+ * latency and throughput. Then a mover three times slower than the other
+ * works through what it gets one request at a time, in rounds of new
+ * requests: its completion rate must come out three times lower whatever
+ * it has waiting on its side, and each mover must get its part of the
+ * waiting requests in that proportion. */
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "daemon_helper.h"
+
+#define COUNT 40
+#define SIZE (1024 * 1024)
+#define ROUNDS 20
+/* time each mover takes per request */
+#define FAST_NS NS_IN_SEC
+#define SLOW_NS (3 * NS_IN_SEC)
+
+static void new_archives(int count)
+{
+	struct hsm_action_node *han;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		han = test_action_new(HSMA_ARCHIVE, 1, NULL, SIZE, 0);
+		assert(han);
+	}
+}
+
+static int client_recv(struct client *client)
+{
+	int count = client->current_archive;
+
+	test_client_recv(client);
+	return client->current_archive - count;
+}
+
+/* client completes one request that took that long */
+static void client_done_after(struct client *client, int64_t ns)
+{
+	struct hsm_action_node *han;
+	int sent;
+
+	new_archives(1);
+	sent = client_recv(client);
+	assert(sent == 1);
+	han = caa_container_of(client->active_requests.prev,
+			       struct hsm_action_node, node);
+	client_perf_done(client, han, han->sent_ns + ns);
+	hsm_action_free(han);
+	client->current_archive--;
+}
+
+/* client got everything at now and works through it in order, one
+ * request every ns: returns when it is done */
+static int64_t client_work(struct client *client, int64_t now, int64_t ns)
+{
+	struct hsm_action_node *han, *next;
+
+	cds_list_for_each_entry(han, &client->active_requests, node)
+		han->sent_ns = now;
+	cds_list_for_each_entry_safe(han, next, &client->active_requests, node)
+	{
+		now += ns;
+		client_perf_done(client, han, now);
+		hsm_action_free(han);
+		client->current_archive--;
+	}
+	return now;
+}
+
+/* first client to ask gets its part of the pending requests, give or
+ * take rounding, plus one as with even splits */
+static void check_share(struct client *client, unsigned int part,
+			unsigned int parts)
+{
+	unsigned int pending = state->stats.pending_archive;
+	unsigned int expected = pending * part / parts + 1;
+	int sent = client_recv(client);
+
+	assert(sent + 1 >= (int)expected && sent <= (int)expected);
+}
+
+int main(void)
+{
+	struct client *fast, *slow;
+	int64_t now, end_fast, end_slow;
+	double ratio;
+	int round;
+
+	test_state_init();
+	fast = test_client_new("fast");
+	slow = test_client_new("slow");
+
+	/* first sample is taken as is, then averaged in */
+	client_done_after(fast, 2 * NS_IN_SEC);
+	assert(fast->perf_archive.latency_ns >= 2 * NS_IN_SEC);
+	assert(fast->perf_archive.throughput == SIZE / 2);
+	client_done_after(fast, 10 * NS_IN_SEC);
+	assert(fast->perf_archive.latency_ns >= 3 * NS_IN_SEC);
+	assert(fast->perf_archive.latency_ns < 3 * NS_IN_SEC + NS_IN_SEC / 10);
+	memset(&fast->perf_archive, 0, sizeof(fast->perf_archive));
+
+	/* both ask for work once done with what they got, whoever asks
+	 * first alternates. Rates are known after a couple of rounds */
+	now = gettime_ns();
+	for (round = 0; round < ROUNDS; round++) {
+		struct client *first = round % 2 ? fast : slow;
+
+		new_archives(COUNT);
+		if (round < 2)
+			client_recv(first);
+		else
+			check_share(first, first == fast ? 3 : 1, 4);
+		client_recv(first == fast ? slow : fast);
+		end_fast = client_work(fast, now, FAST_NS);
+		end_slow = client_work(slow, now, SLOW_NS);
+		now = (end_fast > end_slow ? end_fast : end_slow) + NS_IN_SEC;
+	}
+	ratio = fast->perf_archive.done_rate / slow->perf_archive.done_rate;
+	printf("done per hour fast %.0f slow %.0f (latency %llds, %llds)\n",
+	       fast->perf_archive.done_rate * 3600,
+	       slow->perf_archive.done_rate * 3600,
+	       fast->perf_archive.latency_ns / NS_IN_SEC,
+	       slow->perf_archive.latency_ns / NS_IN_SEC);
+	assert(ratio > 2.9 && ratio < 3.1);
+
+	test_state_free();
+	return 0;
+}
@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Priority classes: requests queued in the wrong order are sent highest
+ * class first whatever their action type, with classes from the priority
+ * hint, a rule or the action type defaults, and old enough requests
+ * raised by aging. Queue positions reported before sending must match.
+ * Each request data carries the class it must be sent in as exp=<class>. */
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "daemon_helper.h"
+
+#define PER_CLASS 5
+#define HOUR_NS (3600 * NS_IN_SEC)
+
+static void new_actions(enum hsm_copytool_action action, const char *data,
+			int64_t timestamp)
+{
+	struct hsm_action_node *han;
+	int i;
+
+	for (i = 0; i < PER_CLASS; i++) {
+		han = test_action_new(action, 1, data, 0, timestamp);
+		assert(han);
+	}
+}
+
+static int exp_class(struct hsm_action_node *han)
+{
+	size_t len;
+	const char *exp = parse_hint(han, "exp=", &len);
+
+	assert(exp);
+	return exp[0] - '0';
+}
+
+/* queue positions count everything of a higher class first, then what is
+ * older in the same class */
+static void check_positions(struct hsm_action_queue *queue)
+{
+	struct hsm_action_subqueue *sq, *other;
+	struct hsm_action_node *han, *cur;
+
+	cds_list_for_each_entry(sq, &queue->subqueues, node)
+	{
+		cds_list_for_each_entry(han, &sq->actions, node)
+		{
+			size_t higher = 0, same = 0, pos;
+
+			cds_list_for_each_entry(other, &queue->subqueues, node)
+			{
+				cds_list_for_each_entry(cur, &other->actions,
+							node)
+				{
+					if (exp_class(cur) > exp_class(han))
+						higher++;
+					else if (exp_class(cur) ==
+							 exp_class(han) &&
+						 hsm_action_older(cur, han))
+						same++;
+				}
+			}
+			pos = hsm_action_queue_position(han);
+			assert(pos == higher + same + 1);
+		}
+	}
+}
+
+static void add_rule(enum hsm_copytool_action action, const char *pattern,
+		     int priority)
+{
+	struct priority_rule *rule = xcalloc(1, sizeof(*rule));
+
+	rule->action = action;
+	rule->pattern = xstrdup(pattern);
+	rule->priority = priority;
+	cds_list_add_tail(&rule->node, &state->config.priority_rules);
+}
+
+int main(void)
+{
+	unsigned int expected[PRIORITY_CLASSES] = {
+		2 * PER_CLASS, PER_CLASS, PER_CLASS, 0, PER_CLASS, PER_CLASS,
+	};
+	struct hsm_action_node *han, *next;
+	int64_t now = gettime_ns();
+	struct client *client;
+	int i, last = PRIORITY_MAX, sent = 0;
+
+	test_state_init();
+	state->config.priority_hint = xstrdup("prio=");
+	state->config.priority_aging_ns = HOUR_NS;
+	add_rule(HSMA_RESTORE, "bulk", 1);
+
+	new_actions(HSMA_ARCHIVE, "exp=0", now);
+	new_actions(HSMA_RESTORE, "bulk,exp=1", now);
+	new_actions(HSMA_REMOVE, "exp=2", now);
+	new_actions(HSMA_RESTORE, "exp=4", now);
+	/* hint wins over rules */
+	new_actions(HSMA_RESTORE, "bulk,prio=5,exp=5", now);
+	/* waited 10 classes worth: as high as it goes */
+	new_actions(HSMA_ARCHIVE, "exp=7", now - 10 * HOUR_NS);
+	/* invalid hints are ignored */
+	new_actions(HSMA_ARCHIVE, "prio=8,exp=0", now);
+	expected[0] += PER_CLASS;
+	for (i = 0; i < PRIORITY_CLASSES; i++)
+		assert(state->stats.pending_priority[i] == expected[i]);
+	check_positions(&state->queues.waiting_restore);
+	check_positions(&state->queues.waiting_archive);
+
+	client = test_client_new("mover");
+	test_client_recv(client);
+
+	/* started in the order they were sent */
+	cds_list_for_each_entry_safe(han, next, &client->active_requests, node)
+	{
+		size_t len;
+		const char *exp = parse_hint(han, "exp=", &len);
+
+		assert(exp);
+		assert(exp[0] - '0' <= last);
+		last = exp[0] - '0';
+		sent++;
+		hsm_action_free(han);
+	}
+	assert(sent == 7 * PER_CLASS);
+	for (i = 0; i < PRIORITY_CLASSES; i++)
+		assert(state->stats.pending_priority[i] == 0);
+
+	test_state_free();
+	return 0;
+}
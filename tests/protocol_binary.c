@@ -0,0 +1,326 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "utils.h"
+
+static int count_cb(struct hsm_action_list *hal UNUSED,
+		    struct hsm_action_item *hai UNUSED, size_t data_len,
+		    void *arg)
+{
+	size_t *total = arg;
+
+	*total += data_len;
+	return 0;
+}
+
+static void test_hal(void)
+{
+	struct protocol_bin_buf bin = { 0 };
+	struct hsm_action_item *hai, *orig;
+	struct hsm_action_list *hal;
+	size_t hal_len = 4096, total = 0;
+	uint32_t len;
+	int rc;
+
+	orig = hai = xcalloc(sizeof(*hai) + 16, 1);
+	hai->hai_action = HSMA_ARCHIVE;
+	hai->hai_fid.f_seq = 0x4200000000L;
+	hai->hai_fid.f_oid = 1;
+	hai->hai_dfid.f_seq = 0x4200000001L;
+	hai->hai_extent.offset = 1;
+	hai->hai_extent.length = 0x100000000L;
+	hai->hai_cookie = 0x123412341234L;
+	memcpy(hai->hai_data, "test\0test\0", 10);
+
+	protocol_bin_init(&bin, RECV);
+	protocol_bin_put_u32(&bin, HAL_VERSION);
+	protocol_bin_put_u32(&bin, 2);
+	protocol_bin_put_u64(&bin, 0);
+	protocol_bin_put_u32(&bin, 2);
+	protocol_bin_put_u32(&bin, 6);
+	protocol_bin_put_bytes(&bin, "testfs", 6);
+	protocol_bin_put_hai(&bin, hai, hai->hai_data, 10);
+	hai->hai_cookie++;
+	protocol_bin_put_hai(&bin, hai, hai->hai_data, 5);
+	protocol_bin_finish(&bin);
+
+	assert((unsigned char)bin.data[0] == PROTOCOL_BINARY_MAGIC);
+	assert(bin.data[1] == RECV);
+	memcpy(&len, bin.data + 4, sizeof(len));
+	assert(le32toh(len) == bin.len - PROTOCOL_BINARY_HEADER_SIZE);
+
+	hal = xcalloc(hal_len, 1);
+	rc = protocol_bin_hal_get(bin.data + PROTOCOL_BINARY_HEADER_SIZE,
+				  bin.len - PROTOCOL_BINARY_HEADER_SIZE, hal,
+				  hal_len, count_cb, &total);
+	assert(rc > 0);
+	assert(total == 15);
+	assert(hal->hal_count == 2);
+	assert(hal->hal_archive_id == 2);
+	assert(strcmp(hal->hal_fsname, "testfs") == 0);
+
+	hai = hai_first(hal);
+	assert(hai->hai_action == HSMA_ARCHIVE);
+	assert(hai->hai_cookie == 0x123412341234L);
+	assert(hai->hai_extent.length == 0x100000000L);
+	assert(hai->hai_len == sizeof(*hai) + 16);
+	assert(memcmp(hai->hai_data, "test\0test\0", 10) == 0);
+	hai = hai_next(hai);
+	assert(hai->hai_cookie == 0x123412341235L);
+	assert(hai->hai_len == sizeof(*hai) + 8);
+	assert((uintptr_t)hai + hai->hai_len - (uintptr_t)hal == (size_t)rc);
+
+	/* truncated payload */
+	rc = protocol_bin_hal_get(bin.data + PROTOCOL_BINARY_HEADER_SIZE,
+				  bin.len - PROTOCOL_BINARY_HEADER_SIZE - 1, hal,
+				  hal_len, NULL, NULL);
+	assert(rc == -EINVAL);
+
+	/* buffer too small */
+	rc = protocol_bin_hal_get(bin.data + PROTOCOL_BINARY_HEADER_SIZE,
+				  bin.len - PROTOCOL_BINARY_HEADER_SIZE, hal,
+				  sizeof(*hal) + 8 + sizeof(*hai), NULL, NULL);
+	assert(rc == -EOVERFLOW);
+
+	protocol_bin_free(&bin);
+	free(hal);
+	free(orig);
+}
+
+static void test_done(void)
+{
+	struct protocol_bin_buf bin = { 0 };
+	struct protocol_bin_reader reader = { 0 };
+	struct lu_fid fid = { 0x4200000000L, 1, 0 }, newfid;
+	uint64_t cookie;
+	uint32_t count;
+	int status, rc;
+
+	protocol_bin_init(&bin, DONE);
+	protocol_bin_put_u32(&bin, 2);
+	protocol_bin_put_done(&bin, 42, &fid, 0);
+	protocol_bin_put_done(&bin, 43, &fid, -ENOENT);
+	protocol_bin_finish(&bin);
+
+	reader.data = bin.data + PROTOCOL_BINARY_HEADER_SIZE;
+	reader.len = bin.len - PROTOCOL_BINARY_HEADER_SIZE;
+	count = protocol_bin_get_u32(&reader);
+	assert(count == 2);
+	rc = protocol_bin_get_done(&reader, &cookie, &newfid, &status);
+	assert(rc == 0);
+	assert(cookie == 42 && status == 0);
+	assert(memcmp(&fid, &newfid, sizeof(fid)) == 0);
+	rc = protocol_bin_get_done(&reader, &cookie, &newfid, &status);
+	assert(rc == 0);
+	assert(cookie == 43 && status == -ENOENT);
+	rc = protocol_bin_get_done(&reader, &cookie, &newfid, &status);
+	assert(rc == -EINVAL);
+
+	protocol_bin_free(&bin);
+}
+
+static int done_count_cb(void *fd_arg UNUSED, const char *payload UNUSED,
+			 size_t len UNUSED, void *arg)
+{
+	int *count = arg;
+
+	(*count)++;
+	return 0;
+}
+
+static protocol_read_bin_cb done_count_cbs[PROTOCOL_COMMANDS_MAX] = {
+	[DONE] = done_count_cb,
+};
+
+/* queue count single item DONE messages */
+static void put_dones(struct protocol_write_buffer *wbuf, int count)
+{
+	struct protocol_bin_buf bin = { 0 };
+	struct lu_fid fid = { 0x4200000000L, 1, 0 };
+
+	for (int i = 0; i < count; i++) {
+		protocol_bin_init(&bin, DONE);
+		protocol_bin_put_u32(&bin, 1);
+		protocol_bin_put_done(&bin, i, &fid, 0);
+		protocol_bin_finish(&bin);
+		protocol_write_buffered_raw(wbuf, bin.data, bin.len);
+	}
+	protocol_bin_free(&bin);
+}
+
+static void test_compress(void)
+{
+	struct protocol_write_buffer wbuf = { 0 }, out = { 0 };
+	struct protocol_read_buffer rbuf = { 0 };
+	size_t before;
+	int fds[2], count = 0, rc;
+
+	rc = pipe(fds);
+	assert(rc == 0);
+	put_dones(&wbuf, 200);
+
+	/* below threshold: left alone */
+	before = wbuf.pending;
+	rc = protocol_write_buffer_compress(&wbuf, before + 1);
+	assert(rc == 0 && wbuf.pending == before);
+
+	rc = protocol_write_buffer_compress(&wbuf, 1024);
+	assert(rc == 0 && wbuf.pending < before / 2);
+
+	protocol_write_buffer_splice(&out, &wbuf);
+	assert(wbuf.pending == 0);
+	rc = protocol_write_flush(fds[1], "test", &out);
+	assert(rc == 0);
+	close(fds[1]);
+
+	while ((rc = protocol_read_buffered(fds[0], "test", &rbuf, NULL, NULL,
+					    done_count_cbs, &count)) == 0)
+		;
+	assert(rc == -ECONNRESET);
+	assert(count == 200);
+
+	close(fds[0]);
+	protocol_read_buffer_free(&rbuf);
+	protocol_write_buffer_free(&wbuf);
+	protocol_write_buffer_free(&out);
+}
+
+/* send wbuf through a pipe and get its bytes back */
+static size_t write_buffer_bytes(struct protocol_write_buffer *wbuf,
+				 char *buf, size_t size)
+{
+	size_t len = wbuf->pending;
+	int fds[2], rc;
+
+	assert(len <= size);
+	rc = pipe(fds);
+	assert(rc == 0);
+	rc = protocol_write_flush(fds[1], "test", wbuf);
+	assert(rc == 0);
+	rc = read(fds[0], buf, size);
+	assert(rc == (int)len);
+	close(fds[0]);
+	close(fds[1]);
+	return len;
+}
+
+/* read all of buf as a peer would send it, return the first error */
+static int read_bytes(const char *buf, size_t len, bool reject_compressed,
+		      int *count)
+{
+	struct protocol_read_buffer rbuf = {
+		.reject_compressed = reject_compressed,
+	};
+	int fds[2], rc;
+
+	rc = pipe(fds);
+	assert(rc == 0);
+	rc = write(fds[1], buf, len);
+	assert(rc == (int)len);
+	close(fds[1]);
+	while ((rc = protocol_read_buffered(fds[0], "test", &rbuf, NULL, NULL,
+					    done_count_cbs, count)) == 0)
+		;
+	close(fds[0]);
+	protocol_read_buffer_free(&rbuf);
+	return rc;
+}
+
+/* compressed messages that must be refused before inflating them */
+static void test_compress_refused(void)
+{
+	struct protocol_write_buffer wbuf = { 0 };
+	char frame[4096], nested[8192];
+	size_t frame_len, nested_len;
+	uint32_t size;
+	int count = 0, rc;
+
+	put_dones(&wbuf, 200);
+	rc = protocol_write_buffer_compress(&wbuf, 1024);
+	assert(rc == 0);
+	frame_len = write_buffer_bytes(&wbuf, frame, sizeof(frame));
+	assert((unsigned char)frame[0] == PROTOCOL_COMPRESSED_MAGIC);
+
+	rc = read_bytes(frame, frame_len, false, &count);
+	assert(rc == -ECONNRESET && count == 200);
+
+	/* compression not negotiated */
+	count = 0;
+	rc = read_bytes(frame, frame_len, true, &count);
+	assert(rc == -EPROTO && count == 0);
+
+	/* compressed message inside compressed data */
+	protocol_write_buffered_raw(&wbuf, frame, frame_len);
+	put_dones(&wbuf, 200);
+	rc = protocol_write_buffer_compress(&wbuf, 1024);
+	assert(rc == 0);
+	nested_len = write_buffer_bytes(&wbuf, nested, sizeof(nested));
+	assert((unsigned char)nested[0] == PROTOCOL_COMPRESSED_MAGIC);
+	rc = read_bytes(nested, nested_len, false, &count);
+	assert(rc == -EPROTO && count == 0);
+
+	/* small message claiming to inflate to much more than it can */
+	size = htole32(frame_len * 2000);
+	memcpy(frame + PROTOCOL_BINARY_HEADER_SIZE, &size, sizeof(size));
+	rc = read_bytes(frame, frame_len, false, &count);
+	assert(rc == -EMSGSIZE && count == 0);
+
+	protocol_write_buffer_free(&wbuf);
+}
+
+/* small messages built aside are copied after what is left to send and
+ * their chunk reused for the next one, rather than chaining a new chunk
+ * per message */
+static void test_splice(void)
+{
+	struct protocol_write_buffer msg = { 0 }, out = { 0 };
+	struct protocol_write_chunk *chunk;
+	char buf[16];
+	int fds[2], rc;
+
+	rc = pipe(fds);
+	assert(rc == 0);
+
+	protocol_write_buffered_raw(&msg, "one,", 4);
+	protocol_write_buffer_splice(&out, &msg);
+	assert(msg.head == NULL && msg.pending == 0);
+	rc = protocol_write_flush(fds[1], "test", &out);
+	assert(rc == 0 && out.pending == 0);
+
+	protocol_write_buffered_raw(&msg, "two,", 4);
+	chunk = msg.head;
+	protocol_write_buffer_splice(&out, &msg);
+	assert(out.head == out.tail && out.pending == 4);
+	assert(msg.head == NULL && msg.spare == chunk);
+
+	protocol_write_buffered_raw(&msg, "three", 5);
+	assert(msg.head == chunk);
+	protocol_write_buffer_splice(&out, &msg);
+	assert(out.head == out.tail && out.pending == 9);
+	rc = protocol_write_flush(fds[1], "test", &out);
+	assert(rc == 0 && out.pending == 0);
+
+	rc = read(fds[0], buf, sizeof(buf));
+	assert(rc == 13 && !memcmp(buf, "one,two,three", 13));
+
+	close(fds[0]);
+	close(fds[1]);
+	protocol_write_buffer_free(&msg);
+	protocol_write_buffer_free(&out);
+}
+
+int main(void)
+{
+	test_hal();
+	test_done();
+	test_compress();
+	test_compress_refused();
+	test_splice();
+
+	printf("ok\n");
+	return 0;
+}
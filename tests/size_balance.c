@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Size-aware dispatch: big and small archives are queued big first for
+ * two waiting movers. Each must end up with about the same bytes in
+ * flight rather than one getting all the big ones, and a mover's
+ * max_inflight_bytes must hold unless it has nothing in flight. */
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "daemon_helper.h"
+
+#define COUNT 10
+#define BIG (5ULL << 40)
+#define SMALL 1024ULL
+
+static void new_archives(uint64_t size)
+{
+	struct hsm_action_node *han;
+	int i;
+
+	for (i = 0; i < COUNT; i++) {
+		han = test_action_new(HSMA_ARCHIVE, 1, NULL, size, 0);
+		assert(han);
+	}
+}
+
+/* mover is done with everything */
+static void client_done(struct client *client)
+{
+	test_client_done(client);
+	assert(client->inflight_bytes == 0);
+}
+
+int main(void)
+{
+	struct client *a, *b;
+	uint64_t diff;
+
+	test_state_init();
+
+	new_archives(BIG);
+	new_archives(SMALL);
+	assert(state->stats.pending_bytes == COUNT * (BIG + SMALL));
+
+	a = test_client_new("a");
+	b = test_client_new("b");
+	test_client_wait(a);
+	test_client_wait(b);
+	ct_schedule(false);
+	assert(a->status == CLIENT_READY && b->status == CLIENT_READY);
+
+	printf("in flight a %lu b %lu\n", a->inflight_bytes, b->inflight_bytes);
+	diff = a->inflight_bytes > b->inflight_bytes ?
+		       a->inflight_bytes - b->inflight_bytes :
+		       b->inflight_bytes - a->inflight_bytes;
+	assert(diff <= BIG);
+	assert(state->stats.running_bytes ==
+	       a->inflight_bytes + b->inflight_bytes);
+	assert(state->stats.running_bytes + state->stats.pending_bytes ==
+	       COUNT * (BIG + SMALL));
+
+	client_done(a);
+	client_done(b);
+	hsm_action_free_all();
+	hsm_action_queues_free(&state->queues);
+	hsm_action_queues_init(&state->queues);
+	state->stats.pending_archive = 0;
+	state->stats.running_archive = 0;
+	state->stats.pending_bytes = 0;
+
+	/* alone, a takes what fits in its limit */
+	cds_list_del(&b->node_clients);
+	state->stats.clients_connected--;
+	new_archives(BIG);
+	a->max_inflight_bytes = 2 * BIG + BIG / 2;
+	test_client_recv(a);
+	assert(a->current_archive == 2 && a->inflight_bytes == 2 * BIG);
+	client_done(a);
+
+	/* .. but always gets one, however big */
+	a->max_inflight_bytes = SMALL;
+	test_client_recv(a);
+	assert(a->current_archive == 1 && a->inflight_bytes == BIG);
+	client_done(a);
+
+	cds_list_add(&b->node_clients, &state->stats.clients);
+	test_state_free();
+	return 0;
+}
@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Slab pools: objects spread over several slabs and handed back, empty
+ * slabs unmapped but one kept aside, blob size classes around the largest
+ * pool and the malloc fallback past it, with the pool counters status
+ * reports checked all along. */
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "coordinatool.h"
+
+/* rounded up to 112 */
+#define OBJ_SIZE 100
+#define SLABS 3
+
+static struct slab_pool test_pool = SLAB_POOL_INIT("test", OBJ_SIZE);
+
+static uintptr_t slab_of(void *obj)
+{
+	return (uintptr_t)obj & ~(uintptr_t)(SLAB_SIZE - 1);
+}
+
+static struct slab_pool *find_pool(const char *name)
+{
+	struct slab_pool *pool;
+
+	cds_list_for_each_entry(pool, &slab_pools, node)
+	{
+		if (!strcmp(pool->name, name))
+			return pool;
+	}
+	return NULL;
+}
+
+static void check_zero(const char *obj, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		assert(obj[i] == 0);
+}
+
+static void test_pool_slabs(void)
+{
+	unsigned int per_slab, count, i;
+	char **objs;
+	char *obj;
+
+	obj = slab_alloc(&test_pool);
+	per_slab = test_pool.objs_per_slab;
+	assert(test_pool.obj_size == 112 && per_slab > 1);
+	assert(find_pool("test") == &test_pool);
+	slab_free(obj);
+
+	/* fill SLABS - 1 slabs and start the last one */
+	count = (SLABS - 1) * per_slab + 1;
+	objs = xcalloc(count, sizeof(*objs));
+	for (i = 0; i < count; i++) {
+		objs[i] = slab_alloc(&test_pool);
+		assert((uintptr_t)objs[i] % 16 == 0);
+		check_zero(objs[i], test_pool.obj_size);
+		memset(objs[i], 0xa5, test_pool.obj_size);
+		/* in order within a slab, a new slab once one is full */
+		if (i % per_slab)
+			assert(objs[i] == objs[i - 1] + test_pool.obj_size);
+		else if (i)
+			assert(slab_of(objs[i]) != slab_of(objs[i - 1]));
+	}
+	assert(test_pool.slabs == SLABS && test_pool.in_use == count);
+	assert(slab_of(objs[count - 1]) != slab_of(objs[count - 2]));
+
+	/* a full slab takes frees, and gives the last one back zeroed */
+	slab_free(objs[1]);
+	assert(test_pool.in_use == count - 1);
+	obj = slab_alloc(&test_pool);
+	assert(obj == objs[1]);
+	check_zero(obj, test_pool.obj_size);
+
+	/* first slab empties: kept aside, still mapped */
+	for (i = 0; i < per_slab; i++)
+		slab_free(objs[i]);
+	assert(test_pool.slabs == SLABS);
+	assert((uintptr_t)test_pool.empty == slab_of(objs[0]));
+
+	/* second one too: the first is unmapped, the second kept */
+	for (i = per_slab; i < 2 * per_slab; i++)
+		slab_free(objs[i]);
+	assert(test_pool.slabs == SLABS - 1);
+	assert((uintptr_t)test_pool.empty == slab_of(objs[per_slab]));
+	assert(test_pool.in_use == 1);
+
+	/* the partial slab is used before the spare */
+	obj = slab_alloc(&test_pool);
+	assert(slab_of(obj) == slab_of(objs[count - 1]));
+	assert(test_pool.slabs == SLABS - 1);
+	slab_free(obj);
+
+	/* last one empties: only one spare is kept */
+	slab_free(objs[count - 1]);
+	assert(test_pool.slabs == 1 && test_pool.in_use == 0);
+	assert((uintptr_t)test_pool.empty == slab_of(objs[count - 1]));
+
+	/* and is reused without mapping a new slab */
+	obj = slab_alloc(&test_pool);
+	assert(slab_of(obj) == slab_of(objs[count - 1]));
+	assert(test_pool.slabs == 1 && !test_pool.empty);
+	check_zero(obj, test_pool.obj_size);
+	slab_free(obj);
+	slab_free(NULL);
+	assert(test_pool.in_use == 0);
+
+	free(objs);
+	printf("%u objects of %zu bytes per slab\n", per_slab,
+	       test_pool.obj_size);
+}
+
+/* allocates size and checks which pool it came from, NULL for malloc */
+static void check_blob(size_t size, const char *pool_name)
+{
+	struct slab_pool *pool = pool_name ? find_pool(pool_name) : NULL;
+	size_t in_use = pool ? pool->in_use : 0;
+	char *blob = slab_blob_alloc(size);
+
+	/* pool is only registered once it allocated */
+	if (pool_name && !pool) {
+		pool = find_pool(pool_name);
+		assert(pool);
+	}
+	if (pool) {
+		assert(pool->in_use == in_use + 1);
+		assert(pool->obj_size >= size);
+		assert(slab_of(blob) == slab_of(blob + size - 1));
+	}
+	memset(blob, 0x5a, size);
+	slab_blob_free(blob, size);
+	if (pool)
+		assert(pool->in_use == in_use);
+}
+
+static void test_blob_sizes(void)
+{
+	struct slab_pool *pool;
+
+	check_blob(1, "blob16");
+	check_blob(16, "blob16");
+	check_blob(17, "blob32");
+	check_blob(512, "blob512");
+	check_blob(513, "blob1024");
+	check_blob(1024, "blob1024");
+	check_blob(1025, NULL);
+	check_blob(SLAB_SIZE, NULL);
+
+	/* nothing left in any pool, spares only */
+	cds_list_for_each_entry(pool, &slab_pools, node)
+	{
+		assert(pool->in_use == 0);
+		assert(pool->slabs == 1 && pool->empty);
+	}
+}
+
+int main(void)
+{
+	test_pool_slabs();
+	test_blob_sizes();
+	printf("ok\n");
+	return 0;
+}
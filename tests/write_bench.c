@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+
+/* Compare bytes copied per recv reply made of pre-encoded items, either
+ * copying the items into the write buffer or handing their buffer over.
+ * This mimics what the server does rather than going through
+ * protocol_reply_recv(): items are first copied one by one into a buffer
+ * as when they are appended to the reply, and that copy is counted too.
+ * Writes to /dev/null, so this measures our overhead only. */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "utils.h"
+
+#define REQUESTS 10000
+#define ITEMS 100
+
+static const char header[] =
+	"{\"command\":\"recv\",\"status\":0,\"hsm_action_list\":{"
+	"\"hal_version\":1,\"hal_archive_id\":1,\"hal_flags\":0,"
+	"\"hal_fsname\":\"testfs\",\"list\":[";
+static const char item[] =
+	"{\"hai_action\":3,\"hai_fid\":{\"f_seq\":8589934593,\"f_oid\":1,"
+	"\"f_ver\":0},\"hai_dfid\":{\"f_seq\":8589934593,\"f_oid\":1,"
+	"\"f_ver\":0},\"hai_extent_offset\":0,\"hai_extent_length\":-1,"
+	"\"hai_cookie\":1234,\"hai_gid\":0,\"hal_archive_id\":1,"
+	"\"hal_flags\":0,\"hai_data\":\"tag=foo\",\"timestamp\":1}";
+
+/* what the scheduler does: build items from cached encoded actions */
+static char *build_items(size_t *len)
+{
+	size_t item_len = strlen(item);
+	char *items = xmalloc(ITEMS * (item_len + 1));
+	char *p = items;
+
+	for (int i = 0; i < ITEMS; i++) {
+		if (i)
+			*p++ = ',';
+		memcpy(p, item, item_len);
+		p += item_len;
+	}
+	*len = p - items;
+	return items;
+}
+
+static void run(int fd, bool take)
+{
+	struct protocol_write_buffer wbuf = { 0 };
+	struct timespec start, end;
+	size_t items_len;
+	char *items;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < REQUESTS; i++) {
+		items = build_items(&items_len);
+		protocol_write_buffered_raw(&wbuf, header, strlen(header));
+		if (take) {
+			protocol_write_buffered_take(&wbuf, items, items_len);
+		} else {
+			protocol_write_buffered_raw(&wbuf, items, items_len);
+			free(items);
+		}
+		protocol_write_buffered_raw(&wbuf, "]}}", 3);
+		rc = protocol_write_flush(fd, "bench", &wbuf);
+		assert(rc == 0);
+		assert(wbuf.pending == 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* each item byte was copied once when building items */
+	printf("%s: %zu bytes copied per request (%zu building items, "
+	       "%zu in write buffer, %zu sent), %ld ns per request\n",
+	       take ? "take" : "copy", items_len + wbuf.copied / REQUESTS,
+	       items_len, wbuf.copied / REQUESTS,
+	       strlen(header) + items_len + 3,
+	       ((end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec -
+		start.tv_nsec) /
+		       REQUESTS);
+	protocol_write_buffer_free(&wbuf);
+}
+
+int main(void)
+{
+	int fd = open("/dev/null", O_WRONLY);
+
+	assert(fd >= 0);
+	run(fd, false);
+	run(fd, true);
+	close(fd);
+
+	return 0;
+}